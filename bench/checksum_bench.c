@@ -0,0 +1,71 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+/*
+ * Throughput of every checksum implementation the CPU supports at the
+ * sizes found in forged replies: the IP header alone and whole !1ECN
+ * datagrams. Their results are checked by "make check".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "checksum.h"
+
+#define MAX_LEN 2048
+#define ROUNDS 2000000
+
+static unsigned char data[MAX_LEN + 8];
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+int main() {
+    static const size_t sizes[] = { 20, 64, 100, 128, 1500 };
+    size_t count;
+    const ChecksumImpl *impls = checksum_impls(&count);
+    volatile uint16_t sink;
+
+    srandom(1);
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = random();
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (!impls[i].supported()) {
+            printf("%-9s not supported by this CPU\n", impls[i].name);
+            continue;
+        }
+        printf("%-9s", impls[i].name);
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int round = 0; round < ROUNDS; round++) {
+                sink = checksum_fold(impls[i].sum(data + (round & 6), sizes[s]));
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            printf("  %4zu B: %5.1f ns", sizes[s], elapsed_ns(&start, &end) / ROUNDS);
+        }
+        printf("\n");
+    }
+
+    printf("%-9s", "reference");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int round = 0; round < ROUNDS; round++) {
+            sink = checksum_reference(data + (round & 6), sizes[s]);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("  %4zu B: %5.1f ns", sizes[s], elapsed_ns(&start, &end) / ROUNDS);
+    }
+    printf("\n");
+
+    (void)sink;
+    return EXIT_SUCCESS;
+}
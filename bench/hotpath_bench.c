@@ -0,0 +1,397 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+/*
+ * Cost of each component of the packet hot path, called in-process with no
+ * socket involved: classification, device learning and refresh at several
+ * table sizes, expiry sweeps, checksums and reply header building.
+ * Every figure is per operation, or per device for sweeps: wall time, CPU
+ * cycles (from perf when the kernel allows it, the TSC otherwise) and heap
+ * calls. The allocator is counted through the linker's --wrap, see
+ * Makefile.am.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "types.h"
+#include "checksum.h"
+#include "device_table.h"
+#include "iscp.h"
+#include "metrics.h"
+#include "packet_processing.h"
+#include "rawpacket.h"
+
+#define CLASSIFY_ROUNDS 1000000
+#define TABLE_OPERATIONS 200000 // Per measurement, whatever the table size
+#define CHECKSUM_ROUNDS 2000000
+#define HEADER_ROUNDS 2000000
+
+// A typical !1ECN response, 16-byte ISCP header included
+static const char response[] = "ISCP\0\0\0\x10\0\0\0\x26\x01\0\0\0!1ECNTX-NR686/60128/DX/0009B0123456\x19\r\n";
+static const char query[] = "ISCP\0\0\0\x10\0\0\0\x0a\x01\0\0\0!xECNQSTN\n";
+static const char other[] = "ISCP\0\0\0\x10\0\0\0\x0a\x01\0\0\0!1PWRQSTN\n";
+static const char junk[] = "M-SEARCH * HTTP/1.1\r\n";
+
+static const size_t tableSizes[] = { 10, 100, 1000, 10000 };
+#define TABLE_SIZE_MAX 10000
+
+// Decoded responses, each device with its own identifier
+static EcnRecord records[TABLE_SIZE_MAX];
+
+// Heap calls made by the code under test
+static unsigned long allocations = 0, releases = 0;
+
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+void *__real_aligned_alloc(size_t, size_t);
+void __real_free(void *);
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    allocations++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+void *__wrap_aligned_alloc(size_t alignment, size_t size) {
+    allocations++;
+    return __real_aligned_alloc(alignment, size);
+}
+
+void __wrap_free(void *ptr) {
+    releases += ptr != NULL;
+    __real_free(ptr);
+}
+
+static int cyclesFd = -1;
+static const char *cyclesSource = "none";
+
+static void cycles_open() {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    cyclesFd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (cyclesFd >= 0) {
+        cyclesSource = "perf cpu-cycles";
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    cyclesSource = "TSC reference cycles";
+#endif
+}
+
+static uint64_t cycles_read() {
+    uint64_t value = 0;
+
+    if (cyclesFd >= 0) {
+        if (read(cyclesFd, &value, sizeof(value)) != sizeof(value)) {
+            value = 0;
+        }
+        return value;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    value = __rdtsc();
+#endif
+    return value;
+}
+
+// Cost accumulated over one measurement, possibly in several stretches
+typedef struct {
+    struct timespec start;
+    uint64_t cycles;
+    unsigned long allocations;
+    unsigned long releases;
+    double spentNs;
+    double spentCycles;
+    unsigned long spentAllocations;
+    unsigned long spentReleases;
+} Meter;
+
+static void meter_resume(Meter *meter) {
+    meter->allocations = allocations;
+    meter->releases = releases;
+    clock_gettime(CLOCK_MONOTONIC, &meter->start);
+    meter->cycles = cycles_read();
+}
+
+static void meter_start(Meter *meter) {
+    meter->spentNs = 0;
+    meter->spentCycles = 0;
+    meter->spentAllocations = 0;
+    meter->spentReleases = 0;
+    meter_resume(meter);
+}
+
+static void meter_pause(Meter *meter) {
+    uint64_t cycles = cycles_read();
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    meter->spentCycles += cycles - meter->cycles;
+    meter->spentNs += (end.tv_sec - meter->start.tv_sec) * 1e9 + (end.tv_nsec - meter->start.tv_nsec);
+    meter->spentAllocations += allocations - meter->allocations;
+    meter->spentReleases += releases - meter->releases;
+}
+
+static void meter_report(Meter *meter, const char *name, size_t size, double operations) {
+    char label[64];
+
+    if (size) {
+        snprintf(label, sizeof(label), "%s/%zu", name, size);
+    } else {
+        snprintf(label, sizeof(label), "%s", name);
+    }
+    printf("%-32s %9.1f %10.1f %9.3f %9.3f\n", label, meter->spentNs / operations, meter->spentCycles / operations,
+           meter->spentAllocations / operations, meter->spentReleases / operations);
+}
+
+// Distinct device addresses, as many as the largest table needs
+static void device_address(struct sockaddr_in *addr, size_t index) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(0x0A000000 | (uint32_t)(index + 1));
+    addr->sin_port = htons(PORT);
+}
+
+static void records_init() {
+    if (iscp_decode_response(response, sizeof(response) - 1, &records[0]) < 0) {
+        fprintf(stderr, "The sample response does not decode\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < TABLE_SIZE_MAX; i++) {
+        records[i] = records[0];
+        snprintf(records[i].identifier, sizeof(records[i].identifier), "0009B0%06zX", i);
+    }
+}
+
+static void table_clear(Environment *env) {
+    while (env->devices.head != NULL) {
+        DiscoveredDevice *device = env->devices.head;
+        device_table_remove(&env->devices, device);
+        device_free(device);
+    }
+}
+
+static void bench_classify(Environment *env) {
+    InterfaceNode interfaces[2];
+    struct sockaddr_in sender;
+    const char *packets[] = { query, response, other, junk };
+    const ssize_t lengths[] = { sizeof(query) - 1, sizeof(response) - 1, sizeof(other) - 1, sizeof(junk) - 1 };
+    unsigned long check = 0;
+    EcnRecord ecn;
+    Meter meter;
+
+    // Sources are compared against the address of every proxied interface
+    memset(interfaces, 0, sizeof(interfaces));
+    interfaces[0].address.sin_addr.s_addr = htonl(0xC0A80001);
+    interfaces[0].next = &interfaces[1];
+    interfaces[1].address.sin_addr.s_addr = htonl(0xC0A80101);
+    env->interfaces = interfaces;
+    device_address(&sender, 0);
+
+    meter_start(&meter);
+    for (int i = 0; i < CLASSIFY_ROUNDS; i++) {
+        check += classify_packet(&sender, packets[i & 3], lengths[i & 3], env, &ecn);
+    }
+    meter_pause(&meter);
+    meter_report(&meter, "classify_packet", 0, CLASSIFY_ROUNDS);
+
+    env->interfaces = NULL;
+    if (check != (unsigned long)CLASSIFY_ROUNDS / 4 * (PACKET_QUERY + PACKET_RESPONSE + 2 * PACKET_IGNORED)) {
+        fprintf(stderr, "classify_packet returned unexpected types\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// New devices showing up, until the table holds size of them
+static void bench_learn(Environment *env, size_t size) {
+    struct sockaddr_in source;
+    size_t rounds = TABLE_OPERATIONS / size + 1;
+    Meter meter;
+
+    meter_start(&meter);
+    for (size_t round = 0; round < rounds; round++) {
+        meter_resume(&meter);
+        for (size_t i = 0; i < size; i++) {
+            device_address(&source, i);
+            handle_discovery_response(&source, 1, env, response, sizeof(response) - 1, &records[i]);
+        }
+        // Only the learning is accounted for, not the teardown
+        meter_pause(&meter);
+        table_clear(env);
+    }
+    meter_report(&meter, "discovery_response_new", size, rounds * size);
+}
+
+// Devices already known answering again
+static void bench_refresh(Environment *env, size_t size) {
+    struct sockaddr_in source;
+    size_t operations = TABLE_OPERATIONS > size ? TABLE_OPERATIONS : size;
+    Meter meter;
+
+    for (size_t i = 0; i < size; i++) {
+        device_address(&source, i);
+        handle_discovery_response(&source, 1, env, response, sizeof(response) - 1, &records[i]);
+    }
+
+    meter_start(&meter);
+    for (size_t i = 0; i < operations; i++) {
+        device_address(&source, i % size);
+        handle_discovery_response(&source, 1, env, response, sizeof(response) - 1, &records[i % size]);
+    }
+    meter_pause(&meter);
+    meter_report(&meter, "discovery_response_refresh", size, operations);
+    table_clear(env);
+}
+
+// Sweeps finding size devices due, per expired device
+static void bench_expire(Environment *env, size_t size) {
+    struct sockaddr_in source;
+    size_t rounds = TABLE_OPERATIONS / size + 1;
+    Meter meter;
+
+    meter_start(&meter);
+    for (size_t round = 0; round < rounds; round++) {
+        uint64_t now = monotonic_ms();
+
+        // Wind the wheel back, so that deadlines just passed are still ahead of it
+        env->devices.wheelTick = now / DEVICE_WHEEL_TICK_MS - 2;
+        for (size_t i = 0; i < size; i++) {
+            DiscoveredDevice *device;
+
+            device_address(&source, i);
+            device = device_table_insert(&env->devices, &source, response, sizeof(response) - 1, &records[i], now);
+            device_table_touch(&env->devices, device, now - DEVICE_WHEEL_TICK_MS);
+        }
+
+        meter_resume(&meter);
+        remove_stale_devices(env);
+        meter_pause(&meter);
+        if (env->devices.count != 0) {
+            fprintf(stderr, "remove_stale_devices left %zu devices\n", env->devices.count);
+            exit(EXIT_FAILURE);
+        }
+    }
+    meter_report(&meter, "remove_stale_devices", size, rounds * size);
+}
+
+static void bench_checksum() {
+    RawHeader hdr;
+    struct sockaddr_in src, dst;
+    unsigned long check = 0;
+    Meter meter;
+
+    device_address(&src, 0);
+    device_address(&dst, 1);
+    build_raw_header(&hdr, &src, &dst, response, sizeof(response) - 1);
+
+    meter_start(&meter);
+    for (int i = 0; i < CHECKSUM_ROUNDS; i++) {
+        check += checksum(response, sizeof(response) - 1 - (i & 1));
+    }
+    meter_pause(&meter);
+    meter_report(&meter, "checksum(payload)", 0, CHECKSUM_ROUNDS);
+
+    meter_start(&meter);
+    for (int i = 0; i < CHECKSUM_ROUNDS; i++) {
+        hdr.ip.id = i;
+        check += checksum_ipv4_header(&hdr.ip);
+    }
+    meter_pause(&meter);
+    meter_report(&meter, "checksum_ipv4_header", 0, CHECKSUM_ROUNDS);
+
+    meter_start(&meter);
+    for (int i = 0; i < CHECKSUM_ROUNDS; i++) {
+        hdr.udp.source = i;
+        check += checksum_udp(&hdr.ip, &hdr.udp, response, sizeof(response) - 1);
+    }
+    meter_pause(&meter);
+    meter_report(&meter, "checksum_udp", 0, CHECKSUM_ROUNDS);
+
+    // Keeps the compiler from dropping the work
+    if (check == 0) {
+        printf("\n");
+    }
+}
+
+// What send_raw_udp_packet() does before handing the datagram to the kernel
+static void bench_header(int udpChecksum) {
+    RawHeader hdr;
+    struct sockaddr_in src, dst;
+    unsigned long check = 0;
+    Meter meter;
+
+    device_address(&src, 0);
+    device_address(&dst, 1);
+
+    meter_start(&meter);
+    for (int i = 0; i < HEADER_ROUNDS; i++) {
+        dst.sin_port = htons(1024 + (i & 0x3FFF));
+        build_raw_header(&hdr, &src, &dst, response, sizeof(response) - 1);
+        check += hdr.ip.check;
+    }
+    meter_pause(&meter);
+    meter_report(&meter, udpChecksum ? "build_raw_header(udp csum)" : "build_raw_header", 0, HEADER_ROUNDS);
+
+    if (check == 0) {
+        printf("\n");
+    }
+}
+
+int main() {
+    Environment env;
+
+    memset(&env, 0, sizeof(env));
+    device_table_init(&env.devices);
+    env.metrics = metrics_create();
+    env.timeout_interval = 30;
+    env.coalesce_window = 250;
+    cycles_open();
+    records_init();
+
+    printf("Cycles: %s\n", cyclesSource);
+    printf("%-32s %9s %10s %9s %9s\n", "operation", "ns/op", "cycles/op", "allocs/op", "frees/op");
+
+    bench_classify(&env);
+    for (size_t i = 0; i < sizeof(tableSizes) / sizeof(tableSizes[0]); i++) {
+        bench_learn(&env, tableSizes[i]);
+    }
+    for (size_t i = 0; i < sizeof(tableSizes) / sizeof(tableSizes[0]); i++) {
+        bench_refresh(&env, tableSizes[i]);
+    }
+    for (size_t i = 0; i < sizeof(tableSizes) / sizeof(tableSizes[0]); i++) {
+        bench_expire(&env, tableSizes[i]);
+    }
+    bench_checksum();
+    bench_header(0);
+    raw_enable_udp_checksum();
+    bench_header(1);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,361 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+/*
+ * Load generator for end-to-end benchmarks, run by bench/netbench.sh on
+ * both sides of the proxy:
+ *  - "devices" answers every !xECNQSTN with one !1ECN per simulated device,
+ *    each device sending from its own address of a local (AnyIP) range;
+ *  - "clients" issues queries from K addresses at a fixed rate, collects the
+ *    replies and prints a JSON report: completeness, latency, proxy CPU.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <sys/socket.h>
+
+#define PORT 60128
+#define ISCP_HEADER_SIZE 16
+#define MAX_SOCKETS 4096
+
+static const char query[] = "ISCP\0\0\0\x10\0\0\0\x0a\x01\0\0\0!xECNQSTN\n";
+
+static volatile sig_atomic_t stopping = 0;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s devices -b FIRST_ADDR -n COUNT [-I IFNAME]\n", prog);
+    fprintf(stderr, "       %s clients -b FIRST_ADDR -k COUNT -e EXPECTED [-r RATE] [-t SECONDS]\n", prog);
+    fprintf(stderr, "                  [-W WINDOW_MS] [-p PROXY_PID] [-I IFNAME]\n");
+    exit(EXIT_FAILURE);
+}
+
+static void handle_stop(int signo) {
+    (void)signo;
+    stopping = 1;
+}
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// One UDP socket bound to the index-th address after first, port 60128
+static int open_socket(struct in_addr first, int index, const char *ifname) {
+    struct sockaddr_in addr;
+    int optval = 1;
+    int bufsize = 1 << 20; // Room for a full reply burst to one client
+    int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+
+    if (sockfd < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0 ||
+        setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &optval, sizeof(optval)) < 0 ||
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &bufsize, sizeof(bufsize)) < 0) {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+    if (ifname != NULL && setsockopt(sockfd, SOL_SOCKET, SO_BINDTODEVICE, ifname, strlen(ifname)) < 0) {
+        perror("setsockopt SO_BINDTODEVICE");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    if (index < 0) {
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    } else {
+        addr.sin_addr.s_addr = htonl(ntohl(first.s_addr) + index);
+    }
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+    return sockfd;
+}
+
+// A !1ECN response as a real receiver would send it, with a unique MAC
+static size_t build_response(char *buf, size_t size, int index) {
+    static const char *models[] = { "TX-NR686", "TX-RZ50", "TX-NR7100", "PR-RZ5100", "CR-N775D", "NR6100" };
+    static const char *regions[] = { "DX", "XX", "JJ" };
+    size_t len;
+
+    len = snprintf(buf + ISCP_HEADER_SIZE, size - ISCP_HEADER_SIZE, "!1ECN%s/%d/%s/0009B0%06X\x19\r\n",
+                   models[index % 6], PORT, regions[index % 3], index);
+    memcpy(buf, "ISCP", 4);
+    buf[4] = 0; buf[5] = 0; buf[6] = 0; buf[7] = ISCP_HEADER_SIZE;
+    buf[8] = len >> 24; buf[9] = len >> 16; buf[10] = len >> 8; buf[11] = len;
+    buf[12] = 1; buf[13] = 0; buf[14] = 0; buf[15] = 0;
+    return ISCP_HEADER_SIZE + len;
+}
+
+static int run_devices(struct in_addr first, int count, const char *ifname) {
+    static int sockets[MAX_SOCKETS];
+    static char responses[MAX_SOCKETS][64];
+    static size_t lengths[MAX_SOCKETS];
+    int listener = open_socket(first, -1, ifname);
+    struct pollfd pfd = { .fd = listener, .events = POLLIN };
+    char buf[512];
+
+    for (int i = 0; i < count; i++) {
+        sockets[i] = open_socket(first, i, ifname);
+        lengths[i] = build_response(responses[i], sizeof(responses[i]), i);
+    }
+
+    while (!stopping) {
+        struct sockaddr_in source;
+        socklen_t sourceLen = sizeof(source);
+        ssize_t len;
+
+        if (poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+        len = recvfrom(listener, buf, sizeof(buf), 0, (struct sockaddr *)&source, &sourceLen);
+        if (len < ISCP_HEADER_SIZE + 9 || memcmp(buf + ISCP_HEADER_SIZE, "!xECNQSTN", 9) != 0) {
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            sendto(sockets[i], responses[i], lengths[i], 0, (struct sockaddr *)&source, sizeof(source));
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+// Query in flight on one client socket
+typedef struct {
+    double sentAt;
+    double nextAt;
+    double firstReply;
+    double lastReply;
+    int replies;
+    int outstanding;
+} ClientState;
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double *samples, size_t count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    return samples[(size_t)(p * (count - 1) + 0.5)];
+}
+
+// User plus system time of a process, in seconds
+static double process_cpu(pid_t pid) {
+    char path[64], buf[1024];
+    unsigned long utime, stime;
+    FILE *f;
+    char *p;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if ((f = fopen(path, "r")) == NULL) {
+        return 0;
+    }
+    p = fgets(buf, sizeof(buf), f);
+    fclose(f);
+    // Fields 14 and 15, counted after the parenthesised command name
+    if (p == NULL || (p = strrchr(buf, ')')) == NULL ||
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return 0;
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static int run_clients(struct in_addr first, int count, int expected, double rate, double seconds,
+                       double window, pid_t proxy, const char *ifname) {
+    static struct pollfd pfds[MAX_SOCKETS];
+    static ClientState clients[MAX_SOCKETS];
+    struct sockaddr_in broadcast;
+    double interval = 1000.0 / rate;
+    double start, end, cpuStart, cpuEnd, current;
+    size_t maxSamples = (size_t)(count * (seconds * rate + 2));
+    double *completion = malloc(maxSamples * sizeof(double));
+    double *firstReply = malloc(maxSamples * sizeof(double));
+    size_t samples = 0;
+    unsigned long queries = 0, replies = 0, complete = 0, unanswered = 0;
+
+    if (completion == NULL || firstReply == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&broadcast, 0, sizeof(broadcast));
+    broadcast.sin_family = AF_INET;
+    broadcast.sin_port = htons(PORT);
+    broadcast.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+
+    start = now_ms();
+    for (int i = 0; i < count; i++) {
+        pfds[i].fd = open_socket(first, i, ifname);
+        pfds[i].events = POLLIN;
+        memset(&clients[i], 0, sizeof(clients[i]));
+        // Spread the clients evenly over one interval
+        clients[i].nextAt = start + interval * i / count;
+    }
+    cpuStart = process_cpu(proxy);
+    end = start + seconds * 1000;
+
+    // Keep going one window past the end, so that the last queries complete
+    while (!stopping && (current = now_ms()) < end + window) {
+        double wake = end + window;
+
+        for (int i = 0; i < count; i++) {
+            ClientState *client = &clients[i];
+
+            if (client->outstanding && current >= client->sentAt + window) {
+                queries++;
+                replies += client->replies;
+                if (client->replies == 0) {
+                    unanswered++;
+                } else {
+                    complete += client->replies >= expected;
+                    completion[samples] = client->lastReply - client->sentAt;
+                    firstReply[samples] = client->firstReply - client->sentAt;
+                    samples++;
+                }
+                client->outstanding = 0;
+            }
+            if (!client->outstanding && current >= client->nextAt && current < end) {
+                sendto(pfds[i].fd, query, sizeof(query) - 1, 0, (struct sockaddr *)&broadcast, sizeof(broadcast));
+                client->sentAt = current;
+                client->nextAt += interval;
+                client->replies = 0;
+                client->outstanding = 1;
+            }
+            if (client->outstanding && client->sentAt + window < wake) {
+                wake = client->sentAt + window;
+            }
+            if (!client->outstanding && client->nextAt < wake && client->nextAt < end) {
+                wake = client->nextAt;
+            }
+        }
+
+        if (poll(pfds, count, wake > current ? (int)(wake - current) + 1 : 0) <= 0) {
+            continue;
+        }
+        current = now_ms();
+        for (int i = 0; i < count; i++) {
+            char buf[512];
+            ssize_t len;
+
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+            while ((len = recv(pfds[i].fd, buf, sizeof(buf), 0)) > 0) {
+                if (!clients[i].outstanding || len < ISCP_HEADER_SIZE + 5 ||
+                    memcmp(buf + ISCP_HEADER_SIZE, "!1ECN", 5) != 0) {
+                    continue;
+                }
+                if (clients[i].replies++ == 0) {
+                    clients[i].firstReply = current;
+                }
+                clients[i].lastReply = current;
+            }
+        }
+    }
+    cpuEnd = process_cpu(proxy);
+
+    qsort(completion, samples, sizeof(double), compare_double);
+    qsort(firstReply, samples, sizeof(double), compare_double);
+
+    printf("{\n");
+    printf("  \"devices\": %d,\n  \"clients\": %d,\n  \"rate_per_client\": %.2f,\n  \"duration_s\": %.1f,\n",
+           expected, count, rate, seconds);
+    printf("  \"queries\": %lu,\n  \"unanswered\": %lu,\n  \"replies\": %lu,\n", queries, unanswered, replies);
+    printf("  \"completeness\": %.4f,\n  \"complete_queries\": %.4f,\n",
+           queries ? (double)replies / ((double)queries * expected) : 0,
+           queries ? (double)complete / queries : 0);
+    printf("  \"first_reply_ms\": { \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n",
+           percentile(firstReply, samples, 0.5), percentile(firstReply, samples, 0.99),
+           percentile(firstReply, samples, 1));
+    printf("  \"last_reply_ms\": { \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n",
+           percentile(completion, samples, 0.5), percentile(completion, samples, 0.99),
+           percentile(completion, samples, 1));
+    printf("  \"proxy_cpu_s\": %.2f,\n  \"proxy_cpu_percent\": %.1f\n",
+           cpuEnd - cpuStart, (cpuEnd - cpuStart) * 100 / seconds);
+    printf("}\n");
+
+    free(completion);
+    free(firstReply);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    struct in_addr first = { .s_addr = INADDR_ANY };
+    const char *ifname = NULL;
+    int count = 0, expected = 0;
+    double rate = 1, seconds = 10, window = 500;
+    pid_t proxy = 0;
+    int opt;
+
+    if (argc < 2) {
+        usage(argv[0]);
+    }
+
+    optind = 2;
+    while ((opt = getopt(argc, argv, "b:n:k:e:r:t:W:p:I:")) != -1) {
+        switch (opt) {
+            case 'b':
+                if (inet_pton(AF_INET, optarg, &first) != 1) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'n':
+            case 'k':
+                count = atoi(optarg);
+                break;
+            case 'e':
+                expected = atoi(optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 't':
+                seconds = atof(optarg);
+                break;
+            case 'W':
+                window = atof(optarg);
+                break;
+            case 'p':
+                proxy = atoi(optarg);
+                break;
+            case 'I':
+                ifname = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (first.s_addr == INADDR_ANY || count <= 0 || count > MAX_SOCKETS || rate <= 0 || seconds <= 0) {
+        usage(argv[0]);
+    }
+
+    signal(SIGINT, handle_stop);
+    signal(SIGTERM, handle_stop);
+
+    if (strcmp(argv[1], "devices") == 0) {
+        return run_devices(first, count, ifname);
+    }
+    if (strcmp(argv[1], "clients") == 0 && expected > 0) {
+        return run_clients(first, count, expected, rate, seconds, window, proxy, ifname);
+    }
+    usage(argv[0]);
+    return EXIT_FAILURE;
+}
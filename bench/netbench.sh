@@ -0,0 +1,108 @@
+#!/bin/sh
+#
+# This file is part of eISCP Proxy, which is licensed under the
+# GNU General Public License v3.0. You can find the full license text
+# in the LICENSE file at the root of the source tree or at
+# https://www.gnu.org/licenses/gpl-3.0.txt.
+#
+# End-to-end benchmark: the proxy runs in the current namespace between two
+# fake VLANs, each a veth pair into its own network namespace.
+#  - eiscp-bench-dev holds DEVICES simulated receivers, on 10.201.0.0/16;
+#  - eiscp-bench-cli holds CLIENTS simulated controllers, on 10.202.0.0/16.
+# Every simulated host gets its own address through a local (AnyIP) route.
+# The JSON report of the clients goes to stdout and to REPORT, the proxy
+# debug output next to it.
+#
+# With FEDERATION=1 the clients' VLAN hangs off a second proxy instead, in
+# eiscp-bench-fed, which only knows the devices from the first one through
+# federation over a WAN link (10.203.0.0/16).
+#
+# Usage: netbench.sh PROXY LOADGEN [REPORT]
+# Tunables (environment): DEVICES CLIENTS RATE DURATION WORKERS PROXY_ARGS FEDERATION
+
+set -e
+
+PROXY=${1:?proxy binary}
+LOADGEN=${2:?load generator binary}
+REPORT=${3:-netbench.json}
+DEVICES=${DEVICES:-50}
+CLIENTS=${CLIENTS:-20}
+RATE=${RATE:-1}
+DURATION=${DURATION:-10}
+WORKERS=${WORKERS:-0}
+FEDERATION=${FEDERATION:-0}
+
+if [ "$(id -u)" -ne 0 ] || ! command -v ip >/dev/null 2>&1; then
+    echo "netbench: needs root and iproute2, skipped" >&2
+    exit 0
+fi
+
+cleanup() {
+    [ -n "$CLIENT_PID" ] && kill "$CLIENT_PID" 2>/dev/null
+    [ -n "$PROXY_PID" ] && kill "$PROXY_PID" 2>/dev/null
+    [ -n "$PEER_PID" ] && kill "$PEER_PID" 2>/dev/null
+    [ -n "$DEVICE_PID" ] && kill "$DEVICE_PID" 2>/dev/null
+    wait 2>/dev/null || :
+    ip netns del eiscp-bench-dev 2>/dev/null || :
+    ip netns del eiscp-bench-cli 2>/dev/null || :
+    ip netns del eiscp-bench-fed 2>/dev/null || :
+    ip link del ebdev0 2>/dev/null || :
+    ip link del ebcli0 2>/dev/null || :
+    ip link del ebfed0 2>/dev/null || :
+    return 0
+}
+trap cleanup EXIT INT TERM
+cleanup
+
+# One fake VLAN: namespace $1 behind link $2 of namespace $4 (default: this
+# one), prefix $3 (10.x)
+segment() {
+    ip netns add "$1"
+    ip ${4:+-n "$4"} link add "$2" type veth peer name "$2p" netns "$1"
+    ip ${4:+-n "$4"} addr add "$3.0.1/16" dev "$2"
+    ip ${4:+-n "$4"} link set "$2" up
+    ip -n "$1" addr add "$3.0.2/16" dev "$2p"
+    ip -n "$1" link set "$2p" up
+    ip -n "$1" link set lo up
+    ip -n "$1" route add local "$3.128.0/17" dev lo
+}
+
+segment eiscp-bench-dev ebdev0 10.201
+if [ "$FEDERATION" = 1 ]; then
+    segment eiscp-bench-fed ebfed0 10.203
+    segment eiscp-bench-cli ebcli0 10.202 eiscp-bench-fed
+    PROXY_INTERFACES=ebdev0
+    FEDERATION_ARGS="-F 10.203.0.1:60129 -p 10.203.0.2:60129"
+else
+    segment eiscp-bench-cli ebcli0 10.202
+    PROXY_INTERFACES=ebdev0,ebcli0
+fi
+
+ip netns exec eiscp-bench-dev "$LOADGEN" devices -b 10.201.128.1 -n "$DEVICES" -I ebdev0p &
+DEVICE_PID=$!
+
+# Kept in the foreground (-f) so that it can be measured and stopped, without
+# the per-packet output of -d, which PROXY_ARGS can still add
+"$PROXY" -f -c none -i "$PROXY_INTERFACES" -w "$WORKERS" $FEDERATION_ARGS $PROXY_ARGS > "${REPORT%.json}-proxy.log" 2>&1 &
+PROXY_PID=$!
+
+if [ "$FEDERATION" = 1 ]; then
+    ip netns exec eiscp-bench-fed "$PROXY" -f -c none -i ebcli0 -w "$WORKERS" $PROXY_ARGS \
+        -F 10.203.0.2:60129 -p 10.203.0.1:60129 > "${REPORT%.json}-peer.log" 2>&1 &
+    PEER_PID=$!
+    # The clients measure the proxy that answers them
+    MEASURED_PID=$PEER_PID
+else
+    MEASURED_PID=$PROXY_PID
+fi
+
+# First probes go out within half a second; leave time for every answer
+sleep 2
+
+ip netns exec eiscp-bench-cli "$LOADGEN" clients -b 10.202.128.1 -k "$CLIENTS" -e "$DEVICES" \
+    -r "$RATE" -t "$DURATION" -p "$MEASURED_PID" -I ebcli0p > "$REPORT" &
+CLIENT_PID=$!
+wait "$CLIENT_PID"
+CLIENT_PID=
+
+cat "$REPORT"
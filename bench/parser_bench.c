@@ -0,0 +1,135 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+/*
+ * Parse throughput of the eISCP parser on the traffic the proxy sees:
+ * discovery responses, queries and datagrams it must reject. The prefix
+ * comparisons the classification used before serve as the baseline; they
+ * accept malformed datagrams and decode nothing, so they bound what the
+ * validation costs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "iscp.h"
+
+#define ROUNDS 5000000
+
+typedef struct {
+    const char *name;
+    char packet[128];
+    size_t length;
+} Sample;
+
+static Sample samples[] = {
+    { .name = "response" }, { .name = "query" }, { .name = "truncated" }, { .name = "bad header" }, { .name = "not eISCP" }
+};
+#define SAMPLE_COUNT (sizeof(samples) / sizeof(samples[0]))
+
+static size_t build_datagram(char *out, const char *message, uint32_t dataSize) {
+    size_t length = strlen(message);
+
+    memcpy(out, "ISCP\0\0\0\x10", 8);
+    out[8] = dataSize >> 24;
+    out[9] = dataSize >> 16;
+    out[10] = dataSize >> 8;
+    out[11] = dataSize;
+    memcpy(out + 12, "\x01\0\0\0", 4);
+    memcpy(out + 16, message, length);
+    return 16 + length;
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+// As classify_packet() did: 0 ignored, 1 query, 2 response
+static int classify_prefix(const char *buffer, size_t length) {
+    if (length < 4 || strncmp(buffer, "ISCP", 4) != 0) {
+        return 0;
+    }
+    if (length >= 25 && strncmp(buffer + 16, "!xECNQSTN", 9) == 0) {
+        return 1;
+    } else if (length >= 20 && strncmp(buffer + 16, "!1ECN", 5) == 0) {
+        return 2;
+    }
+    return 0;
+}
+
+// The same verdict, with the header checked and the response decoded
+static int classify_parse(const char *buffer, size_t length, EcnRecord *ecn) {
+    IscpMessage message;
+
+    if (iscp_parse(buffer, length, &message) < 0 || memcmp(message.command, "ECN", 3) != 0) {
+        return 0;
+    }
+    if (message.parameterLength == 4 && memcmp(message.parameter, "QSTN", 4) == 0) {
+        return message.unit == ISCP_UNIT_ANY || iscp_category(message.unit) >= 0 ? 1 : 0;
+    } else if (iscp_parse_ecn(&message, ecn) == 0) {
+        return 2;
+    }
+    return 0;
+}
+
+int main() {
+    EcnRecord ecn;
+    volatile int sink;
+
+    samples[0].length = build_datagram(samples[0].packet, "!1ECNTX-NR686/60128/DX/0009B0123456\x19\r\n", 38);
+    samples[1].length = build_datagram(samples[1].packet, "!xECNQSTN\n", 10);
+    samples[2].length = build_datagram(samples[2].packet, "!1ECNTX-NR686/60128/DX/", 23);
+    samples[3].length = build_datagram(samples[3].packet, "!1ECNTX-NR686/60128/DX/0009B0123456\x19\r\n", 200);
+    samples[4].length = 48;
+    memset(samples[4].packet, 'M', samples[4].length);
+
+    // Both must agree on what is well-formed, and the response decode right
+    if (classify_parse(samples[0].packet, samples[0].length, &ecn) != 2 || ecn.port != 60128 ||
+        strcmp(ecn.model, "TX-NR686") != 0 || strcmp(ecn.region, "DX") != 0 ||
+        strcmp(ecn.identifier, "0009B0123456") != 0) {
+        fprintf(stderr, "response not decoded\n");
+        return EXIT_FAILURE;
+    }
+    if (classify_parse(samples[1].packet, samples[1].length, &ecn) != 1) {
+        fprintf(stderr, "query not recognized\n");
+        return EXIT_FAILURE;
+    }
+    for (size_t s = 2; s < SAMPLE_COUNT; s++) {
+        if (classify_parse(samples[s].packet, samples[s].length, &ecn) != 0) {
+            fprintf(stderr, "%s datagram accepted\n", samples[s].name);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("%-11s %14s %14s %10s\n", "datagram", "prefix ns/op", "parse ns/op", "parse MB/s");
+    for (size_t s = 0; s < SAMPLE_COUNT; s++) {
+        struct timespec start, middle, end;
+        const char *packet = samples[s].packet;
+        size_t length = samples[s].length;
+        double prefix, parse;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int round = 0; round < ROUNDS; round++) {
+            sink = classify_prefix(packet, length);
+            __asm__ volatile("" ::: "memory"); // Keep the datagram from being assumed unchanged
+        }
+        clock_gettime(CLOCK_MONOTONIC, &middle);
+        for (int round = 0; round < ROUNDS; round++) {
+            sink = classify_parse(packet, length, &ecn);
+            __asm__ volatile("" ::: "memory");
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        prefix = elapsed_ns(&start, &middle) / ROUNDS;
+        parse = elapsed_ns(&middle, &end) / ROUNDS;
+        printf("%-11s %14.1f %14.1f %10.0f\n", samples[s].name, prefix, parse, length * 1e3 / parse);
+    }
+
+    (void)sink;
+    return EXIT_SUCCESS;
+}
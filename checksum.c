@@ -0,0 +1,231 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "checksum.h"
+
+/*
+ * Internet checksum (RFC 1071). The one's complement sum does not depend
+ * on the byte order, so buffers are summed in host order, several 16-bit
+ * words at a time in a wide accumulator, and folded down at the end.
+ * The widest implementation the CPU supports is picked at startup, or on
+ * first use by the programs that do not select one.
+ */
+
+// The original 16-bit loop, kept as the reference the others are checked against
+unsigned short checksum_reference(void *b, int len) {
+    unsigned short *buf = b;
+    unsigned int sum = 0;
+    unsigned short result;
+
+    for (sum = 0; len > 1; len -= 2)
+        sum += *buf++;
+    if (len == 1)
+        sum += *(unsigned char *)buf;
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    sum += (sum >> 16);
+    result = ~sum;
+    return result;
+}
+
+// Sum of the last bytes that do not fill a whole 32-bit word
+static uint64_t sum_tail(const unsigned char *p, size_t len) {
+    uint64_t sum = 0;
+    uint16_t word = 0;
+
+    if (len >= 2) {
+        memcpy(&word, p, 2);
+        sum += word;
+        p += 2;
+        len -= 2;
+    }
+    if (len == 1) {
+        word = 0;
+        memcpy(&word, p, 1); // Padded with a zero byte, whatever the byte order
+        sum += word;
+    }
+    return sum;
+}
+
+// Portable path: 32-bit words into a 64-bit accumulator, that cannot overflow
+static uint64_t sum_words64(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint64_t sum = 0;
+
+    for (; len >= 16; p += 16, len -= 16) {
+        uint32_t w[4];
+        memcpy(w, p, sizeof(w));
+        sum += (uint64_t)w[0] + w[1] + w[2] + w[3];
+    }
+    for (; len >= 4; p += 4, len -= 4) {
+        uint32_t w;
+        memcpy(&w, p, sizeof(w));
+        sum += w;
+    }
+    return sum + sum_tail(p, len);
+}
+
+static int always_supported() {
+    return 1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 16 bytes per step, 32-bit lanes widened into two 64-bit accumulators
+__attribute__((target("sse2")))
+static uint64_t sum_sse2(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    __m128i acc = _mm_setzero_si128();
+    __m128i zero = _mm_setzero_si128();
+    uint64_t lanes[2];
+
+    for (; len >= 16; p += 16, len -= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+    }
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    return lanes[0] + lanes[1] + sum_words64(p, len);
+}
+
+// 32 bytes per step, 32-bit lanes widened into four 64-bit accumulators
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    __m256i acc = _mm256_setzero_si256();
+    uint64_t lanes[4];
+
+    // Not worth waking up the 256-bit units for a header
+    if (len < 64) {
+        return sum_words64(buf, len);
+    }
+
+    for (; len >= 32; p += 32, len -= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        acc = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(v)));
+        acc = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(v, 1)));
+    }
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    _mm256_zeroupper(); // Avoid the AVX to SSE transition penalty in the callers
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sum_words64(p, len);
+}
+
+static int sse2_supported() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+static int avx2_supported() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+// Best first
+static const ChecksumImpl impls[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    { "avx2", sum_avx2, avx2_supported },
+    { "sse2", sum_sse2, sse2_supported },
+#endif
+    { "scalar64", sum_words64, always_supported },
+};
+
+// Read by every thread that forges replies
+static const ChecksumImpl *_Atomic selected;
+
+const ChecksumImpl* checksum_impls(size_t *count) {
+    *count = sizeof(impls) / sizeof(impls[0]);
+    return impls;
+}
+
+// Use the named implementation, or the best supported one when name is NULL
+const ChecksumImpl* checksum_select(const char *name) {
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if ((name == NULL || strcmp(name, impls[i].name) == 0) && impls[i].supported()) {
+            atomic_store_explicit(&selected, &impls[i], memory_order_relaxed);
+            return &impls[i];
+        }
+    }
+    return NULL;
+}
+
+uint16_t checksum_fold(uint64_t sum) {
+    sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+    sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    return ~sum;
+}
+
+static uint64_t checksum_sum(const void *buf, size_t len) {
+    const ChecksumImpl *impl = atomic_load_explicit(&selected, memory_order_relaxed);
+
+    if (impl == NULL) {
+        impl = checksum_select(NULL);
+    }
+    return impl->sum(buf, len);
+}
+
+uint16_t checksum(const void *buf, size_t len) {
+    return checksum_fold(checksum_sum(buf, len));
+}
+
+uint16_t checksum_ipv4_header(const struct iphdr *iph) {
+    return checksum(iph, iph->ihl * 4);
+}
+
+// UDP checksum over the pseudo-header, the UDP header and the payload.
+// A result of zero is sent as 0xFFFF, zero meaning no checksum.
+uint16_t checksum_udp(const struct iphdr *iph, const struct udphdr *udph, const void *payload, size_t payload_len) {
+    uint64_t sum = 0;
+    uint16_t result;
+    struct udphdr hdr = *udph;
+
+    sum += (iph->saddr >> 16) + (iph->saddr & 0xFFFF);
+    sum += (iph->daddr >> 16) + (iph->daddr & 0xFFFF);
+    sum += htons(IPPROTO_UDP);
+    sum += udph->len;
+
+    hdr.check = 0;
+    sum += checksum_sum(&hdr, sizeof(hdr));
+    sum += checksum_sum(payload, payload_len);
+
+    result = checksum_fold(sum);
+    return result == 0 ? 0xFFFF : result;
+}
+
+// RFC 1624 incremental update of a checksum when a 32-bit field changes from old to new
+uint16_t checksum_update32(uint16_t check, uint32_t old, uint32_t new) {
+    uint32_t sum = (uint16_t)~check;
+
+    // HC' = ~(~HC + ~m + m'), summed 16 bits at a time
+    sum += (uint16_t)~(old >> 16) + (uint16_t)~old;
+    sum += (new >> 16) + (new & 0xFFFF);
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    sum += (sum >> 16);
+    return ~sum;
+}
+
+// Same for a 16-bit field
+uint16_t checksum_update16(uint16_t check, uint16_t old, uint16_t new) {
+    uint32_t sum = (uint16_t)~check;
+
+    sum += (uint16_t)~old + new;
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    sum += (sum >> 16);
+    return ~sum;
+}
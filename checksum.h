@@ -0,0 +1,32 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+
+// One way of summing a buffer, as 16-bit words in host order
+typedef struct {
+    const char *name;
+    uint64_t (*sum)(const void *, size_t);
+    int (*supported)();
+} ChecksumImpl;
+
+const ChecksumImpl* checksum_impls(size_t *);
+const ChecksumImpl* checksum_select(const char *);
+unsigned short checksum_reference(void *, int);
+uint16_t checksum_fold(uint64_t);
+uint16_t checksum(const void *, size_t);
+uint16_t checksum_ipv4_header(const struct iphdr *);
+uint16_t checksum_udp(const struct iphdr *, const struct udphdr *, const void *, size_t);
+uint16_t checksum_update32(uint16_t, uint32_t, uint32_t);
+uint16_t checksum_update16(uint16_t, uint16_t, uint16_t);
+
+#endif
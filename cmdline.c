@@ -11,40 +11,150 @@
 #include <ctype.h>
 
 #include "types.h"
+#include "device_table.h"
+#include "workers.h"
+#include "txring.h"
+#include "rawpacket.h"
+#include "devcache.h"
+#include "interface.h"
 #include "cmdline.h"
 
 void print_help(const char* progName) {
     printf("Usage: %s [OPTIONS]\n", progName);
     printf("Options:\n");
-    printf("  -i <interfaces>  Comma-separated list of interfaces (mandatory)\n");
+    printf("  -i <interfaces>  Comma-separated list of interfaces or patterns such as eth1.* (mandatory)\n");
     printf("  -d               Enable debug mode\n");
-    printf("  -t <timeout>     Set timeout interval in seconds (other than 5 seconds)\n");
+    printf("  -f               Stay in the foreground, logging to stderr, without debug output\n");
+    printf("  -t <timeout>     Interval between liveness checks of a device, in seconds (default: 30)\n");
+    printf("  -M <endpoint>    Serve Prometheus metrics on a Unix socket path or [address:]port\n");
+    printf("  -q <window>      Answer repeated queries from a client once per window, in ms (default: 250)\n");
+    printf("  -u               Fill in the UDP checksum of forged replies\n");
+    printf("  -x <backend>     Send forged replies through \"raw\" sockets (default) or a packet \"ring\"\n");
+    printf("  -w <workers>     Receive queries on that many threads (default: single-threaded)\n");
+    printf("  -c <file>        Device cache (default: %s, \"none\" to disable)\n", DEVCACHE_DEFAULT_PATH);
+    printf("  -r <file>        Replay the discovery traffic of a pcap or pcapng file, offline\n");
+    printf("  -o <file>        Write the replies of a replay to that pcap file\n");
+    printf("  -F <endpoint>    Share devices with federation peers over UDP on [address:]port\n");
+    printf("  -p <peers>       Comma-separated address:port of the federation peers\n");
+    printf("  -K <file>        Authenticate federation datagrams with the shared key in that file\n");
+    printf("  -R               Relay queries onto the interfaces whose devices are not all known yet\n");
     printf("  -h               Display this help and exit\n");
 }
 
 void handle_command_line(int argc, char *argv[], Environment *args) {
     int opt;
     args->debugging_enabled = 0;
-    args->timeout_interval = 5;
+    args->foreground = 0;
+    args->timeout_interval = 30;
     args->interfaces = NULL;
-	args->devices = NULL;
+	device_table_init(&args->devices);
+    args->raw_sockfd = -1;
+    args->tx_backend = TX_BACKEND_RAW;
+    args->tx_rings = NULL;
+    args->rx_ring = NULL;
+    args->loop = NULL;
+    args->workers = NULL;
+    args->worker = NULL;
+    args->worker_count = 0;
+    args->requesters = NULL;
+    args->coalesce_window = 250;
+    args->metrics = NULL;
+    args->latency = NULL;
+    args->metrics_endpoint = NULL;
+    args->replay_input = NULL;
+    args->replay_output = NULL;
+    args->replay = NULL;
+    args->cache_path = DEVCACHE_DEFAULT_PATH;
+    args->cache = NULL;
+    args->interface_patterns = NULL;
+    args->interface_pattern_count = 0;
+    args->linkwatch = NULL;
+    args->federation_endpoint = NULL;
+    args->federation_peers = NULL;
+    args->federation_key = NULL;
+    args->federation = NULL;
+    args->socket_filter = NULL;
+    args->relay_enabled = 0;
+    args->relay = NULL;
 
-    while ((opt = getopt(argc, argv, "i:dt:h")) != -1) {
+    while ((opt = getopt(argc, argv, "i:dft:M:q:uw:x:c:r:o:F:p:K:Rh")) != -1) {
         switch (opt) {
             case 'i':
                 // Split the optarg by commas and populate args->interfaces
                  // Split the optarg by commas to extract interfaces
                 char *token = strtok(optarg, ",");
                 while (token != NULL) {
-                    args->interfaces = addInterface(args->interfaces,token);
+                    if (isInterfacePattern(token)) {
+                        addInterfacePattern(args, token);
+                    } else {
+                        args->interfaces = addInterface(args->interfaces,token);
+                    }
                     token = strtok(NULL, ",");
                 }
                 break;
             case 'd':
                 args->debugging_enabled = 1;
                 break;
+            case 'f':
+                args->foreground = 1;
+                break;
             case 't':
                 args->timeout_interval = atoi(optarg);
+                if (args->timeout_interval < 1) {
+                    fprintf(stderr, "The liveness check interval must be at least 1 second\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'M':
+                args->metrics_endpoint = optarg;
+                break;
+            case 'q':
+                args->coalesce_window = atoi(optarg);
+                if (args->coalesce_window < 0) {
+                    fprintf(stderr, "The query window cannot be negative\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'u':
+                raw_enable_udp_checksum();
+                break;
+            case 'x':
+                if (strcmp(optarg, "raw") == 0) {
+                    args->tx_backend = TX_BACKEND_RAW;
+                } else if (strcmp(optarg, "ring") == 0) {
+                    args->tx_backend = TX_BACKEND_RING;
+                } else {
+                    fprintf(stderr, "Unknown transmit backend: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                args->worker_count = atoi(optarg);
+                if (args->worker_count < 0 || args->worker_count > WORKERS_MAX) {
+                    fprintf(stderr, "The number of workers must be between 0 and %d\n", WORKERS_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                args->cache_path = strcmp(optarg, "none") == 0 ? NULL : optarg;
+                break;
+            case 'r':
+                args->replay_input = optarg;
+                break;
+            case 'o':
+                args->replay_output = optarg;
+                break;
+            case 'F':
+                args->federation_endpoint = optarg;
+                break;
+            case 'p':
+                args->federation_peers = optarg;
+                break;
+            case 'K':
+                args->federation_key = optarg;
+                break;
+            case 'R':
+                args->relay_enabled = 1;
                 break;
 			case 'h':
 				print_help(argv[0]);
@@ -72,13 +182,22 @@ InterfaceNode* addInterface(InterfaceNode* node, const char* name) {
         return node;
     }
 
-    InterfaceNode* newNode = malloc(sizeof(InterfaceNode));
-    if (!newNode) {
-        perror("Failed to allocate memory for new interface node");
-        exit(EXIT_FAILURE);
-    }
-    newNode->name = strdup(name);
+    InterfaceNode* newNode = newInterfaceNode(name);
     newNode->next = node;
     return newNode;
 }
 
+// Shell wildcards select every interface whose name matches, see linkwatch.c
+int isInterfacePattern(const char* name) {
+    return strpbrk(name, "*?[") != NULL;
+}
+
+void addInterfacePattern(Environment* args, const char* pattern) {
+    char** patterns = realloc(args->interface_patterns, (args->interface_pattern_count + 1) * sizeof(char*));
+    if (!patterns || !(patterns[args->interface_pattern_count] = strdup(pattern))) {
+        perror("Failed to allocate memory for interface pattern");
+        exit(EXIT_FAILURE);
+    }
+    args->interface_patterns = patterns;
+    args->interface_pattern_count++;
+}
@@ -12,5 +12,7 @@
 void handle_command_line(int argc, char *argv[], Environment *args);
 InterfaceNode* addInterface(InterfaceNode*, const char*);
 int isValidInterfaceName(const char*);
+int isInterfacePattern(const char*);
+void addInterfacePattern(Environment*, const char*);
 
 #endif
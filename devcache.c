@@ -0,0 +1,309 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+/*
+ * Device cache: the device table mirrored into a memory-mapped file, so that
+ * a restarted proxy can answer queries before its first probes come back.
+ *
+ * Each device has a fixed-size slot, rewritten in place when it is learned or
+ * heard from and cleared when it expires: no syscall on the packet path, the
+ * kernel writes the pages back. A slot carries its own checksum, written last,
+ * so that a crash in the middle of an update only loses that device.
+ *
+ * At startup, the entries of proxied interfaces seen within the last hour go
+ * back into the table as provisional: they are served at once, and dropped
+ * unless the device answers a probe within DEVCACHE_PROVISIONAL_MS.
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "types.h"
+#include "eventloop.h"
+#include "device_table.h"
+#include "iscp.h"
+#include "utilities.h"
+#include "devcache.h"
+
+static const char magic[8] = "EISCPDC";
+
+// FNV-1a, enough to tell a torn or foreign slot from a valid one
+static uint64_t cache_checksum(const void *data, size_t length) {
+    const unsigned char *p = data;
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ p[i]) * 0x100000001B3ULL;
+    }
+    // Zero marks a free slot
+    return hash ? hash : 1;
+}
+
+static uint64_t header_checksum(const DeviceCacheHeader *header) {
+    return cache_checksum(header, offsetof(DeviceCacheHeader, checksum));
+}
+
+static uint64_t slot_checksum(const DeviceCacheSlot *slot) {
+    return cache_checksum((const char *)slot + sizeof(slot->checksum), sizeof(*slot) - sizeof(slot->checksum));
+}
+
+static uint64_t realtime_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t map_size(uint32_t capacity) {
+    return sizeof(DeviceCacheHeader) + (size_t)capacity * sizeof(DeviceCacheSlot);
+}
+
+// Map the file at the given capacity, growing it as needed
+static int cache_map(DeviceCache *cache, uint32_t capacity) {
+    size_t size = map_size(capacity);
+    void *map;
+
+    if (ftruncate(cache->fd, size) < 0) {
+        return -1;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    if (cache->header != NULL) {
+        munmap(cache->header, cache->mapSize);
+    }
+    cache->header = map;
+    cache->slots = (DeviceCacheSlot *)(cache->header + 1);
+    cache->mapSize = size;
+    return 0;
+}
+
+// Give a fresh file or one that cannot be trusted a blank header
+static int cache_reset(DeviceCache *cache) {
+    if (ftruncate(cache->fd, 0) < 0 || cache_map(cache, DEVCACHE_INITIAL_CAPACITY) < 0) {
+        return -1;
+    }
+    memcpy(cache->header->magic, magic, sizeof(magic));
+    cache->header->version = DEVCACHE_VERSION;
+    cache->header->slotSize = sizeof(DeviceCacheSlot);
+    cache->header->capacity = DEVCACHE_INITIAL_CAPACITY;
+    cache->header->reserved = 0;
+    cache->header->checksum = header_checksum(cache->header);
+    return 0;
+}
+
+// Double the number of slots, the new ones are free
+static int cache_grow(DeviceCache *cache) {
+    uint32_t capacity = cache->header->capacity;
+    uint32_t *freeSlots = realloc(cache->freeSlots, (size_t)capacity * 2 * sizeof(uint32_t));
+
+    if (freeSlots == NULL) {
+        return -1;
+    }
+    cache->freeSlots = freeSlots;
+    if (cache_map(cache, capacity * 2) < 0) {
+        return -1;
+    }
+    cache->header->capacity = capacity * 2;
+    cache->header->checksum = header_checksum(cache->header);
+
+    // Lowest numbers on top of the stack
+    for (uint32_t i = capacity * 2; i > capacity; i--) {
+        cache->freeSlots[cache->freeCount++] = i - 1;
+    }
+    return 0;
+}
+
+static const char* interface_name(const Environment *pEnv, int ifindex) {
+    for (InterfaceNode *current = pEnv->interfaces; current != NULL; current = current->next) {
+        if (current->ifindex == ifindex) {
+            return current->name;
+        }
+    }
+    return NULL;
+}
+
+static int interface_index(const Environment *pEnv, const char *name) {
+    for (InterfaceNode *current = pEnv->interfaces; current != NULL; current = current->next) {
+        if (strncmp(current->name, name, IFNAMSIZ) == 0) {
+            return current->ifindex;
+        }
+    }
+    return 0;
+}
+
+// Put back the devices of a previous run, provisional until they answer again
+static void cache_load(Environment *pEnv, DeviceCache *cache) {
+    uint32_t capacity = cache->header->capacity;
+    uint64_t now = monotonic_ms();
+    uint64_t wallNow = realtime_ms();
+    size_t loaded = 0;
+    char msg[80];
+
+    for (uint32_t i = capacity; i > 0; i--) {
+        DeviceCacheSlot *slot = &cache->slots[i - 1];
+        struct sockaddr_in source;
+        DiscoveredDevice *device;
+        EcnRecord ecn;
+        char name[IFNAMSIZ + 1];
+        int ifindex;
+
+        if (slot->payloadSize == 0 && slot->checksum == 0) {
+            cache->freeSlots[cache->freeCount++] = i - 1;
+            continue;
+        }
+
+        memcpy(name, slot->interface, IFNAMSIZ);
+        name[IFNAMSIZ] = '\0';
+        ifindex = interface_index(pEnv, name);
+
+        memset(&source, 0, sizeof(source));
+        source.sin_family = AF_INET;
+        source.sin_addr.s_addr = slot->address;
+        source.sin_port = slot->port;
+
+        // Torn, stale, behind an interface we no longer proxy, or a duplicate
+        if (slot->checksum != slot_checksum(slot) || slot->payloadSize > DEVCACHE_PAYLOAD_MAX ||
+            slot->lastSeen + DEVCACHE_MAX_AGE_MS < wallNow || ifindex == 0 ||
+            iscp_decode_response(slot->payload, slot->payloadSize, &ecn) < 0 ||
+            device_table_find(&pEnv->devices, &source) != NULL ||
+            device_table_find_identity(&pEnv->devices, &ecn) != NULL ||
+            (device = device_table_insert(&pEnv->devices, &source, slot->payload, slot->payloadSize, &ecn, now + DEVCACHE_PROVISIONAL_MS)) == NULL) {
+            memset(slot, 0, sizeof(*slot));
+            cache->freeSlots[cache->freeCount++] = i - 1;
+            continue;
+        }
+
+        device->ifindex = ifindex;
+        device->lastSeen = now;
+        device->cadence = slot->cadence;
+        device->provisional = 1;
+        device->cacheSlot = i;
+        loaded++;
+    }
+
+    snprintf(msg, sizeof(msg), "Loaded %zu devices from the device cache", loaded);
+    logger(pEnv, msg, 0);
+}
+
+// Open or create the cache file and load it, the proxy runs without on failure
+void devcache_open(Environment *pEnv) {
+    DeviceCache *cache;
+    char *dir;
+    struct stat st;
+    int valid;
+
+    if (pEnv->cache_path == NULL) {
+        return;
+    }
+
+    cache = calloc(1, sizeof(DeviceCache));
+    dir = strdup(pEnv->cache_path);
+    if (cache == NULL || dir == NULL) {
+        logger(pEnv, "Failed to allocate memory for the device cache", errno);
+        free(cache);
+        free(dir);
+        return;
+    }
+    // The parent directory, but not further up
+    if (mkdir(dirname(dir), 0755) < 0 && errno != EEXIST) {
+        logger(pEnv, "Failed to create the device cache directory", errno);
+    }
+    free(dir);
+
+    cache->fd = open(pEnv->cache_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (cache->fd < 0 || flock(cache->fd, LOCK_EX | LOCK_NB) < 0 || fstat(cache->fd, &st) < 0) {
+        logger(pEnv, "Device cache unavailable, starting empty", errno);
+        if (cache->fd >= 0) {
+            close(cache->fd);
+        }
+        free(cache);
+        return;
+    }
+
+    // Anything unexpected, from a version change to corruption, starts afresh
+    valid = (size_t)st.st_size >= sizeof(DeviceCacheHeader);
+    if (valid) {
+        DeviceCacheHeader header;
+        valid = pread(cache->fd, &header, sizeof(header), 0) == sizeof(header) &&
+            memcmp(header.magic, magic, sizeof(magic)) == 0 && header.version == DEVCACHE_VERSION &&
+            header.slotSize == sizeof(DeviceCacheSlot) && header.checksum == header_checksum(&header) &&
+            header.capacity > 0 && (size_t)st.st_size >= map_size(header.capacity) &&
+            cache_map(cache, header.capacity) == 0;
+    }
+    if (!valid && cache_reset(cache) < 0) {
+        logger(pEnv, "Device cache unavailable, starting empty", errno);
+        close(cache->fd);
+        free(cache);
+        return;
+    }
+
+    cache->freeSlots = malloc((size_t)cache->header->capacity * sizeof(uint32_t));
+    if (cache->freeSlots == NULL) {
+        logger(pEnv, "Failed to allocate memory for the device cache", errno);
+        munmap(cache->header, cache->mapSize);
+        close(cache->fd);
+        free(cache);
+        return;
+    }
+    cache_load(pEnv, cache);
+    pEnv->cache = cache;
+}
+
+// Write a device learned or heard from
+void devcache_store(Environment *pEnv, DiscoveredDevice *device) {
+    DeviceCache *cache = pEnv->cache;
+    DeviceCacheSlot *slot;
+    const char *name;
+
+    if (cache == NULL || device->payloadSize > DEVCACHE_PAYLOAD_MAX ||
+        (name = interface_name(pEnv, device->ifindex)) == NULL) {
+        return;
+    }
+
+    if (device->cacheSlot == 0) {
+        if (cache->freeCount == 0 && cache_grow(cache) < 0) {
+            logger(pEnv, "Failed to grow the device cache", errno);
+            return;
+        }
+        device->cacheSlot = cache->freeSlots[--cache->freeCount] + 1;
+    }
+
+    slot = &cache->slots[device->cacheSlot - 1];
+    slot->checksum = 0;
+    slot->lastSeen = realtime_ms();
+    slot->address = device->source.sin_addr.s_addr;
+    slot->port = device->source.sin_port;
+    slot->payloadSize = device->payloadSize;
+    slot->cadence = device->cadence;
+    memset(slot->interface, 0, IFNAMSIZ);
+    memcpy(slot->interface, name, strnlen(name, IFNAMSIZ));
+    memcpy(slot->payload, device->payload, device->payloadSize);
+    memset(slot->payload + device->payloadSize, 0, DEVCACHE_PAYLOAD_MAX - device->payloadSize);
+    slot->checksum = slot_checksum(slot);
+}
+
+// Forget an expired device
+void devcache_erase(Environment *pEnv, DiscoveredDevice *device) {
+    DeviceCache *cache = pEnv->cache;
+
+    if (cache == NULL || device->cacheSlot == 0) {
+        return;
+    }
+    memset(&cache->slots[device->cacheSlot - 1], 0, sizeof(DeviceCacheSlot));
+    cache->freeSlots[cache->freeCount++] = device->cacheSlot - 1;
+    device->cacheSlot = 0;
+}
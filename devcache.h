@@ -0,0 +1,57 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#ifndef DEVCACHE_H
+#define DEVCACHE_H
+
+#include <stdint.h>
+#include <net/if.h>
+
+#include "types.h"
+
+#define DEVCACHE_DEFAULT_PATH "/var/lib/eiscp-proxy/devices.cache"
+#define DEVCACHE_VERSION 1
+#define DEVCACHE_INITIAL_CAPACITY 256
+#define DEVCACHE_PAYLOAD_MAX 216           // Discovery responses are well under 100 bytes
+#define DEVCACHE_MAX_AGE_MS (3600 * 1000)  // Older entries are not loaded
+#define DEVCACHE_PROVISIONAL_MS 10000      // Time left to loaded entries to be heard from again
+
+// File header, followed by capacity slots
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t slotSize;
+    uint32_t capacity;
+    uint32_t reserved;
+    uint64_t checksum; // Of the fields above
+} DeviceCacheHeader;
+
+// One device, written in place; a torn write only loses that slot
+typedef struct {
+    uint64_t checksum;    // Of the fields below, 0 in a free slot
+    uint64_t lastSeen;    // Wall clock, ms since the epoch
+    uint32_t address;     // Network byte order
+    uint16_t port;        // Network byte order
+    uint16_t payloadSize; // 0 in a free slot
+    uint32_t cadence;
+    char interface[IFNAMSIZ];
+    char payload[DEVCACHE_PAYLOAD_MAX];
+} DeviceCacheSlot;
+
+typedef struct DeviceCache {
+    int fd;
+    DeviceCacheHeader *header; // Start of the mapping
+    DeviceCacheSlot *slots;
+    size_t mapSize;
+    uint32_t *freeSlots;       // Stack of free slot numbers
+    uint32_t freeCount;
+} DeviceCache;
+
+void devcache_open(Environment *);
+void devcache_store(Environment *, DiscoveredDevice *);
+void devcache_erase(Environment *, DiscoveredDevice *);
+
+#endif
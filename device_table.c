@@ -0,0 +1,362 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "types.h"
+#include "rawpacket.h"
+#include "device_table.h"
+
+/*
+ * Devices are indexed by (address, port) in an open-addressing hash table
+ * with linear probing. Those whose response carries an identifier are also
+ * indexed by it in a second table of the same capacity, so that a device
+ * showing up under another address is recognized. Devices are threaded on
+ * three intrusive lists:
+ *  - the iteration list (newest first), which reply_to_discovery() walks;
+ *  - the list of their unit type, walked instead for queries naming one;
+ *  - one bucket of a hashed timing wheel, chosen from the deadline of the
+ *    device (its next liveness check, or its expiry), so that finding the
+ *    devices due only visits the buckets that became due.
+ */
+
+#define DEVICE_TABLE_INITIAL_CAPACITY 64
+
+typedef uint32_t (*DeviceKey)(const DiscoveredDevice *);
+
+static uint32_t source_hash(const struct sockaddr_in *addr) {
+    uint64_t key = ((uint64_t)addr->sin_addr.s_addr << 16) | addr->sin_port;
+
+    // 64-bit finalizer from MurmurHash3
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return (uint32_t)key;
+}
+
+// FNV-1a
+static uint32_t identity_hash(const char *identifier) {
+    uint32_t hash = 0x811C9DC5;
+
+    for (; *identifier; identifier++) {
+        hash = (hash ^ (unsigned char)*identifier) * 0x01000193;
+    }
+    return hash;
+}
+
+static uint32_t device_source_key(const DiscoveredDevice *device) {
+    return source_hash(&device->source);
+}
+
+static uint32_t device_identity_key(const DiscoveredDevice *device) {
+    return identity_hash(device->ecn.identifier);
+}
+
+static int same_source(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static int has_identity(const DiscoveredDevice *device) {
+    return device->ecn.identifier[0] != '\0';
+}
+
+static void *table_alloc(size_t capacity) {
+    void *slots = calloc(capacity, sizeof(DiscoveredDevice *));
+    if (!slots) {
+        perror("Failed to allocate memory for device table");
+        exit(EXIT_FAILURE);
+    }
+    return slots;
+}
+
+void device_table_init(DeviceTable *table) {
+    memset(table, 0, sizeof(*table));
+    table->capacity = DEVICE_TABLE_INITIAL_CAPACITY;
+    table->slots = table_alloc(table->capacity);
+    table->identities = table_alloc(table->capacity);
+    table->wheelTick = monotonic_ms() / DEVICE_WHEEL_TICK_MS;
+}
+
+// Follow another clock from now on, that of a replay: the table must still be empty
+void device_table_set_clock(DeviceTable *table, uint64_t now) {
+    table->wheelTick = now / DEVICE_WHEEL_TICK_MS;
+}
+
+static void hash_place(DiscoveredDevice **slots, size_t mask, DiscoveredDevice *device, DeviceKey key) {
+    size_t i = key(device) & mask;
+
+    while (slots[i] != NULL) {
+        i = (i + 1) & mask;
+    }
+    slots[i] = device;
+}
+
+static void hash_grow(DeviceTable *table) {
+    DiscoveredDevice **old = table->slots;
+    DiscoveredDevice **oldIdentities = table->identities;
+    size_t oldCapacity = table->capacity;
+    size_t mask;
+
+    table->capacity *= 2;
+    mask = table->capacity - 1;
+    table->slots = table_alloc(table->capacity);
+    table->identities = table_alloc(table->capacity);
+    for (size_t i = 0; i < oldCapacity; i++) {
+        if (old[i] != NULL) {
+            hash_place(table->slots, mask, old[i], device_source_key);
+        }
+        if (oldIdentities[i] != NULL) {
+            hash_place(table->identities, mask, oldIdentities[i], device_identity_key);
+        }
+    }
+    free(old);
+    free(oldIdentities);
+}
+
+// Backward-shift deletion keeps probe sequences intact without tombstones
+static void hash_delete(DiscoveredDevice **slots, size_t mask, const DiscoveredDevice *device, DeviceKey key) {
+    size_t i = key(device) & mask;
+
+    while (slots[i] != device) {
+        i = (i + 1) & mask;
+    }
+
+    size_t hole = i;
+    for (size_t j = (hole + 1) & mask; slots[j] != NULL; j = (j + 1) & mask) {
+        size_t home = key(slots[j]) & mask;
+        // Move the entry back if its home is not within (hole, j]
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            slots[hole] = slots[j];
+            hole = j;
+        }
+    }
+    slots[hole] = NULL;
+}
+
+static void wheel_link(DeviceTable *table, DiscoveredDevice *device) {
+    uint64_t tick = device->expires / DEVICE_WHEEL_TICK_MS;
+    DiscoveredDevice **bucket;
+
+    // A deadline already behind the wheel is handled on the next advance
+    if (tick <= table->wheelTick) {
+        tick = table->wheelTick + 1;
+    }
+    bucket = &table->wheel[tick % DEVICE_WHEEL_SLOTS];
+
+    device->wheelPrev = NULL;
+    device->wheelNext = *bucket;
+    if (*bucket) {
+        (*bucket)->wheelPrev = device;
+    }
+    *bucket = device;
+    device->wheelBucket = bucket;
+}
+
+static void wheel_unlink(DiscoveredDevice *device) {
+    // Already taken off by device_table_due()
+    if (device->wheelBucket == NULL) {
+        return;
+    }
+    if (device->wheelPrev) {
+        device->wheelPrev->wheelNext = device->wheelNext;
+    } else {
+        *device->wheelBucket = device->wheelNext;
+    }
+    if (device->wheelNext) {
+        device->wheelNext->wheelPrev = device->wheelPrev;
+    }
+    device->wheelBucket = NULL;
+}
+
+static void category_link(DeviceTable *table, DiscoveredDevice *device) {
+    int category = iscp_category(device->ecn.unit);
+
+    if (category < 0) {
+        return;
+    }
+    device->categoryPrev = NULL;
+    device->categoryNext = table->categories[category];
+    if (device->categoryNext) {
+        device->categoryNext->categoryPrev = device;
+    }
+    table->categories[category] = device;
+    table->categoryCounts[category]++;
+}
+
+static void category_unlink(DeviceTable *table, DiscoveredDevice *device) {
+    int category = iscp_category(device->ecn.unit);
+
+    if (category < 0) {
+        return;
+    }
+    if (device->categoryPrev) {
+        device->categoryPrev->categoryNext = device->categoryNext;
+    } else {
+        table->categories[category] = device->categoryNext;
+    }
+    if (device->categoryNext) {
+        device->categoryNext->categoryPrev = device->categoryPrev;
+    }
+    table->categoryCounts[category]--;
+}
+
+DiscoveredDevice* device_table_find(const DeviceTable *table, const struct sockaddr_in *source) {
+    size_t mask = table->capacity - 1;
+
+    for (size_t i = source_hash(source) & mask; table->slots[i] != NULL; i = (i + 1) & mask) {
+        if (same_source(&table->slots[i]->source, source)) {
+            return table->slots[i];
+        }
+    }
+    return NULL;
+}
+
+// The device answering with the same identifier, whatever its address
+DiscoveredDevice* device_table_find_identity(const DeviceTable *table, const EcnRecord *ecn) {
+    size_t mask = table->capacity - 1;
+
+    if (ecn == NULL || ecn->identifier[0] == '\0') {
+        return NULL;
+    }
+    for (size_t i = identity_hash(ecn->identifier) & mask; table->identities[i] != NULL; i = (i + 1) & mask) {
+        if (strcmp(table->identities[i]->ecn.identifier, ecn->identifier) == 0) {
+            return table->identities[i];
+        }
+    }
+    return NULL;
+}
+
+// Add a new device expiring at the given monotonic time (ms), NULL on allocation
+// failure. Its identifier, if any, must not be in the table already.
+DiscoveredDevice* device_table_insert(DeviceTable *table, const struct sockaddr_in *source, const char *payload, size_t payloadSize, const EcnRecord *ecn, uint64_t expires) {
+    DiscoveredDevice *device = calloc(1, sizeof(DiscoveredDevice));
+    if (!device) {
+        return NULL;
+    }
+
+    device->payload = malloc(payloadSize);
+    if (!device->payload) {
+        free(device);
+        return NULL;
+    }
+    memcpy(device->payload, payload, payloadSize);
+    device->payloadSize = payloadSize;
+    memcpy(&device->source, source, sizeof(struct sockaddr_in));
+    if (ecn != NULL) {
+        device->ecn = *ecn;
+    }
+    raw_frame_build(&device->frame, source, device->payload, payloadSize);
+    device->timestamp = time(NULL);
+    device->expires = expires;
+
+    if ((table->count + 1) * 2 > table->capacity) {
+        hash_grow(table);
+    }
+    hash_place(table->slots, table->capacity - 1, device, device_source_key);
+    if (has_identity(device)) {
+        hash_place(table->identities, table->capacity - 1, device, device_identity_key);
+    }
+    table->count++;
+    table->generation++;
+
+    // Insert the new node at the beginning of the iteration list
+    device->prev = NULL;
+    device->next = table->head;
+    if (table->head) {
+        table->head->prev = device;
+    }
+    table->head = device;
+
+    category_link(table, device);
+    wheel_link(table, device);
+    return device;
+}
+
+// Move the deadline of a device, monotonic ms
+void device_table_reschedule(DeviceTable *table, DiscoveredDevice *device, uint64_t expires) {
+    device->expires = expires;
+    wheel_unlink(device);
+    wheel_link(table, device);
+}
+
+// Record that a device was seen again, moving its deadline
+void device_table_touch(DeviceTable *table, DiscoveredDevice *device, uint64_t expires) {
+    device->timestamp = time(NULL);
+    device_table_reschedule(table, device, expires);
+}
+
+// Unlink a device from the table, without freeing it
+void device_table_remove(DeviceTable *table, DiscoveredDevice *device) {
+    hash_delete(table->slots, table->capacity - 1, device, device_source_key);
+    if (has_identity(device)) {
+        hash_delete(table->identities, table->capacity - 1, device, device_identity_key);
+    }
+    wheel_unlink(device);
+    category_unlink(table, device);
+
+    if (device->prev) {
+        device->prev->next = device->next;
+    } else {
+        table->head = device->next;
+    }
+    if (device->next) {
+        device->next->prev = device->prev;
+    }
+    table->count--;
+    table->generation++;
+}
+
+// Advance the timing wheel to now (monotonic ms) and take every device whose
+// deadline has passed off it. They stay in the table, and are returned as a
+// list chained through wheelNext: each must be rescheduled or removed.
+DiscoveredDevice* device_table_due(DeviceTable *table, uint64_t now) {
+    DiscoveredDevice *due = NULL;
+    // The current bucket may still hold deadlines ahead, only the past ones are emptied
+    uint64_t lastTick = now / DEVICE_WHEEL_TICK_MS - 1;
+    uint64_t tick = table->wheelTick;
+
+    // No need to go round the wheel more than once
+    if (lastTick > tick && lastTick - tick > DEVICE_WHEEL_SLOTS) {
+        tick = lastTick - DEVICE_WHEEL_SLOTS;
+    }
+
+    while (tick < lastTick) {
+        tick++;
+        DiscoveredDevice *current = table->wheel[tick % DEVICE_WHEEL_SLOTS];
+        while (current != NULL) {
+            DiscoveredDevice *next = current->wheelNext;
+            // Deadlines further than one revolution stay in their bucket
+            if (current->expires <= now) {
+                wheel_unlink(current);
+                current->wheelNext = due;
+                due = current;
+            }
+            current = next;
+        }
+    }
+    table->wheelTick = tick;
+
+    return due;
+}
+
+// How many devices have the unit type, or how many in all for 'x'
+size_t device_table_count(const DeviceTable *table, char unit) {
+    int category = iscp_category(unit);
+
+    return category < 0 ? table->count : table->categoryCounts[category];
+}
+
+void device_free(DiscoveredDevice *device) {
+    free(device->payload);
+    free(device);
+}
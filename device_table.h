@@ -0,0 +1,27 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#ifndef DEVICE_TABLE_H
+#define DEVICE_TABLE_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "types.h"
+
+void device_table_init(DeviceTable *);
+void device_table_set_clock(DeviceTable *, uint64_t);
+DiscoveredDevice* device_table_find(const DeviceTable *, const struct sockaddr_in *);
+DiscoveredDevice* device_table_find_identity(const DeviceTable *, const EcnRecord *);
+DiscoveredDevice* device_table_insert(DeviceTable *, const struct sockaddr_in *, const char *, size_t, const EcnRecord *, uint64_t);
+void device_table_touch(DeviceTable *, DiscoveredDevice *, uint64_t);
+void device_table_reschedule(DeviceTable *, DiscoveredDevice *, uint64_t);
+void device_table_remove(DeviceTable *, DiscoveredDevice *);
+DiscoveredDevice* device_table_due(DeviceTable *, uint64_t);
+size_t device_table_count(const DeviceTable *, char);
+void device_free(DiscoveredDevice *);
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "eventloop.h"
+
+EventLoop* event_loop_create() {
+    EventLoop *loop = malloc(sizeof(EventLoop));
+    if (!loop) {
+        perror("Failed to allocate memory for event loop");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+
+    return loop;
+}
+
+int event_loop_add(EventLoop *loop, EventSource *source, uint32_t events) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = source;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, source->fd, &ev);
+}
+
+// Wait for other events on a registered source
+int event_loop_modify(EventLoop *loop, EventSource *source, uint32_t events) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = source;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, source->fd, &ev);
+}
+
+void event_loop_remove(EventLoop *loop, EventSource *source) {
+    if (source->fd >= 0) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, source->fd, NULL);
+    }
+}
+
+// Dispatch events forever, sleeping in epoll_wait() while nothing is due
+void event_loop_run(EventLoop *loop) {
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+    while (1) {
+        int ready = epoll_wait(loop->epfd, events, EVENT_LOOP_MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < ready; i++) {
+            EventSource *source = events[i].data.ptr;
+            source->handler(source, events[i].events);
+        }
+    }
+}
+
+// Create a disarmed timer on the monotonic clock and register it
+int event_timer_create(EventLoop *loop, EventSource *source, EventHandler handler, void *ctx) {
+    source->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (source->fd < 0) {
+        return -1;
+    }
+
+    source->handler = handler;
+    source->ctx = ctx;
+    if (event_loop_add(loop, source, EPOLLIN) < 0) {
+        close(source->fd);
+        source->fd = -1;
+        return -1;
+    }
+
+    return source->fd;
+}
+
+// Fire every interval_ms, on absolute deadlines that do not drift with load
+int event_timer_set_periodic(EventSource *source, long interval_ms) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    monotonic_now(&its.it_value);
+    timespec_add_ms(&its.it_value, interval_ms);
+    its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+    return timerfd_settime(source->fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// Fire once at an absolute monotonic deadline
+int event_timer_set_deadline(EventSource *source, const struct timespec *deadline) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value = *deadline;
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+        its.it_value.tv_nsec = 1; // A zero value would disarm the timer
+    }
+    return timerfd_settime(source->fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// Consume a timer expiration, returns the number of periods elapsed
+uint64_t event_timer_ack(EventSource *source) {
+    uint64_t expirations = 0;
+
+    if (read(source->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return 0;
+    }
+    return expirations;
+}
+
+// Set while replaying a capture: time then follows the packets
+static struct timespec replayClock;
+static int replayClockSet = 0;
+
+void monotonic_replay(const struct timespec *ts) {
+    replayClock = *ts;
+    replayClockSet = 1;
+}
+
+void monotonic_now(struct timespec *ts) {
+    if (replayClockSet) {
+        *ts = replayClock;
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+uint64_t monotonic_ms() {
+    struct timespec ts;
+
+    monotonic_now(&ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timespec_add_ms(struct timespec *ts, long ms) {
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
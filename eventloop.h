@@ -0,0 +1,45 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define EVENT_LOOP_MAX_EVENTS 32 // Events collected by one epoll_wait()
+
+struct EventSource;
+typedef void (*EventHandler)(struct EventSource *, uint32_t);
+
+// A file descriptor watched by the event loop, usually embedded in its owner
+typedef struct EventSource {
+    int fd;
+    EventHandler handler; // Called with the epoll events that fired
+    void *ctx;
+} EventSource;
+
+typedef struct EventLoop {
+    int epfd;
+} EventLoop;
+
+EventLoop* event_loop_create();
+int event_loop_add(EventLoop *, EventSource *, uint32_t);
+int event_loop_modify(EventLoop *, EventSource *, uint32_t);
+void event_loop_remove(EventLoop *, EventSource *);
+void event_loop_run(EventLoop *);
+
+int event_timer_create(EventLoop *, EventSource *, EventHandler, void *);
+int event_timer_set_periodic(EventSource *, long);
+int event_timer_set_deadline(EventSource *, const struct timespec *);
+uint64_t event_timer_ack(EventSource *);
+
+void monotonic_now(struct timespec *);
+void monotonic_replay(const struct timespec *);
+uint64_t monotonic_ms();
+void timespec_add_ms(struct timespec *, long);
+
+#endif
@@ -0,0 +1,625 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+/*
+ * Federation: proxies share the devices they see with configured peers, so
+ * that each of them answers queries with the union without any broadcast
+ * crossing the WAN.
+ *
+ * Every proxy only announces the devices it hears itself, in DELTA datagrams
+ * of add, refresh and expire records sent over unicast UDP and numbered by a
+ * sequence. A device learned from a peer is leased: it goes away unless
+ * refreshed in time, so a proxy that vanishes takes its devices with it.
+ * Refreshes are only sent once half of the last announced lease is gone.
+ *
+ * Lost datagrams are caught by anti-entropy: every FEDERATION_DIGEST_MS a
+ * proxy sends its peers the count and a hash of its devices. A peer that
+ * missed a sequence number, or whose view does not match the digest, asks
+ * for a SNAPSHOT, after which the devices the snapshot no longer lists are
+ * dropped. Full dumps therefore only travel when something was lost.
+ *
+ * Peers form a full mesh, devices learned from a peer are not relayed.
+ *
+ * Datagrams are only accepted from the configured addresses, which anyone
+ * on the path can spoof. With a shared key (-K), every datagram ends with
+ * an HMAC-SHA256 tag over all of it, and those without a valid one are
+ * dropped. A recorded datagram can still be sent again: it may bring back
+ * a device for one lease, or make the receiver ask for a snapshot.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "types.h"
+#include "eventloop.h"
+#include "device_table.h"
+#include "iscp.h"
+#include "workers.h"
+#include "scheduler.h"
+#include "utilities.h"
+#include "metrics.h"
+#include "hmac.h"
+#include "federation.h"
+
+static const char magic[4] = "EPFD";
+
+static void put32(char *at, uint32_t value) {
+    value = htonl(value);
+    memcpy(at, &value, sizeof(value));
+}
+
+static uint32_t get32(const char *at) {
+    uint32_t value;
+    memcpy(&value, at, sizeof(value));
+    return ntohl(value);
+}
+
+// FNV-1a of what a device announces, XORed over a device set for the digest
+static uint64_t announce_hash(const void *address, const void *port, const char *payload, size_t payloadSize) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    for (size_t i = 0; i < sizeof(in_addr_t); i++) {
+        hash = (hash ^ ((const unsigned char *)address)[i]) * 0x100000001B3ULL;
+    }
+    for (size_t i = 0; i < sizeof(in_port_t); i++) {
+        hash = (hash ^ ((const unsigned char *)port)[i]) * 0x100000001B3ULL;
+    }
+    for (size_t i = 0; i < payloadSize; i++) {
+        hash = (hash ^ (unsigned char)payload[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// Count and hash of the devices learned from peer (plus one), 0 for our own
+static void digest_compute(const Environment *pEnv, int peer, uint32_t *count, uint64_t *hash) {
+    *count = 0;
+    *hash = 0;
+    for (DiscoveredDevice *current = pEnv->devices.head; current != NULL; current = current->next) {
+        if (current->peer == peer && current->payloadSize <= FEDERATION_PAYLOAD_MAX) {
+            (*count)++;
+            *hash ^= announce_hash(&current->source.sin_addr, &current->source.sin_port, current->payload, current->payloadSize);
+        }
+    }
+}
+
+static void header_write(const Federation *federation, char *buffer, FederationType type, int flags, uint32_t snapshot) {
+    memcpy(buffer, magic, sizeof(magic));
+    buffer[4] = FEDERATION_VERSION;
+    buffer[5] = type;
+    buffer[6] = flags;
+    buffer[7] = federation->authenticated ? FEDERATION_AUTHENTICATED : 0;
+    put32(buffer + 8, federation->instance);
+    put32(buffer + 12, federation->sequence);
+    put32(buffer + 16, snapshot);
+}
+
+static size_t record_write(char *at, FederationOp op, const DiscoveredDevice *device, uint64_t lifetime, uint64_t now) {
+    size_t payloadSize = op == FEDERATION_ADD ? device->payloadSize : 0;
+
+    at[0] = op;
+    at[1] = payloadSize;
+    memcpy(at + 2, &device->source.sin_port, sizeof(device->source.sin_port));
+    memcpy(at + 4, &device->source.sin_addr, sizeof(device->source.sin_addr));
+    put32(at + 8, lifetime > now ? lifetime - now : 0);
+    memcpy(at + FEDERATION_RECORD_SIZE, device->payload, payloadSize);
+    return FEDERATION_RECORD_SIZE + payloadSize;
+}
+
+static void send_to_peer(Environment *pEnv, FederationPeer *peer, const char *buffer, size_t length) {
+    Federation *federation = pEnv->federation;
+    unsigned char tag[SHA256_DIGEST_SIZE];
+    struct iovec iov[2] = { { (void *)buffer, length }, { tag, 0 } };
+    struct msghdr msg;
+
+    if (federation->authenticated) {
+        hmac_sha256(&federation->key, buffer, length, tag);
+        iov[1].iov_len = FEDERATION_TAG_SIZE;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &peer->address;
+    msg.msg_namelen = sizeof(peer->address);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    if (sendmsg(federation->fd, &msg, 0) < 0 && pEnv->debugging_enabled) {
+        fprintf(stderr, "Federation send to %s:%d failed: %s\n", inet_ntoa(peer->address.sin_addr), ntohs(peer->address.sin_port), strerror(errno));
+    }
+}
+
+// Send the pending delta records to every peer
+static void flush_deltas(Environment *pEnv) {
+    Federation *federation = pEnv->federation;
+
+    if (federation->pending == 0) {
+        return;
+    }
+    federation->sequence++;
+    header_write(federation, federation->buffer, FEDERATION_DELTA, 0, 0);
+    for (int i = 0; i < federation->peerCount; i++) {
+        send_to_peer(pEnv, &federation->peers[i], federation->buffer, FEDERATION_HEADER_SIZE + federation->pending);
+    }
+    federation->pending = 0;
+}
+
+// Records are gathered for FEDERATION_FLUSH_MS, or until the datagram is full
+static void queue_record(Environment *pEnv, FederationOp op, DiscoveredDevice *device) {
+    Federation *federation = pEnv->federation;
+    size_t size = FEDERATION_RECORD_SIZE + (op == FEDERATION_ADD ? device->payloadSize : 0);
+    uint64_t now = monotonic_ms();
+    uint64_t lifetime = scheduler_device_lifetime(pEnv, device);
+
+    if (device->payloadSize > FEDERATION_PAYLOAD_MAX) {
+        return;
+    }
+    if (FEDERATION_HEADER_SIZE + federation->pending + size > FEDERATION_BODY_MAX) {
+        flush_deltas(pEnv);
+    }
+    if (federation->pending == 0) {
+        struct timespec deadline;
+        monotonic_now(&deadline);
+        timespec_add_ms(&deadline, FEDERATION_FLUSH_MS);
+        event_timer_set_deadline(&federation->flushTimer, &deadline);
+    }
+    federation->pending += record_write(federation->buffer + FEDERATION_HEADER_SIZE + federation->pending, op, device, lifetime, now);
+    device->advertised = lifetime;
+}
+
+void federation_device_learned(Environment *pEnv, DiscoveredDevice *device) {
+    if (pEnv->federation != NULL) {
+        queue_record(pEnv, FEDERATION_ADD, device);
+    }
+}
+
+void federation_device_refreshed(Environment *pEnv, DiscoveredDevice *device) {
+    uint64_t now = monotonic_ms();
+    uint64_t lifetime;
+
+    if (pEnv->federation == NULL || device->peer != 0) {
+        return;
+    }
+    // The peers still have more than half of the lifetime we could give
+    lifetime = scheduler_device_lifetime(pEnv, device);
+    if (device->advertised > now && lifetime > now && device->advertised - now > (lifetime - now) / 2) {
+        return;
+    }
+    queue_record(pEnv, FEDERATION_REFRESH, device);
+}
+
+void federation_device_expired(Environment *pEnv, DiscoveredDevice *device) {
+    if (pEnv->federation != NULL && device->peer == 0) {
+        queue_record(pEnv, FEDERATION_EXPIRE, device);
+    }
+}
+
+static void remove_device(Environment *pEnv, DiscoveredDevice *device) {
+    if (pEnv->debugging_enabled) {
+        fprintf(stderr, "Removing device %s learned from a peer\n", inet_ntoa(device->source.sin_addr));
+    }
+    device_table_remove(&pEnv->devices, device);
+    workers_release_device(pEnv, device);
+}
+
+// Drop the devices of a peer, all of them or those missing from a snapshot
+static void forget_devices(Environment *pEnv, int index, int all, uint32_t snapshot) {
+    DiscoveredDevice *current = pEnv->devices.head;
+
+    while (current != NULL) {
+        DiscoveredDevice *next = current->next;
+        if (current->peer == index + 1 && (all || current->snapshot != snapshot)) {
+            remove_device(pEnv, current);
+        }
+        current = next;
+    }
+}
+
+static void request_snapshot(Environment *pEnv, FederationPeer *peer) {
+    Federation *federation = pEnv->federation;
+    uint64_t now = monotonic_ms();
+    char buffer[FEDERATION_HEADER_SIZE];
+
+    // One request in flight at a time
+    if (peer->lastRequest != 0 && now - peer->lastRequest < FEDERATION_DIGEST_MS / 2) {
+        return;
+    }
+    peer->lastRequest = now;
+    header_write(federation, buffer, FEDERATION_REQUEST, 0, 0);
+    send_to_peer(pEnv, peer, buffer, sizeof(buffer));
+}
+
+// Every device of ours, as ADD records over as many datagrams as needed
+static void send_snapshot(Environment *pEnv, FederationPeer *peer) {
+    Federation *federation = pEnv->federation;
+    char buffer[FEDERATION_DATAGRAM_MAX];
+    size_t length = FEDERATION_HEADER_SIZE;
+    int flags = FEDERATION_SNAPSHOT_FIRST;
+    uint64_t now = monotonic_ms();
+
+    // The snapshot then follows the last DELTA sent
+    flush_deltas(pEnv);
+    federation->snapshot++;
+
+    for (DiscoveredDevice *current = pEnv->devices.head; current != NULL; current = current->next) {
+        if (current->peer != 0 || current->payloadSize > FEDERATION_PAYLOAD_MAX) {
+            continue;
+        }
+        if (length + FEDERATION_RECORD_SIZE + current->payloadSize > FEDERATION_BODY_MAX) {
+            header_write(federation, buffer, FEDERATION_SNAPSHOT, flags, federation->snapshot);
+            send_to_peer(pEnv, peer, buffer, length);
+            length = FEDERATION_HEADER_SIZE;
+            flags = 0;
+        }
+        current->advertised = scheduler_device_lifetime(pEnv, current);
+        length += record_write(buffer + length, FEDERATION_ADD, current, current->advertised, now);
+    }
+    header_write(federation, buffer, FEDERATION_SNAPSHOT, flags | FEDERATION_SNAPSHOT_LAST, federation->snapshot);
+    send_to_peer(pEnv, peer, buffer, length);
+}
+
+// Apply one record of a peer. Returns -1 when it refers to a device we do not
+// know, 1 when we hear the device ourselves and the record is ignored.
+static int apply_record(Environment *pEnv, int index, const char *record, uint32_t snapshot) {
+    FederationOp op = record[0];
+    size_t payloadSize = (unsigned char)record[1];
+    uint64_t now = monotonic_ms();
+    struct sockaddr_in source;
+    DiscoveredDevice *device;
+
+    memset(&source, 0, sizeof(source));
+    source.sin_family = AF_INET;
+    memcpy(&source.sin_port, record + 2, sizeof(source.sin_port));
+    memcpy(&source.sin_addr, record + 4, sizeof(source.sin_addr));
+    device = device_table_find(&pEnv->devices, &source);
+
+    if (op == FEDERATION_EXPIRE) {
+        if (device != NULL && device->peer == index + 1) {
+            remove_device(pEnv, device);
+        }
+        return 0;
+    }
+    // What we hear ourselves wins over what peers say
+    if (device != NULL && device->peer == 0) {
+        return 1;
+    }
+    if (device != NULL && op == FEDERATION_ADD && (device->payloadSize != payloadSize ||
+        memcmp(device->payload, record + FEDERATION_RECORD_SIZE, payloadSize) != 0)) {
+        remove_device(pEnv, device);
+        device = NULL;
+    }
+    if (device == NULL) {
+        DiscoveredDevice *same;
+        EcnRecord ecn;
+
+        if (op != FEDERATION_ADD || payloadSize == 0) {
+            return -1;
+        }
+        if (iscp_decode_response(record + FEDERATION_RECORD_SIZE, payloadSize, &ecn) < 0) {
+            return 0;
+        }
+        // The same device under another address: ours wins, a peer's moved
+        if ((same = device_table_find_identity(&pEnv->devices, &ecn)) != NULL) {
+            if (same->peer == 0) {
+                return 1;
+            }
+            remove_device(pEnv, same);
+        }
+        device = device_table_insert(&pEnv->devices, &source, record + FEDERATION_RECORD_SIZE, payloadSize, &ecn, now);
+        if (device == NULL) {
+            logger(pEnv, "Failed to allocate memory for new DiscoveredDevice node", errno);
+            return 0;
+        }
+        // Answered on every interface
+        device->ifindex = 0;
+        device->lastSeen = now;
+        if (pEnv->debugging_enabled) {
+            char peerIP[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &pEnv->federation->peers[index].address.sin_addr, peerIP, sizeof(peerIP));
+            fprintf(stderr, "Learned device %s from peer %s\n", inet_ntoa(source.sin_addr), peerIP);
+        }
+    }
+
+    device->peer = index + 1;
+    if (snapshot != 0) {
+        device->snapshot = snapshot;
+    }
+    device_table_touch(&pEnv->devices, device, now + get32(record + 8) + FEDERATION_LEASE_SLACK_MS);
+    return 0;
+}
+
+// Returns 0 when a record could not be applied
+static int apply_records(Environment *pEnv, int index, const char *data, size_t length, uint32_t snapshot) {
+    FederationPeer *peer = &pEnv->federation->peers[index];
+    int complete = 1;
+
+    while (length >= FEDERATION_RECORD_SIZE && length >= FEDERATION_RECORD_SIZE + (size_t)(unsigned char)data[1]) {
+        size_t size = FEDERATION_RECORD_SIZE + (unsigned char)data[1];
+        int result = apply_record(pEnv, index, data, snapshot);
+
+        if (result < 0) {
+            complete = 0;
+        } else if (result > 0 && snapshot != 0) {
+            // Left out of our view of the peer, but part of its digest
+            peer->shadowCount++;
+            peer->shadowHash ^= announce_hash(data + 4, data + 2, data + FEDERATION_RECORD_SIZE, size - FEDERATION_RECORD_SIZE);
+        }
+        data += size;
+        length -= size;
+    }
+    return complete;
+}
+
+static void handle_datagram(Environment *pEnv, int index, const char *data, size_t length) {
+    Federation *federation = pEnv->federation;
+    FederationPeer *peer = &federation->peers[index];
+    uint32_t instance, sequence, snapshot;
+    int flags;
+
+    if (length < FEDERATION_HEADER_SIZE || memcmp(data, magic, sizeof(magic)) != 0 || data[4] != FEDERATION_VERSION) {
+        return;
+    }
+    flags = data[6];
+    instance = get32(data + 8);
+    sequence = get32(data + 12);
+    snapshot = get32(data + 16);
+
+    // A restarted peer starts over, with new sequence numbers
+    if (instance != peer->instance) {
+        if (peer->instance != 0) {
+            char msg[80];
+            snprintf(msg, sizeof(msg), "Federation peer %s restarted", inet_ntoa(peer->address.sin_addr));
+            logger(pEnv, msg, 0);
+            forget_devices(pEnv, index, 1, 0);
+        }
+        peer->instance = instance;
+        peer->synchronized = 0;
+        peer->lastRequest = 0;
+    }
+
+    switch (data[5]) {
+        case FEDERATION_DELTA:
+            if (!apply_records(pEnv, index, data + FEDERATION_HEADER_SIZE, length - FEDERATION_HEADER_SIZE, 0) ||
+                sequence != peer->nextSequence) {
+                peer->synchronized = 0;
+            }
+            peer->nextSequence = sequence + 1;
+            break;
+        case FEDERATION_DIGEST:
+            if (length >= FEDERATION_HEADER_SIZE + FEDERATION_DIGEST_SIZE) {
+                uint32_t count;
+                uint64_t hash;
+                digest_compute(pEnv, index + 1, &count, &hash);
+                count += peer->shadowCount;
+                hash ^= peer->shadowHash;
+                if (sequence + 1 != peer->nextSequence || count != get32(data + FEDERATION_HEADER_SIZE) ||
+                    hash != ((uint64_t)get32(data + FEDERATION_HEADER_SIZE + 4) << 32 | get32(data + FEDERATION_HEADER_SIZE + 8))) {
+                    peer->synchronized = 0;
+                }
+            }
+            break;
+        case FEDERATION_REQUEST:
+            send_snapshot(pEnv, peer);
+            return;
+        case FEDERATION_SNAPSHOT:
+            if (flags & FEDERATION_SNAPSHOT_FIRST) {
+                peer->snapshot = snapshot;
+                peer->shadowCount = 0;
+                peer->shadowHash = 0;
+            }
+            apply_records(pEnv, index, data + FEDERATION_HEADER_SIZE, length - FEDERATION_HEADER_SIZE, snapshot);
+            // Only a complete snapshot tells which devices are gone
+            if ((flags & FEDERATION_SNAPSHOT_LAST) && snapshot == peer->snapshot) {
+                forget_devices(pEnv, index, 0, snapshot);
+                peer->nextSequence = sequence + 1;
+                peer->synchronized = 1;
+                peer->lastRequest = 0;
+            }
+            break;
+    }
+
+    if (!peer->synchronized) {
+        request_snapshot(pEnv, peer);
+    }
+}
+
+// Check and strip the tag of a datagram, 0 when it must be dropped
+static int datagram_authentic(const Federation *federation, const char *data, size_t *length) {
+    unsigned char tag[SHA256_DIGEST_SIZE];
+    int tagged = *length >= FEDERATION_HEADER_SIZE && (data[7] & FEDERATION_AUTHENTICATED);
+
+    // Without a key, a tag cannot be told from records
+    if (!federation->authenticated) {
+        return !tagged;
+    }
+    if (!tagged || *length < FEDERATION_HEADER_SIZE + FEDERATION_TAG_SIZE) {
+        return 0;
+    }
+    *length -= FEDERATION_TAG_SIZE;
+    hmac_sha256(&federation->key, data, *length, tag);
+    return hmac_equal(tag, data + *length, FEDERATION_TAG_SIZE);
+}
+
+static void handle_federation_socket(EventSource *source, uint32_t events) {
+    Environment *pEnv = source->ctx;
+    Federation *federation = pEnv->federation;
+    char buffer[FEDERATION_DATAGRAM_MAX];
+    struct sockaddr_in sender;
+    socklen_t senderLength;
+    ssize_t received;
+
+    (void)events;
+    for (;;) {
+        senderLength = sizeof(sender);
+        received = recvfrom(source->fd, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr *)&sender, &senderLength);
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EINTR && pEnv->debugging_enabled) {
+                fprintf(stderr, "Federation receive failed: %s\n", strerror(errno));
+            }
+            break;
+        }
+
+        // Only configured peers are listened to
+        for (int i = 0; i < federation->peerCount; i++) {
+            size_t length = received;
+
+            if (federation->peers[i].address.sin_addr.s_addr != sender.sin_addr.s_addr ||
+                federation->peers[i].address.sin_port != sender.sin_port) {
+                continue;
+            }
+            if (!datagram_authentic(federation, buffer, &length)) {
+                metric_add(pEnv->metrics, METRIC_FEDERATION_REJECTED, 1);
+                if (pEnv->debugging_enabled) {
+                    fprintf(stderr, "Federation datagram from %s:%d failed authentication\n", inet_ntoa(sender.sin_addr), ntohs(sender.sin_port));
+                }
+                break;
+            }
+            handle_datagram(pEnv, i, buffer, length);
+            break;
+        }
+    }
+
+    workers_publish(pEnv);
+}
+
+static void handle_flush_timer(EventSource *source, uint32_t events) {
+    Environment *pEnv = source->ctx;
+
+    (void)events;
+    if (event_timer_ack(source) != 0) {
+        flush_deltas(pEnv);
+    }
+}
+
+static void handle_digest_timer(EventSource *source, uint32_t events) {
+    Environment *pEnv = source->ctx;
+    Federation *federation = pEnv->federation;
+    char buffer[FEDERATION_HEADER_SIZE + FEDERATION_DIGEST_SIZE];
+    uint32_t count;
+    uint64_t hash;
+
+    (void)events;
+    if (event_timer_ack(source) == 0) {
+        return;
+    }
+
+    // The digest covers every delta sent so far
+    flush_deltas(pEnv);
+    digest_compute(pEnv, 0, &count, &hash);
+    header_write(federation, buffer, FEDERATION_DIGEST, 0, 0);
+    put32(buffer + FEDERATION_HEADER_SIZE, count);
+    put32(buffer + FEDERATION_HEADER_SIZE + 4, hash >> 32);
+    put32(buffer + FEDERATION_HEADER_SIZE + 8, hash);
+    for (int i = 0; i < federation->peerCount; i++) {
+        send_to_peer(pEnv, &federation->peers[i], buffer, sizeof(buffer));
+    }
+}
+
+// [address:]port, any address by default
+static int parse_endpoint(const char *endpoint, const char *anyHost, struct sockaddr_in *address) {
+    const char *colon = strrchr(endpoint, ':');
+    char host[INET_ADDRSTRLEN];
+
+    snprintf(host, sizeof(host), "%s", anyHost);
+    if (colon != NULL && colon != endpoint) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - endpoint), endpoint);
+    }
+    memset(address, 0, sizeof(*address));
+    address->sin_family = AF_INET;
+    address->sin_port = htons(atoi(colon ? colon + 1 : endpoint));
+    return inet_pton(AF_INET, host, &address->sin_addr) == 1 && address->sin_port != 0 ? 0 : -1;
+}
+
+// The shared key is the content of the file, without the line break ending it
+static void load_key(Federation *federation, const char *path) {
+    char secret[FEDERATION_KEY_MAX + 1];
+    FILE *file = fopen(path, "rb");
+    size_t length;
+
+    if (file == NULL) {
+        perror("Failed to open the federation key");
+        exit(EXIT_FAILURE);
+    }
+    length = fread(secret, 1, sizeof(secret), file);
+    fclose(file);
+    while (length > 0 && (secret[length - 1] == '\n' || secret[length - 1] == '\r')) {
+        length--;
+    }
+    if (length == 0 || length > FEDERATION_KEY_MAX) {
+        fprintf(stderr, "The federation key must hold 1 to %d bytes: %s\n", FEDERATION_KEY_MAX, path);
+        exit(EXIT_FAILURE);
+    }
+    hmac_key_init(&federation->key, secret, length);
+    memset(secret, 0, sizeof(secret));
+    federation->authenticated = 1;
+}
+
+// Bind the federation socket and ask every peer for its devices
+void federation_open(Environment *pEnv) {
+    Federation *federation;
+    struct sockaddr_in local;
+    char *peers, *token, *saveptr;
+
+    if (pEnv->federation_endpoint == NULL) {
+        return;
+    }
+
+    federation = calloc(1, sizeof(Federation));
+    if (!federation) {
+        perror("Failed to allocate memory for the federation");
+        exit(EXIT_FAILURE);
+    }
+    if (parse_endpoint(pEnv->federation_endpoint, "0.0.0.0", &local) < 0) {
+        fprintf(stderr, "Invalid federation endpoint: %s\n", pEnv->federation_endpoint);
+        exit(EXIT_FAILURE);
+    }
+
+    peers = strdup(pEnv->federation_peers ? pEnv->federation_peers : "");
+    for (token = strtok_r(peers, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr)) {
+        if (federation->peerCount == FEDERATION_PEERS_MAX ||
+            parse_endpoint(token, "", &federation->peers[federation->peerCount].address) < 0) {
+            fprintf(stderr, "Invalid or too many federation peers: %s\n", token);
+            exit(EXIT_FAILURE);
+        }
+        federation->peerCount++;
+    }
+    free(peers);
+
+    if (pEnv->federation_key != NULL) {
+        load_key(federation, pEnv->federation_key);
+    }
+
+    while (federation->instance == 0) {
+        if (getrandom(&federation->instance, sizeof(federation->instance), 0) < 0) {
+            federation->instance = getpid() ^ monotonic_ms();
+        }
+    }
+
+    if ((federation->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(federation->fd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+        perror("federation socket setup failed");
+        exit(EXIT_FAILURE);
+    }
+    pEnv->federation = federation;
+
+    federation->socket.fd = federation->fd;
+    federation->socket.handler = handle_federation_socket;
+    federation->socket.ctx = pEnv;
+    if (event_loop_add(pEnv->loop, &federation->socket, EPOLLIN) < 0 ||
+        event_timer_create(pEnv->loop, &federation->flushTimer, handle_flush_timer, pEnv) < 0 ||
+        event_timer_create(pEnv->loop, &federation->digestTimer, handle_digest_timer, pEnv) < 0 ||
+        event_timer_set_periodic(&federation->digestTimer, FEDERATION_DIGEST_MS) < 0) {
+        logger(pEnv, "federation event setup failed", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < federation->peerCount; i++) {
+        request_snapshot(pEnv, &federation->peers[i]);
+    }
+}
@@ -0,0 +1,86 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "types.h"
+#include "eventloop.h"
+#include "hmac.h"
+
+#define FEDERATION_VERSION 1
+#define FEDERATION_PEERS_MAX 32
+#define FEDERATION_DATAGRAM_MAX 1400   // Stays below the path MTU of most WAN links
+#define FEDERATION_FLUSH_MS 20         // Deltas are gathered that long before being sent
+#define FEDERATION_DIGEST_MS 5000      // Anti-entropy period
+#define FEDERATION_LEASE_SLACK_MS 2000 // Added to the lifetime of a device learned from a peer
+#define FEDERATION_PAYLOAD_MAX 255     // Devices with larger responses are not shared
+#define FEDERATION_TAG_SIZE 16         // Truncated HMAC-SHA256 ending the datagrams, with -K
+#define FEDERATION_BODY_MAX (FEDERATION_DATAGRAM_MAX - FEDERATION_TAG_SIZE)
+#define FEDERATION_KEY_MAX 1024
+
+// Datagram types
+typedef enum {
+    FEDERATION_DELTA = 1,    // Changes to the sender's devices, sequenced
+    FEDERATION_DIGEST = 2,   // Summary of the sender's devices
+    FEDERATION_REQUEST = 3,  // Ask for a snapshot, the digest did not match
+    FEDERATION_SNAPSHOT = 4  // Every device of the sender, over one or more datagrams
+} FederationType;
+
+// Record operations, in DELTA and SNAPSHOT datagrams
+typedef enum {
+    FEDERATION_ADD = 1,      // Carries the payload
+    FEDERATION_REFRESH = 2,  // Extends the lease of a known device
+    FEDERATION_EXPIRE = 3
+} FederationOp;
+
+#define FEDERATION_SNAPSHOT_FIRST 1
+#define FEDERATION_SNAPSHOT_LAST 2
+
+// Header options
+#define FEDERATION_AUTHENTICATED 1 // A tag follows the records
+
+// Datagram header, multi-byte fields in network byte order
+#define FEDERATION_HEADER_SIZE 20 // magic[4] version type flags options instance sequence snapshot
+#define FEDERATION_RECORD_SIZE 12 // op length port address lease, then length bytes of payload
+#define FEDERATION_DIGEST_SIZE 12 // count hash
+
+typedef struct {
+    struct sockaddr_in address;
+    uint32_t instance;        // Of the peer process, 0 until heard from
+    uint32_t nextSequence;    // Next DELTA expected
+    uint32_t snapshot;        // Snapshot being received
+    int synchronized;         // No DELTA missed since the last snapshot
+    uint32_t shadowCount;     // Devices of its last snapshot that we hear ourselves
+    uint64_t shadowHash;
+    uint64_t lastRequest;     // Monotonic time (ms) of the last snapshot request
+} FederationPeer;
+
+typedef struct Federation {
+    int fd;
+    EventSource socket;
+    EventSource flushTimer;
+    EventSource digestTimer;
+    uint32_t instance;        // Random, tells a restarted peer apart
+    uint32_t sequence;        // Of the last DELTA sent
+    uint32_t snapshot;        // Of the last SNAPSHOT sent
+    int authenticated;        // Datagrams carry a tag made with key, both ways
+    HmacKey key;
+    int peerCount;
+    FederationPeer peers[FEDERATION_PEERS_MAX];
+    size_t pending;           // Bytes of delta records waiting in buffer
+    char buffer[FEDERATION_DATAGRAM_MAX];
+} Federation;
+
+void federation_open(Environment *);
+void federation_device_learned(Environment *, DiscoveredDevice *);
+void federation_device_refreshed(Environment *, DiscoveredDevice *);
+void federation_device_expired(Environment *, DiscoveredDevice *);
+
+#endif
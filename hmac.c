@@ -0,0 +1,151 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#include <string.h>
+#include <stdint.h>
+
+#include "hmac.h"
+
+/*
+ * HMAC-SHA256 (RFC 2104, FIPS 180-4), which authenticates the federation
+ * datagrams. Messages are a few hundred bytes, so a plain implementation
+ * does, without pulling a crypto library in.
+ */
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t ror(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_block(Sha256 *ctx, const unsigned char *block) {
+    uint32_t w[64], s[8];
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    memcpy(s, ctx->state, sizeof(s));
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = s[7] + (ror(s[4], 6) ^ ror(s[4], 11) ^ ror(s[4], 25)) + ((s[4] & s[5]) ^ (~s[4] & s[6])) + K[i] + w[i];
+        uint32_t t2 = (ror(s[0], 2) ^ ror(s[0], 13) ^ ror(s[0], 22)) + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+        memmove(s + 1, s, 7 * sizeof(s[0]));
+        s[4] += t1;
+        s[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; i++) {
+        ctx->state[i] += s[i];
+    }
+}
+
+void sha256_init(Sha256 *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void sha256_update(Sha256 *ctx, const void *data, size_t length) {
+    const unsigned char *at = data;
+
+    ctx->length += length;
+    while (length > 0) {
+        size_t chunk = SHA256_BLOCK_SIZE - ctx->used < length ? SHA256_BLOCK_SIZE - ctx->used : length;
+
+        memcpy(ctx->block + ctx->used, at, chunk);
+        ctx->used += chunk;
+        at += chunk;
+        length -= chunk;
+        if (ctx->used == SHA256_BLOCK_SIZE) {
+            sha256_block(ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+void sha256_final(Sha256 *ctx, unsigned char *digest) {
+    uint64_t bits = ctx->length * 8;
+
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > SHA256_BLOCK_SIZE - 8) {
+        memset(ctx->block + ctx->used, 0, SHA256_BLOCK_SIZE - ctx->used);
+        sha256_block(ctx, ctx->block);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, SHA256_BLOCK_SIZE - 8 - ctx->used);
+    for (int i = 0; i < 8; i++) {
+        ctx->block[SHA256_BLOCK_SIZE - 1 - i] = bits >> (8 * i);
+    }
+    sha256_block(ctx, ctx->block);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = ctx->state[i] >> 24;
+        digest[4 * i + 1] = ctx->state[i] >> 16;
+        digest[4 * i + 2] = ctx->state[i] >> 8;
+        digest[4 * i + 3] = ctx->state[i];
+    }
+}
+
+// Keys longer than a block are hashed first, as RFC 2104 asks
+void hmac_key_init(HmacKey *key, const void *secret, size_t length) {
+    unsigned char block[SHA256_BLOCK_SIZE] = { 0 };
+
+    if (length > SHA256_BLOCK_SIZE) {
+        Sha256 ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, secret, length);
+        sha256_final(&ctx, block);
+    } else {
+        memcpy(block, secret, length);
+    }
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        key->inner[i] = block[i] ^ 0x36;
+        key->outer[i] = block[i] ^ 0x5c;
+    }
+}
+
+void hmac_sha256(const HmacKey *key, const void *data, size_t length, unsigned char *mac) {
+    unsigned char inner[SHA256_DIGEST_SIZE];
+    Sha256 ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, key->inner, sizeof(key->inner));
+    sha256_update(&ctx, data, length);
+    sha256_final(&ctx, inner);
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, key->outer, sizeof(key->outer));
+    sha256_update(&ctx, inner, sizeof(inner));
+    sha256_final(&ctx, mac);
+}
+
+// Compare in constant time, so that a forged tag cannot be guessed byte by byte
+int hmac_equal(const void *a, const void *b, size_t length) {
+    const unsigned char *x = a, *y = b;
+    unsigned char diff = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        diff |= x[i] ^ y[i];
+    }
+    return diff == 0;
+}
@@ -0,0 +1,36 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#ifndef HMAC_H
+#define HMAC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_DIGEST_SIZE 32
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length; // Bytes hashed so far
+    unsigned char block[SHA256_BLOCK_SIZE];
+    size_t used;     // Bytes waiting in block
+} Sha256;
+
+// A key, padded once for every message it authenticates
+typedef struct {
+    unsigned char inner[SHA256_BLOCK_SIZE];
+    unsigned char outer[SHA256_BLOCK_SIZE];
+} HmacKey;
+
+void sha256_init(Sha256 *);
+void sha256_update(Sha256 *, const void *, size_t);
+void sha256_final(Sha256 *, unsigned char *);
+void hmac_key_init(HmacKey *, const void *, size_t);
+void hmac_sha256(const HmacKey *, const void *, size_t, unsigned char *);
+int hmac_equal(const void *, const void *, size_t);
+
+#endif
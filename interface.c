@@ -8,8 +8,6 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
-#include <ctype.h>
-#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <net/if.h>
@@ -17,43 +15,66 @@
 #include "types.h"
 #include "interface.h"
 
-void setInterfaceIPAddress(InterfaceNode* node) {
-    int fd;
-    struct ifreq ifr;
-    char ip[INET_ADDRSTRLEN];
-
-	// Open a dummy socket to perform the ioctl
-    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        perror("socket");
-        return;
+// A node for a selected interface, without an address until netlink reports one
+InterfaceNode* newInterfaceNode(const char* name) {
+    InterfaceNode* node = calloc(1, sizeof(InterfaceNode));
+    if (!node || !(node->name = strdup(name))) {
+        perror("Failed to allocate memory for new interface node");
+        exit(EXIT_FAILURE);
     }
+    node->address.sin_family = AF_INET;
+    node->socket.fd = -1;
+    node->probeTimer.fd = -1;
+    return node;
+}
 
-	// Prepare the interface request structure
-    memset(&ifr, 0, sizeof(ifr));
-    ifr.ifr_addr.sa_family = AF_INET; // IPv4 address
-    strncpy(ifr.ifr_name, node->name, IFNAMSIZ-1);
+InterfaceNode* findInterfaceByName(InterfaceNode* node, const char* name) {
+    for (InterfaceNode* current = node; current != NULL; current = current->next) {
+        if (strcmp(current->name, name) == 0) {
+            return current;
+        }
+    }
+    return NULL;
+}
 
-	// Retrieve the interface address
-    if (ioctl(fd, SIOCGIFADDR, &ifr) < 0) {
-        perror(node->name);
-        close(fd);
-		fprintf(stderr, "Error: Interface %s does not exist on this system or does not have an IP address assigned.\n", node->name);
-        exit(EXIT_FAILURE);
+InterfaceNode* findInterfaceByIndex(InterfaceNode* node, int ifindex) {
+    for (InterfaceNode* current = node; current != NULL && ifindex != 0; current = current->next) {
+        if (current->ifindex == ifindex) {
+            return current;
+        }
     }
+    return NULL;
+}
 
-    close(fd);
+int interfaceHasAddress(const InterfaceNode* node) {
+    return node->address.sin_addr.s_addr != htonl(INADDR_ANY);
+}
 
-	// Copy the address to the node's sockaddr_in structure
-    memcpy(&node->address, (struct sockaddr_in *)&ifr.ifr_addr, sizeof(struct sockaddr_in));
+// Worker threads walk the list while the main thread appends nodes and
+// changes addresses, through these. Nodes are published with a release
+// store (linkwatch.c), addresses are single words stored atomically.
+InterfaceNode* interfaceListHead(InterfaceNode* const* list) {
+    return __atomic_load_n(list, __ATOMIC_ACQUIRE);
+}
 
-    // Convert the IP address to string and store it in the node
-    inet_ntop(AF_INET, &((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr, ip, INET_ADDRSTRLEN);
-    node->ipAddress = strdup(ip);
+InterfaceNode* interfaceListNext(const InterfaceNode* node) {
+    return __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
 }
 
-void enrichInterfaceNodes(InterfaceNode* node) {
-    for (InterfaceNode* current = node; current != NULL; current = current->next) {
-        setInterfaceIPAddress(current);
+in_addr_t interfaceAddress(const InterfaceNode* node) {
+    return __atomic_load_n(&node->address.sin_addr.s_addr, __ATOMIC_RELAXED);
+}
+
+// Worker threads compare their datagrams against the address, the store is atomic
+void setInterfaceAddress(InterfaceNode* node, struct in_addr address) {
+    char ip[INET_ADDRSTRLEN];
+
+    __atomic_store_n(&node->address.sin_addr.s_addr, address.s_addr, __ATOMIC_RELAXED);
+    free(node->ipAddress);
+    node->ipAddress = NULL;
+    if (address.s_addr != htonl(INADDR_ANY)) {
+        inet_ntop(AF_INET, &address, ip, INET_ADDRSTRLEN);
+        node->ipAddress = strdup(ip);
     }
 }
 
@@ -62,6 +83,7 @@ void freeInterfaceList(InterfaceNode* node) {
     while (current) {
         InterfaceNode* next = current->next;
         free(current->name);
+        free(current->ipAddress);
         free(current);
         current = next;
     }
@@ -69,6 +91,6 @@ void freeInterfaceList(InterfaceNode* node) {
 
 void dumpInterfaceList(InterfaceNode* node) {
 	for (InterfaceNode* current = node; current != NULL; current = current->next) {
-        fprintf(stderr, "Interface %s (%s)\n", current->name, current->ipAddress);
+        fprintf(stderr, "Interface %s (%s)\n", current->name, current->ipAddress ? current->ipAddress : "no address yet");
     }
 }
@@ -7,11 +7,19 @@
 #ifndef INTERFACE_H
 #define INTERFACE_H
 
+#include <netinet/in.h>
+
 #include "types.h"
 
-void setInterfaceIPAddress(InterfaceNode* node);
-void enrichInterfaceNodes(InterfaceNode* node);
+InterfaceNode* newInterfaceNode(const char* name);
+InterfaceNode* findInterfaceByName(InterfaceNode* node, const char* name);
+InterfaceNode* findInterfaceByIndex(InterfaceNode* node, int ifindex);
+int interfaceHasAddress(const InterfaceNode* node);
+InterfaceNode* interfaceListHead(InterfaceNode* const* list);
+InterfaceNode* interfaceListNext(const InterfaceNode* node);
+in_addr_t interfaceAddress(const InterfaceNode* node);
+void setInterfaceAddress(InterfaceNode* node, struct in_addr address);
 void freeInterfaceList(InterfaceNode* node);
 void dumpInterfaceList(InterfaceNode* node);
 
-#endif
\ No newline at end of file
+#endif
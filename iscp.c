@@ -0,0 +1,145 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+/*
+ * eISCP datagrams: a header ("ISCP", header size, data size, version, all
+ * sizes big-endian) followed by one ISCP message, "!" unit command parameter,
+ * ended by some combination of EOF, CR and LF.
+ *
+ * iscp_parse() checks the header against the datagram and returns a view of
+ * the message, without copying it. iscp_parse_ecn() decodes the parameter of
+ * a discovery response in a single pass, rejecting anything malformed.
+ *
+ * The unit type tells the category of a device: '1' for receivers, other
+ * digits and letters for other kinds of devices or brands. A query names the
+ * category it wants answers from, or 'x' for every device.
+ */
+#include <string.h>
+#include <stdint.h>
+
+#include "iscp.h"
+
+static uint32_t get32(const char *at) {
+    const unsigned char *p = (const unsigned char *)at;
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Devices end messages with EOF (0x1A, some send 0x19), CR, LF or several of them
+static int is_terminator(char c) {
+    return c == 0x1A || c == 0x19 || c == '\r' || c == '\n' || c == '\0';
+}
+
+static int is_printable(char c) {
+    return c >= 0x20 && c <= 0x7E && c != '/';
+}
+
+static int is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static int is_alnum(char c) {
+    return is_digit(c) || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+// Index of a unit type among the categories, -1 for 'x' and invalid ones
+int iscp_category(char unit) {
+    if (unit >= '0' && unit <= '9') {
+        return unit - '0';
+    } else if (unit >= 'A' && unit <= 'Z') {
+        return 10 + unit - 'A';
+    } else if (unit >= 'a' && unit <= 'z' && unit != ISCP_UNIT_ANY) {
+        return 36 + unit - 'a';
+    }
+    return -1;
+}
+
+int iscp_parse(const char *packet, size_t length, IscpMessage *message) {
+    uint32_t headerSize, dataSize;
+    const char *data;
+
+    if (length < ISCP_HEADER_SIZE || memcmp(packet, "ISCP", 4) != 0) {
+        return -1;
+    }
+    headerSize = get32(packet + 4);
+    dataSize = get32(packet + 8);
+    if (headerSize < ISCP_HEADER_SIZE || headerSize > length || dataSize > length - headerSize ||
+        packet[12] != ISCP_VERSION) {
+        return -1;
+    }
+
+    data = packet + headerSize;
+    while (dataSize > 0 && is_terminator(data[dataSize - 1])) {
+        dataSize--;
+    }
+    // Start character, unit type and a three-letter command at least
+    if (dataSize < 5 || data[0] != '!') {
+        return -1;
+    }
+
+    message->data = data;
+    message->length = dataSize;
+    message->unit = data[1];
+    message->command = data + 2;
+    message->parameter = data + 5;
+    message->parameterLength = dataSize - 5;
+    return 0;
+}
+
+// Copy one field up to the next slash (or the end when last), NULL if invalid
+static const char* take_field(const char *p, const char *end, char *out, size_t size, int (*valid)(char), int last) {
+    size_t n = 0;
+
+    for (; p < end && *p != '/'; p++) {
+        if (n == size - 1 || !valid(*p)) {
+            return NULL;
+        }
+        out[n++] = *p;
+    }
+    if (n == 0 || (last ? p != end : p == end)) {
+        return NULL;
+    }
+    out[n] = '\0';
+    return p;
+}
+
+// "model/port/region/identifier", as in TX-NR686/60128/DX/0009B0123456
+int iscp_parse_ecn(const IscpMessage *message, EcnRecord *record) {
+    const char *p = message->parameter;
+    const char *end = p + message->parameterLength;
+    char port[6];
+    uint32_t value = 0;
+
+    memset(record, 0, sizeof(*record));
+    if (iscp_category(message->unit) < 0) {
+        return -1;
+    }
+    record->unit = message->unit;
+    if ((p = take_field(p, end, record->model, sizeof(record->model), is_printable, 0)) == NULL ||
+        (p = take_field(p + 1, end, port, sizeof(port), is_digit, 0)) == NULL ||
+        (p = take_field(p + 1, end, record->region, sizeof(record->region), is_alnum, 0)) == NULL ||
+        take_field(p + 1, end, record->identifier, sizeof(record->identifier), is_alnum, 1) == NULL) {
+        return -1;
+    }
+
+    for (const char *digit = port; *digit; digit++) {
+        value = value * 10 + (*digit - '0');
+    }
+    if (value == 0 || value > 65535) {
+        return -1;
+    }
+    record->port = value;
+    return 0;
+}
+
+// A whole ECN response datagram, as stored in the device table
+int iscp_decode_response(const char *packet, size_t length, EcnRecord *record) {
+    IscpMessage message;
+
+    if (iscp_parse(packet, length, &message) < 0 || memcmp(message.command, "ECN", 3) != 0) {
+        return -1;
+    }
+    return iscp_parse_ecn(&message, record);
+}
@@ -0,0 +1,44 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#ifndef ISCP_H
+#define ISCP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ISCP_HEADER_SIZE 16     // Smallest header, the one every device sends
+#define ISCP_VERSION 1
+#define ISCP_MODEL_SIZE 32      // Model names are around 10 characters
+#define ISCP_IDENTIFIER_SIZE 26 // Usually the 12 hex digits of the MAC address
+#define ISCP_UNIT_ANY 'x'       // Unit type of queries addressed to every device
+#define ISCP_CATEGORIES 62      // Unit types a device can have: digits and letters
+
+// One ISCP message, pointing into the datagram it was parsed from
+typedef struct {
+    const char *data;       // From the '!' start character
+    size_t length;          // End-of-message characters excluded
+    char unit;              // Unit type: '1' for a receiver, 'x' for any, see iscp_category()
+    const char *command;    // Three characters, e.g. "ECN"
+    const char *parameter;  // What follows the command, not NUL-terminated
+    size_t parameterLength;
+} IscpMessage;
+
+// Decoded ECN response: "model/port/region/identifier"; 64 bytes
+typedef struct {
+    uint16_t port;                          // TCP port of the ISCP service
+    char unit;                              // Unit type of the device, its category
+    char region[3];                         // "DX", "XX", "JJ"...
+    char model[ISCP_MODEL_SIZE];
+    char identifier[ISCP_IDENTIFIER_SIZE];  // Never empty, responses without one are rejected
+} EcnRecord;
+
+int iscp_category(char);
+int iscp_parse(const char *, size_t, IscpMessage *);
+int iscp_parse_ecn(const IscpMessage *, EcnRecord *);
+int iscp_decode_response(const char *, size_t, EcnRecord *);
+
+#endif
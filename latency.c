@@ -0,0 +1,163 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "types.h"
+#include "utilities.h"
+#include "workers.h"
+#include "latency.h"
+
+/*
+ * Latencies are measured from the kernel receive timestamp of a query
+ * (SO_TIMESTAMPNS) to the return of the send call carrying the last reply
+ * of its burst, and kept in log-bucketed histograms in the style of HDR
+ * histograms: every power of two is split into 2^LATENCY_SUB_BITS linear
+ * buckets, so memory is fixed and the relative error bounded. Each thread
+ * fills its own histograms; they are summed when dumped.
+ */
+
+static const char *size_class_names[LATENCY_SIZE_CLASSES] = { "0-9", "10-99", "100-999", "1000+" };
+static const double quantiles[] = { 0.5, 0.99, 0.999 };
+
+LatencyHistogram* latency_create() {
+    LatencyHistogram *hist = calloc(1, sizeof(LatencyHistogram));
+    if (!hist) {
+        perror("Failed to allocate memory for latency histogram");
+        exit(EXIT_FAILURE);
+    }
+    return hist;
+}
+
+static unsigned int bucket_index(uint64_t value) {
+    unsigned int exponent;
+
+    if (value < (1 << LATENCY_SUB_BITS)) {
+        return value;
+    }
+    exponent = 63 - __builtin_clzll(value);
+    return ((exponent - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) +
+        ((value >> (exponent - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1));
+}
+
+// Highest value that falls into a bucket
+static uint64_t bucket_limit(unsigned int index) {
+    unsigned int exponent;
+    uint64_t sub;
+
+    if (index < (1 << LATENCY_SUB_BITS)) {
+        return index;
+    }
+    exponent = (index >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    sub = index & ((1 << LATENCY_SUB_BITS) - 1);
+    return (((1ULL << LATENCY_SUB_BITS) + sub + 1) << (exponent - LATENCY_SUB_BITS)) - 1;
+}
+
+static int size_class(size_t devices) {
+    int cls = 0;
+
+    for (size_t limit = 10; devices >= limit && cls < LATENCY_SIZE_CLASSES - 1; limit *= 10) {
+        cls++;
+    }
+    return cls;
+}
+
+// Record the time elapsed since a query was received, for a table of that many devices
+void latency_record(LatencyHistogram *hist, const struct timespec *received, size_t devices) {
+    struct timespec now;
+    int64_t elapsed;
+    _Atomic uint64_t *count;
+
+    if (received->tv_sec == 0) {
+        return; // The kernel gave no timestamp
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    elapsed = (now.tv_sec - received->tv_sec) * 1000000000LL + (now.tv_nsec - received->tv_nsec);
+    if (elapsed < 0) {
+        elapsed = 0;
+    }
+
+    // Only the owning thread writes, no need for a locked increment
+    count = &hist->counts[size_class(devices)][bucket_index(elapsed)];
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+// Sum the histograms of every thread for one size class, returns the number of samples
+static uint64_t latency_sum(Environment *pEnv, int cls, uint64_t *counts) {
+    uint64_t total = 0;
+
+    memset(counts, 0, LATENCY_BUCKETS * sizeof(uint64_t));
+    for (int i = -1; i < (pEnv->workers ? pEnv->workers->count : 0); i++) {
+        LatencyHistogram *hist = i < 0 ? pEnv->latency : pEnv->workers->workers[i].env.latency;
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            uint64_t n = atomic_load_explicit(&hist->counts[cls][b], memory_order_relaxed);
+            counts[b] += n;
+            total += n;
+        }
+    }
+    return total;
+}
+
+static uint64_t quantile(const uint64_t *counts, uint64_t total, double q) {
+    uint64_t rank = (uint64_t)(q * total);
+    uint64_t seen = 0;
+
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += counts[b];
+        if (seen > rank) {
+            return bucket_limit(b);
+        }
+    }
+    return bucket_limit(LATENCY_BUCKETS - 1);
+}
+
+// Log p50/p99/p999 for every table size class that has samples
+void latency_log(Environment *pEnv) {
+    uint64_t counts[LATENCY_BUCKETS];
+    char msg[160];
+
+    for (int cls = 0; cls < LATENCY_SIZE_CLASSES; cls++) {
+        uint64_t total = latency_sum(pEnv, cls, counts);
+        if (total == 0) {
+            continue;
+        }
+        snprintf(msg, sizeof(msg), "Reply latency with %s devices over %llu queries: p50 %.1f us, p99 %.1f us, p999 %.1f us",
+            size_class_names[cls], (unsigned long long)total,
+            quantile(counts, total, 0.5) / 1000.0, quantile(counts, total, 0.99) / 1000.0,
+            quantile(counts, total, 0.999) / 1000.0);
+        logger(pEnv, msg, 0);
+    }
+}
+
+// Write the histograms as a Prometheus summary into buf, returns its length
+size_t latency_render(Environment *pEnv, char *buf, size_t size) {
+    uint64_t counts[LATENCY_BUCKETS];
+    size_t len;
+    int n;
+
+    n = snprintf(buf, size, "# HELP eiscp_reply_latency_seconds Time from query reception to the last reply sent\n"
+                            "# TYPE eiscp_reply_latency_seconds summary\n");
+    len = n < 0 || (size_t)n >= size ? size : (size_t)n;
+
+    for (int cls = 0; cls < LATENCY_SIZE_CLASSES && len < size; cls++) {
+        uint64_t total = latency_sum(pEnv, cls, counts);
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]) && len < size; q++) {
+            n = snprintf(buf + len, size - len, "eiscp_reply_latency_seconds{devices=\"%s\",quantile=\"%g\"} %.9f\n",
+                size_class_names[cls], quantiles[q], total ? quantile(counts, total, quantiles[q]) / 1e9 : 0.0);
+            len = n < 0 || len + n >= size ? size : len + n;
+        }
+        if (len < size) {
+            n = snprintf(buf + len, size - len, "eiscp_reply_latency_seconds_count{devices=\"%s\"} %llu\n",
+                size_class_names[cls], (unsigned long long)total);
+            len = n < 0 || len + n >= size ? size : len + n;
+        }
+    }
+    return len;
+}
@@ -0,0 +1,31 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "types.h"
+
+#define LATENCY_SUB_BITS 3 // Sub-buckets per power of two: 2^3, for a 12.5% resolution
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+#define LATENCY_SIZE_CLASSES 4 // Table sizes up to 9, 99, 999, and beyond
+
+// Query-to-reply latencies (ns) of one thread, by device table size class
+typedef struct LatencyHistogram {
+    _Atomic uint64_t counts[LATENCY_SIZE_CLASSES][LATENCY_BUCKETS];
+} LatencyHistogram;
+
+LatencyHistogram* latency_create();
+void latency_record(LatencyHistogram *, const struct timespec *, size_t);
+void latency_log(Environment *);
+size_t latency_render(Environment *, char *, size_t);
+
+#endif
@@ -0,0 +1,334 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+/*
+ * Interface tracking over rtnetlink.
+ *
+ * At startup a single RTM_GETADDR dump gives the address of every selected
+ * interface and resolves the -i wildcards. Afterwards the link and IPv4
+ * address notifications keep the list current: an interface that gets a new
+ * address (DHCP renewal, VLAN re-created, cable plugged back) has its
+ * broadcast socket rebuilt and is probed aggressively again, the other
+ * interfaces are left alone. An interface that disappears is kept, without
+ * address, until it comes back.
+ *
+ * Nodes are only ever appended to the interface list and never freed, so
+ * that worker threads can walk it while the main thread extends it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "types.h"
+#include "eventloop.h"
+#include "interface.h"
+#include "packet_processing.h"
+#include "scheduler.h"
+#include "workers.h"
+#include "utilities.h"
+#include "linkwatch.h"
+
+typedef struct LinkWatch {
+    EventSource source;
+    uint32_t sequence; // Of the last dump requested
+    char buffer[LINKWATCH_BUFFER_SIZE];
+} LinkWatch;
+
+static int matches_selection(const Environment *pEnv, const char *name) {
+    for (int i = 0; i < pEnv->interface_pattern_count; i++) {
+        if (fnmatch(pEnv->interface_patterns[i], name, 0) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Append a node matched by a pattern, published last for the worker threads
+static InterfaceNode* append_interface(Environment *pEnv, const char *name) {
+    InterfaceNode *node = newInterfaceNode(name);
+    InterfaceNode *tail = pEnv->interfaces;
+
+    if (tail == NULL) {
+        __atomic_store_n(&pEnv->interfaces, node, __ATOMIC_RELEASE);
+        // The workers walk the list from their copy of the environment
+        for (int i = 0; pEnv->workers != NULL && i < pEnv->workers->count; i++) {
+            __atomic_store_n(&pEnv->workers->workers[i].env.interfaces, node, __ATOMIC_RELEASE);
+        }
+        return node;
+    }
+    while (tail->next != NULL) {
+        tail = tail->next;
+    }
+    __atomic_store_n(&tail->next, node, __ATOMIC_RELEASE);
+    return node;
+}
+
+static void request_dump(Environment *pEnv) {
+    LinkWatch *watch = pEnv->linkwatch;
+    struct {
+        struct nlmsghdr header;
+        struct ifaddrmsg message;
+    } request;
+
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+    request.header.nlmsg_type = RTM_GETADDR;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = ++watch->sequence;
+    request.message.ifa_family = AF_INET;
+
+    if (send(watch->source.fd, &request, request.header.nlmsg_len, 0) < 0) {
+        logger(pEnv, "Netlink address dump request failed", errno);
+    }
+}
+
+// Drop the address of an interface; live once the event loop runs
+static void forget_address(Environment *pEnv, InterfaceNode *node, int live) {
+    struct in_addr none = { htonl(INADDR_ANY) };
+    char msg[80];
+
+    if (!interfaceHasAddress(node)) {
+        return;
+    }
+    snprintf(msg, sizeof(msg), "Interface %s lost address %s", node->name, node->ipAddress);
+    logger(pEnv, msg, 0);
+    setInterfaceAddress(node, none);
+    if (live) {
+        close_broadcast_socket(node, pEnv);
+    }
+}
+
+static void handle_address(Environment *pEnv, struct nlmsghdr *header, int live) {
+    struct ifaddrmsg *message = NLMSG_DATA(header);
+    int length = IFA_PAYLOAD(header);
+    struct in_addr *local = NULL, *address = NULL;
+    char name[IF_NAMESIZE];
+    InterfaceNode *node;
+    int created = 0;
+    char msg[80];
+
+    if (message->ifa_family != AF_INET) {
+        return;
+    }
+    name[0] = '\0';
+    for (struct rtattr *rta = IFA_RTA(message); RTA_OK(rta, length); rta = RTA_NEXT(rta, length)) {
+        if (rta->rta_type == IFA_LOCAL) {
+            local = RTA_DATA(rta);
+        } else if (rta->rta_type == IFA_ADDRESS) {
+            address = RTA_DATA(rta);
+        } else if (rta->rta_type == IFA_LABEL) {
+            // The label of an alias is "name:alias"
+            snprintf(name, sizeof(name), "%.*s", (int)strcspn(RTA_DATA(rta), ":"), (char *)RTA_DATA(rta));
+        }
+    }
+    // IFA_ADDRESS is the peer on point-to-point links
+    if (local != NULL) {
+        address = local;
+    }
+    if (address == NULL || (name[0] == '\0' && if_indextoname(message->ifa_index, name) == NULL)) {
+        return;
+    }
+
+    node = findInterfaceByName(pEnv->interfaces, name);
+    if (header->nlmsg_type == RTM_DELADDR) {
+        if (node != NULL && node->address.sin_addr.s_addr == address->s_addr) {
+            forget_address(pEnv, node, live);
+            // The interface may have other addresses left
+            if (live) {
+                request_dump(pEnv);
+            }
+        }
+        return;
+    }
+
+    if (node == NULL) {
+        if (!matches_selection(pEnv, name)) {
+            return;
+        }
+        node = append_interface(pEnv, name);
+        created = 1;
+    }
+    node->ifindex = message->ifa_index;
+    // Secondary addresses are not used
+    if (interfaceHasAddress(node)) {
+        return;
+    }
+
+    node->linkUp = 1;
+    setInterfaceAddress(node, *address);
+    snprintf(msg, sizeof(msg), "Interface %s has address %s", node->name, node->ipAddress);
+    logger(pEnv, msg, 0);
+    if (!live) {
+        return;
+    }
+
+    // Only the socket of this interface is rebuilt
+    close_broadcast_socket(node, pEnv);
+    if (open_broadcast_socket(node, pEnv) < 0) {
+        fprintf(stderr, "Warning: interface %s will be retried on the next discovery cycle\n", node->name);
+    }
+    if (created) {
+        scheduler_add_interface(pEnv, node);
+    } else {
+        scheduler_reset(pEnv, node->ifindex);
+    }
+}
+
+static void handle_link(Environment *pEnv, struct nlmsghdr *header, int live) {
+    struct ifinfomsg *message = NLMSG_DATA(header);
+    int length = IFLA_PAYLOAD(header);
+    const char *name = NULL;
+    int running = (message->ifi_flags & IFF_RUNNING) != 0;
+    char msg[80];
+
+    for (struct rtattr *rta = IFLA_RTA(message); RTA_OK(rta, length); rta = RTA_NEXT(rta, length)) {
+        if (rta->rta_type == IFLA_IFNAME) {
+            name = RTA_DATA(rta);
+        }
+    }
+
+    for (InterfaceNode *current = pEnv->interfaces; current != NULL; current = current->next) {
+        if (name != NULL && strcmp(current->name, name) == 0 && header->nlmsg_type == RTM_NEWLINK) {
+            // A re-created link (a VLAN for instance) comes back with a new index
+            current->ifindex = message->ifi_index;
+            if (running && !current->linkUp && live) {
+                snprintf(msg, sizeof(msg), "Interface %s is up", current->name);
+                logger(pEnv, msg, 0);
+                scheduler_reset(pEnv, current->ifindex);
+            }
+            current->linkUp = running;
+        } else if (current->ifindex == message->ifi_index) {
+            // Deleted, or renamed to something else
+            forget_address(pEnv, current, live);
+            current->ifindex = 0;
+            current->linkUp = 0;
+        }
+    }
+}
+
+// Handle the messages of one datagram, returns 1 at the end of a dump
+static int dispatch(Environment *pEnv, ssize_t received, int live) {
+    LinkWatch *watch = pEnv->linkwatch;
+    int done = 0;
+
+    for (struct nlmsghdr *header = (struct nlmsghdr *)watch->buffer; NLMSG_OK(header, received); header = NLMSG_NEXT(header, received)) {
+        switch (header->nlmsg_type) {
+            case NLMSG_DONE:
+                done = header->nlmsg_seq == watch->sequence;
+                break;
+            case NLMSG_ERROR:
+                logger(pEnv, "Netlink request failed", -((struct nlmsgerr *)NLMSG_DATA(header))->error);
+                done = header->nlmsg_seq == watch->sequence;
+                break;
+            case RTM_NEWADDR:
+            case RTM_DELADDR:
+                handle_address(pEnv, header, live);
+                break;
+            case RTM_NEWLINK:
+            case RTM_DELLINK:
+                handle_link(pEnv, header, live);
+                break;
+        }
+    }
+    return done;
+}
+
+static void handle_linkwatch_event(EventSource *source, uint32_t events) {
+    Environment *pEnv = source->ctx;
+    LinkWatch *watch = pEnv->linkwatch;
+    ssize_t received;
+
+    (void)events;
+    for (;;) {
+        received = recv(source->fd, watch->buffer, sizeof(watch->buffer), MSG_DONTWAIT);
+        if (received < 0) {
+            if (errno == ENOBUFS) {
+                // Notifications were lost, read the addresses again
+                logger(pEnv, "Netlink notifications lost, resynchronizing", errno);
+                request_dump(pEnv);
+                continue;
+            }
+            if (errno != EAGAIN && errno != EINTR) {
+                logger(pEnv, "Netlink receive failed", errno);
+            }
+            return;
+        }
+        dispatch(pEnv, received, 1);
+    }
+}
+
+// Subscribe to link and address changes and resolve the selected interfaces
+void linkwatch_open(Environment *pEnv) {
+    LinkWatch *watch = calloc(1, sizeof(LinkWatch));
+    struct sockaddr_nl local;
+    ssize_t received;
+    char msg[80];
+
+    if (!watch) {
+        perror("Failed to allocate memory for the netlink subscription");
+        exit(EXIT_FAILURE);
+    }
+    pEnv->linkwatch = watch;
+
+    memset(&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    local.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+    watch->source.fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (watch->source.fd < 0 || bind(watch->source.fd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+        logger(pEnv, "Netlink socket setup failed", errno);
+        exit(EXIT_FAILURE);
+    }
+    watch->source.handler = handle_linkwatch_event;
+    watch->source.ctx = pEnv;
+
+    // Notifications arriving meanwhile are applied as well, in order
+    request_dump(pEnv);
+    do {
+        received = recv(watch->source.fd, watch->buffer, sizeof(watch->buffer), 0);
+        if (received < 0 && errno != EINTR && errno != ENOBUFS) {
+            logger(pEnv, "Netlink address dump failed", errno);
+            exit(EXIT_FAILURE);
+        }
+    } while (received <= 0 || !dispatch(pEnv, received, 0));
+
+    for (InterfaceNode *current = pEnv->interfaces; current != NULL; current = current->next) {
+        if (!interfaceHasAddress(current)) {
+            snprintf(msg, sizeof(msg), "Interface %s has no IPv4 address, waiting for one", current->name);
+            logger(pEnv, msg, 0);
+        }
+    }
+    for (int i = 0; i < pEnv->interface_pattern_count; i++) {
+        int matched = 0;
+        for (InterfaceNode *current = pEnv->interfaces; current != NULL; current = current->next) {
+            matched |= fnmatch(pEnv->interface_patterns[i], current->name, 0) == 0;
+        }
+        if (!matched) {
+            snprintf(msg, sizeof(msg), "No interface matches %s yet", pEnv->interface_patterns[i]);
+            logger(pEnv, msg, 0);
+        }
+    }
+}
+
+// Apply changes from the event loop, once the sockets and the scheduler are set up
+void linkwatch_start(Environment *pEnv) {
+    LinkWatch *watch = pEnv->linkwatch;
+
+    if (fcntl(watch->source.fd, F_SETFL, O_NONBLOCK) < 0 ||
+        event_loop_add(pEnv->loop, &watch->source, EPOLLIN) < 0) {
+        logger(pEnv, "Netlink socket setup failed", errno);
+        exit(EXIT_FAILURE);
+    }
+}
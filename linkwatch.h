@@ -0,0 +1,17 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#ifndef LINKWATCH_H
+#define LINKWATCH_H
+
+#include "types.h"
+
+#define LINKWATCH_BUFFER_SIZE 16384 // Netlink messages read at once
+
+void linkwatch_open(Environment *);
+void linkwatch_start(Environment *);
+
+#endif
@@ -23,77 +23,196 @@ https://tascam.com/downloads/tascam/790/pa-r100_200_protocol.pdf
 #include <sys/time.h>
 #include <time.h>
 #include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "types.h"
+#include "eventloop.h"
 #include "interface.h"
 #include "packet_processing.h"
+#include "rawpacket.h"
+#include "checksum.h"
+#include "rxring.h"
+#include "workers.h"
+#include "requesters.h"
+#include "scheduler.h"
+#include "metrics.h"
+#include "latency.h"
+#include "replay.h"
+#include "devcache.h"
+#include "linkwatch.h"
+#include "federation.h"
+#include "sockfilter.h"
+#include "relay.h"
 #include "utilities.h"
 #include "cmdline.h"
 
+// Time to expire old devices, discovery probes have their own timers
+static void handle_expiry_timer(EventSource *source, uint32_t events) {
+	Environment *pEnv = source->ctx;
+
+	if (event_timer_ack(source) == 0) {
+		return;
+	}
+
+	remove_stale_devices(pEnv);
+	workers_publish(pEnv);
+	metrics_sweep(pEnv);
+}
+
+// Log what the query storm protection saved, over every thread
+static void log_query_counters(Environment *pEnv) {
+	uint64_t answered = 0, coalesced = 0, rateLimited = 0, repliesSaved = 0;
+	char msg[160];
+
+	for (int i = -1; i < (pEnv->workers ? pEnv->workers->count : 0); i++) {
+		QueryCounters *counters = i < 0 ? &pEnv->requesters->counters : &pEnv->workers->workers[i].env.requesters->counters;
+		answered += atomic_load_explicit(&counters->answered, memory_order_relaxed);
+		coalesced += atomic_load_explicit(&counters->coalesced, memory_order_relaxed);
+		rateLimited += atomic_load_explicit(&counters->rateLimited, memory_order_relaxed);
+		repliesSaved += atomic_load_explicit(&counters->repliesSaved, memory_order_relaxed);
+	}
+
+	snprintf(msg, sizeof(msg), "Queries answered: %llu, coalesced: %llu, rate limited: %llu, replies saved: %llu",
+		(unsigned long long)answered, (unsigned long long)coalesced,
+		(unsigned long long)rateLimited, (unsigned long long)repliesSaved);
+	logger(pEnv, msg, 0);
+
+	snprintf(msg, sizeof(msg), "Datagrams delivered: %llu, dropped in the kernel: %llu",
+		(unsigned long long)metrics_delivered(pEnv), (unsigned long long)sockfilter_dropped(pEnv));
+	logger(pEnv, msg, 0);
+}
+
+static void handle_signal(EventSource *source, uint32_t events) {
+	struct signalfd_siginfo info;
+
+	while (read(source->fd, &info, sizeof(info)) == sizeof(info)) {
+		if (info.ssi_signo == SIGUSR1) {
+			log_query_counters(source->ctx);
+			latency_log(source->ctx);
+		}
+	}
+}
+
 int main(int argc, char *argv[]) {
 	Environment env;
+	EventSource listener, expiry_timer, signals;
+	sigset_t mask;
     int sockfd;
 
+    handle_command_line(argc, argv, &env);
+
+    // Before any worker thread forges a reply
+    checksum_select(NULL);
+
+    // Replaying a capture needs neither privileges nor interfaces
+    if (env.replay_input != NULL) {
+        replay_run(&env);
+        return 0;
+    }
+    if ((env.federation_peers != NULL || env.federation_key != NULL) && env.federation_endpoint == NULL) {
+        fprintf(stderr, "Error: -p and -K need a federation endpoint, with -F.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (env.replay_output != NULL) {
+        fprintf(stderr, "Error: -o only applies to a replay, with -r.\n");
+        exit(EXIT_FAILURE);
+    }
+
     if (geteuid() != 0) {
         fprintf(stderr, "This application must be run as root. Exiting.\n");
         exit(EXIT_FAILURE);
     }
 
-    handle_command_line(argc, argv, &env);
-
     // Check if interfaces were specified
-    if (env.interfaces == NULL) {
+    if (env.interfaces == NULL && env.interface_pattern_count == 0) {
         fprintf(stderr, "Error: No interfaces specified. The -i option is mandatory.\n");
         fprintf(stderr, "Usage: %s -i interface1,interface2\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-	enrichInterfaceNodes(env.interfaces);
-	
+	if (!env.debugging_enabled && !env.foreground) {
+		daemonize();
+		logger(&env,"Daemon started successfully.",0);
+	}
+
+	env.loop=event_loop_create();
+
+	// Addresses come from netlink, and follow the interfaces from then on
+	linkwatch_open(&env);
+
 	if (env.debugging_enabled) {
 		fprintf(stderr, "Selected interfaces:\n");
 		dumpInterfaceList(env.interfaces);
 	}
 
-	if (!env.debugging_enabled) {
-		daemonize();
-		logger(&env,"Daemon started successfully.",0);
+	env.raw_sockfd=setup_raw_sender();
+	setup_broadcast_sockets(&env);
+	env.rx_ring=rx_ring_create();
+	env.requesters=requester_table_create();
+	env.metrics=metrics_create();
+	env.latency=latency_create();
+
+	// Devices of the previous run are answered for until probes confirm them
+	devcache_open(&env);
+	relay_open(&env);
+
+	// Signals are read from the event loop, the mask is inherited by the workers
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	signals.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	signals.handler = handle_signal;
+	signals.ctx = &env;
+	if (signals.fd < 0 || event_loop_add(env.loop, &signals, EPOLLIN) < 0) {
+		logger(&env, "signalfd setup failed", errno);
+		exit(EXIT_FAILURE);
 	}
 
-	sockfd=setup_listener();
-
-	// Start by sending a first batch of discovery packets
-	send_discovery_packets(&env);
-
-    struct timeval tv;
-    fd_set readfds;
-
-    while (1) {
-        FD_ZERO(&readfds);
-        FD_SET(sockfd, &readfds);
-
-        // Set timeout for select
-        tv.tv_sec = env.timeout_interval;
-        tv.tv_usec = 0;
-
-        // Wait for a packet or a timeout
-        int ret = select(sockfd + 1, &readfds, NULL, NULL, &tv);
-        if (ret < 0) {
-			logger(&env, "select error", errno);
-            exit(EXIT_FAILURE);
-        } else if (ret == 0) {
-            // Timeout occurred, time to send discovery packets
-			remove_stale_devices(&env);
-            send_discovery_packets(&env);
-        } else {
-            // Packet received
-            if (FD_ISSET(sockfd, &readfds)) {
-                process_received_packet(sockfd,&env);
-            }
-        }
-    }
+	if (env.worker_count > 0) {
+		// Queries are received by the workers, each on its own listener
+		sockfd=-1;
+		workers_start(&env, env.worker_count);
+	} else {
+		sockfd=setup_listener();
+		sockfilter_attach(&env, sockfd);
+		listener.fd = sockfd;
+		listener.handler = handle_socket_event;
+		listener.ctx = &env;
+		if (event_loop_add(env.loop, &listener, EPOLLIN) < 0) {
+			logger(&env, "epoll_ctl failed", errno);
+			exit(EXIT_FAILURE);
+		}
+	}
 
-    close(sockfd);
+	// Periodic work runs on absolute deadlines, whatever the packet load
+	if (event_timer_create(env.loop, &expiry_timer, handle_expiry_timer, &env) < 0 ||
+		event_timer_set_periodic(&expiry_timer, EXPIRY_SWEEP_MS) < 0) {
+		logger(&env, "timerfd setup failed", errno);
+		exit(EXIT_FAILURE);
+	}
+
+	if (env.metrics_endpoint != NULL) {
+		metrics_listen(&env, env.metrics_endpoint);
+	}
+
+	// Devices seen by the peers are answered for as well
+	federation_open(&env);
+
+	// Start probing every interface, quickly at first
+	scheduler_start(&env);
+	linkwatch_start(&env);
+
+	event_loop_run(env.loop);
+
+    rx_ring_free(env.rx_ring);
+    close(env.raw_sockfd);
+    if (sockfd >= 0) {
+        close(sockfd);
+    }
     closelog();
     return 0;
 }
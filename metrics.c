@@ -0,0 +1,384 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "types.h"
+#include "utilities.h"
+#include "eventloop.h"
+#include "requesters.h"
+#include "workers.h"
+#include "metrics.h"
+#include "latency.h"
+#include "sockfilter.h"
+
+/*
+ * Counters are kept per thread and only summed when scraped. The
+ * exposition is served in the Prometheus text format over HTTP, from the
+ * main event loop: every connection gets the page as soon as its request
+ * arrives, without blocking, and is closed.
+ */
+
+static const struct {
+    const char *name;
+    const char *labels;
+    const char *help;
+} metric_info[METRIC_COUNT] = {
+    [METRIC_PACKETS_IGNORED]  = { "eiscp_packets_received_total", "type=\"ignored\"", "Datagrams received, by type" },
+    [METRIC_PACKETS_QUERY]    = { "eiscp_packets_received_total", "type=\"query\"", NULL },
+    [METRIC_PACKETS_RESPONSE] = { "eiscp_packets_received_total", "type=\"response\"", NULL },
+    [METRIC_PACKETS_DROPPED]  = { "eiscp_packets_received_total", "type=\"dropped\"", NULL },
+    [METRIC_FORWARD_OVERSIZE] = { "eiscp_worker_forward_dropped_total", "reason=\"oversize\"", "Datagrams a worker could not hand over to the main thread, by reason" },
+    [METRIC_FORWARD_QUEUE_FULL] = { "eiscp_worker_forward_dropped_total", "reason=\"queue_full\"", NULL },
+    [METRIC_REPLIES_SENT]     = { "eiscp_replies_total", "result=\"sent\"", "Forged replies, by result" },
+    [METRIC_REPLIES_FAILED]   = { "eiscp_replies_total", "result=\"failed\"", NULL },
+    [METRIC_DEVICES_LEARNED]  = { "eiscp_devices_learned_total", NULL, "Devices added to the table" },
+    [METRIC_DEVICES_EXPIRED]  = { "eiscp_devices_expired_total", NULL, "Devices removed from the table" },
+    [METRIC_PROBES_SENT]      = { "eiscp_probes_total", NULL, "Discovery probes broadcast" },
+    [METRIC_LIVENESS_PROBES]  = { "eiscp_liveness_probes_total", NULL, "Unicast probes of known devices" },
+    [METRIC_QUERIES_RELAYED]  = { "eiscp_relayed_queries_total", NULL, "Discovery queries relayed onto interfaces still being discovered" },
+    [METRIC_RELAYED_REPLIES]  = { "eiscp_relayed_replies_total", NULL, "Forged replies streamed to the requesters of relayed queries" },
+    [METRIC_FEDERATION_REJECTED] = { "eiscp_federation_rejected_total", NULL, "Datagrams of federation peers dropped for a missing or wrong authentication tag" },
+};
+
+typedef struct MetricsConnection {
+    EventSource source;
+    Environment *env;
+    char *page;   // Response being sent, NULL until the request arrives
+    size_t length;
+    size_t sent;
+    uint64_t deadline; // Monotonic ms, closed by the sweep past it
+    struct MetricsConnection *prev, *next;
+} MetricsConnection;
+
+// Scrapes in progress. The listener is taken out of the loop while no more
+// can be accepted: left there, a pending connection keeps it readable.
+static struct {
+    EventSource listener;
+    int paused;
+    int count;
+    MetricsConnection *head;
+} server;
+
+MetricBlock* metrics_create() {
+    MetricBlock *block = aligned_alloc(METRICS_CACHE_LINE, sizeof(MetricBlock));
+    if (!block) {
+        perror("Failed to allocate memory for metrics");
+        exit(EXIT_FAILURE);
+    }
+    memset(block, 0, sizeof(*block));
+    return block;
+}
+
+static uint64_t metric_sum(Environment *pEnv, MetricId id) {
+    uint64_t sum = atomic_load_explicit(&pEnv->metrics->values[id], memory_order_relaxed);
+
+    for (int i = 0; pEnv->workers != NULL && i < pEnv->workers->count; i++) {
+        sum += atomic_load_explicit(&pEnv->workers->workers[i].env.metrics->values[id], memory_order_relaxed);
+    }
+    return sum;
+}
+
+// Datagrams that made it through the socket filter
+uint64_t metrics_delivered(Environment *pEnv) {
+    return metric_sum(pEnv, METRIC_PACKETS_IGNORED) + metric_sum(pEnv, METRIC_PACKETS_QUERY) +
+        metric_sum(pEnv, METRIC_PACKETS_RESPONSE) + metric_sum(pEnv, METRIC_PACKETS_DROPPED);
+}
+
+static uint64_t query_sum(Environment *pEnv, size_t offset) {
+    uint64_t sum = atomic_load_explicit((_Atomic uint64_t *)((char *)&pEnv->requesters->counters + offset), memory_order_relaxed);
+
+    for (int i = 0; pEnv->workers != NULL && i < pEnv->workers->count; i++) {
+        QueryCounters *counters = &pEnv->workers->workers[i].env.requesters->counters;
+        sum += atomic_load_explicit((_Atomic uint64_t *)((char *)counters + offset), memory_order_relaxed);
+    }
+    return sum;
+}
+
+static void append(char *buf, size_t size, size_t *len, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    if (*len >= size) {
+        return;
+    }
+    va_start(ap, fmt);
+    n = vsnprintf(buf + *len, size - *len, fmt, ap);
+    va_end(ap);
+    *len = n < 0 ? size : (*len + n > size ? size : *len + n);
+}
+
+// Write the Prometheus text exposition into buf, returns its length
+size_t metrics_render(Environment *pEnv, char *buf, size_t size) {
+    size_t len = 0;
+
+    for (int id = 0; id < METRIC_COUNT; id++) {
+        if (metric_info[id].help) {
+            append(buf, size, &len, "# HELP %s %s\n# TYPE %s counter\n",
+                metric_info[id].name, metric_info[id].help, metric_info[id].name);
+        }
+        append(buf, size, &len, "%s%s%s%s %llu\n", metric_info[id].name,
+            metric_info[id].labels ? "{" : "", metric_info[id].labels ? metric_info[id].labels : "",
+            metric_info[id].labels ? "}" : "", (unsigned long long)metric_sum(pEnv, id));
+    }
+
+    append(buf, size, &len, "# HELP eiscp_queries_total Discovery queries, by verdict\n# TYPE eiscp_queries_total counter\n");
+    append(buf, size, &len, "eiscp_queries_total{verdict=\"answered\"} %llu\n", (unsigned long long)query_sum(pEnv, offsetof(QueryCounters, answered)));
+    append(buf, size, &len, "eiscp_queries_total{verdict=\"coalesced\"} %llu\n", (unsigned long long)query_sum(pEnv, offsetof(QueryCounters, coalesced)));
+    append(buf, size, &len, "eiscp_queries_total{verdict=\"rate_limited\"} %llu\n", (unsigned long long)query_sum(pEnv, offsetof(QueryCounters, rateLimited)));
+    append(buf, size, &len, "# HELP eiscp_replies_saved_total Forged replies not sent thanks to query suppression\n# TYPE eiscp_replies_saved_total counter\n");
+    append(buf, size, &len, "eiscp_replies_saved_total %llu\n", (unsigned long long)query_sum(pEnv, offsetof(QueryCounters, repliesSaved)));
+
+    append(buf, size, &len, "# HELP eiscp_socket_packets_total Datagrams to the discovery port, delivered or dropped by the kernel\n# TYPE eiscp_socket_packets_total counter\n");
+    append(buf, size, &len, "eiscp_socket_packets_total{result=\"delivered\"} %llu\n", (unsigned long long)metrics_delivered(pEnv));
+    append(buf, size, &len, "eiscp_socket_packets_total{result=\"dropped\"} %llu\n", (unsigned long long)sockfilter_dropped(pEnv));
+
+    append(buf, size, &len, "# HELP eiscp_devices Devices in the table\n# TYPE eiscp_devices gauge\neiscp_devices %zu\n", pEnv->devices.count);
+
+    append(buf, size, &len, "# HELP eiscp_probe_interval_seconds Current discovery probing interval\n# TYPE eiscp_probe_interval_seconds gauge\n");
+    for (InterfaceNode *current = pEnv->interfaces; current != NULL; current = current->next) {
+        append(buf, size, &len, "eiscp_probe_interval_seconds{interface=\"%s\"} %.3f\n", current->name, current->probeInterval / 1000.0);
+    }
+    append(buf, size, &len, "# HELP eiscp_interface_send_errors_total Failed sends on interface sockets\n# TYPE eiscp_interface_send_errors_total counter\n");
+    for (InterfaceNode *current = pEnv->interfaces; current != NULL; current = current->next) {
+        append(buf, size, &len, "eiscp_interface_send_errors_total{interface=\"%s\"} %llu\n", current->name, (unsigned long long)current->sendErrors);
+    }
+
+    if (len < size) {
+        len += latency_render(pEnv, buf + len, size - len);
+    }
+
+    return len;
+}
+
+static void listener_pause(Environment *pEnv) {
+    if (!server.paused) {
+        event_loop_remove(pEnv->loop, &server.listener);
+        server.paused = 1;
+    }
+}
+
+static void listener_resume(Environment *pEnv) {
+    if (server.paused && server.count < METRICS_CONNECTIONS_MAX &&
+        event_loop_add(pEnv->loop, &server.listener, EPOLLIN) == 0) {
+        server.paused = 0;
+    }
+}
+
+static void close_connection(MetricsConnection *conn) {
+    Environment *pEnv = conn->env;
+
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        server.head = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    server.count--;
+
+    event_loop_remove(pEnv->loop, &conn->source);
+    close(conn->source.fd);
+    free(conn->page);
+    free(conn);
+    listener_resume(pEnv);
+}
+
+// Response and exposition in one buffer, grown until nothing is cut off
+static int render_page(MetricsConnection *conn) {
+    static const char header[] = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n";
+    size_t size = METRICS_PAGE_SIZE;
+
+    for (;;) {
+        char *page = realloc(conn->page, size);
+        size_t len;
+
+        if (!page) {
+            return -1;
+        }
+        conn->page = page;
+        memcpy(page, header, sizeof(header) - 1);
+        len = metrics_render(conn->env, page + sizeof(header) - 1, size - sizeof(header) + 1);
+        if (len < size - sizeof(header) + 1) {
+            conn->length = sizeof(header) - 1 + len;
+            return 0;
+        }
+        size *= 2;
+    }
+}
+
+// Send what the socket takes of the page, and hang up once all of it went
+static void send_page(MetricsConnection *conn) {
+    while (conn->sent < conn->length) {
+        ssize_t n = send(conn->source.fd, conn->page + conn->sent, conn->length - conn->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (n <= 0) {
+            close_connection(conn);
+            return;
+        }
+        conn->sent += n;
+    }
+    shutdown(conn->source.fd, SHUT_WR);
+    close_connection(conn);
+}
+
+// The request has arrived, whatever it is: answer with the page and hang up.
+// What the socket does not take at once follows as it becomes writable.
+static void handle_connection(EventSource *source, uint32_t events) {
+    MetricsConnection *conn = (MetricsConnection *)source;
+    char request[1024];
+    ssize_t received;
+
+    if (conn->page != NULL) {
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            close_connection(conn);
+        } else {
+            send_page(conn);
+        }
+        return;
+    }
+
+    received = recv(source->fd, request, sizeof(request), MSG_DONTWAIT);
+    if (received < 0 && errno == EAGAIN) {
+        return;
+    }
+    if (received <= 0 || render_page(conn) < 0 ||
+        event_loop_modify(conn->env->loop, &conn->source, EPOLLOUT) < 0) {
+        close_connection(conn);
+        return;
+    }
+    send_page(conn);
+}
+
+static void handle_accept(EventSource *source, uint32_t events) {
+    Environment *pEnv = source->ctx;
+    int fd;
+
+    while (server.count < METRICS_CONNECTIONS_MAX) {
+        MetricsConnection *conn;
+
+        if ((fd = accept4(source->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+            // Out of descriptors: the sweep tries again
+            if (errno == EMFILE || errno == ENFILE) {
+                listener_pause(pEnv);
+            }
+            return;
+        }
+        if ((conn = malloc(sizeof(MetricsConnection))) == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->source.fd = fd;
+        conn->source.handler = handle_connection;
+        conn->source.ctx = conn;
+        conn->env = pEnv;
+        conn->page = NULL;
+        conn->length = 0;
+        conn->sent = 0;
+        conn->deadline = monotonic_ms() + METRICS_TIMEOUT_MS;
+        if (event_loop_add(pEnv->loop, &conn->source, EPOLLIN | EPOLLRDHUP) < 0) {
+            close(fd);
+            free(conn);
+            continue;
+        }
+        conn->prev = NULL;
+        conn->next = server.head;
+        if (server.head != NULL) {
+            server.head->prev = conn;
+        }
+        server.head = conn;
+        server.count++;
+    }
+    listener_pause(pEnv);
+}
+
+// Close the scrapes that went on for too long, whether the client sends no
+// request or reads nothing, and listen again once descriptors are back
+void metrics_sweep(Environment *pEnv) {
+    uint64_t now = monotonic_ms();
+    MetricsConnection *conn = server.head;
+
+    while (conn != NULL) {
+        MetricsConnection *next = conn->next;
+        if (conn->deadline <= now) {
+            close_connection(conn);
+        }
+        conn = next;
+    }
+    listener_resume(pEnv);
+}
+
+// Serve the metrics on endpoint: a Unix socket path, or [address:]port over TCP
+void metrics_listen(Environment *pEnv, const char *endpoint) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int optval = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    if (endpoint[0] == '/') {
+        struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+        if (strlen(endpoint) >= sizeof(un->sun_path)) {
+            fprintf(stderr, "Metrics socket path too long: %s\n", endpoint);
+            exit(EXIT_FAILURE);
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, endpoint);
+        unlink(endpoint);
+        addrlen = sizeof(*un);
+    } else {
+        struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+        const char *colon = strrchr(endpoint, ':');
+        char host[INET_ADDRSTRLEN] = "127.0.0.1"; // Local only unless told otherwise
+
+        if (colon != NULL && colon != endpoint) {
+            snprintf(host, sizeof(host), "%.*s", (int)(colon - endpoint), endpoint);
+        }
+        in->sin_family = AF_INET;
+        in->sin_port = htons(atoi(colon ? colon + 1 : endpoint));
+        if (inet_pton(AF_INET, host, &in->sin_addr) != 1 || in->sin_port == 0) {
+            fprintf(stderr, "Invalid metrics endpoint: %s\n", endpoint);
+            exit(EXIT_FAILURE);
+        }
+        addrlen = sizeof(*in);
+    }
+
+    if ((server.listener.fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("metrics socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    if (addr.ss_family == AF_INET) {
+        setsockopt(server.listener.fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    }
+    if (bind(server.listener.fd, (struct sockaddr *)&addr, addrlen) < 0 || listen(server.listener.fd, 16) < 0) {
+        perror("metrics bind failed");
+        exit(EXIT_FAILURE);
+    }
+
+    server.listener.handler = handle_accept;
+    server.listener.ctx = pEnv;
+    if (event_loop_add(pEnv->loop, &server.listener, EPOLLIN) < 0) {
+        logger(pEnv, "epoll_ctl failed", errno);
+        exit(EXIT_FAILURE);
+    }
+}
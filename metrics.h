@@ -0,0 +1,56 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "types.h"
+
+#define METRICS_CACHE_LINE 64
+#define METRICS_PAGE_SIZE 16384 // First guess of the page size, doubled until the exposition fits
+#define METRICS_CONNECTIONS_MAX 16 // Scrapes served at once
+#define METRICS_TIMEOUT_MS 5000 // A scrape still open after that is dropped
+
+typedef enum {
+    METRIC_PACKETS_IGNORED,
+    METRIC_PACKETS_QUERY,
+    METRIC_PACKETS_RESPONSE,
+    METRIC_PACKETS_DROPPED, // Lost to an oversize neighbour in the receive ring
+    METRIC_FORWARD_OVERSIZE, // Too large to be handed over to the writer
+    METRIC_FORWARD_QUEUE_FULL,
+    METRIC_REPLIES_SENT,
+    METRIC_REPLIES_FAILED,
+    METRIC_DEVICES_LEARNED,
+    METRIC_DEVICES_EXPIRED,
+    METRIC_PROBES_SENT,
+    METRIC_LIVENESS_PROBES,
+    METRIC_QUERIES_RELAYED,
+    METRIC_RELAYED_REPLIES,
+    METRIC_FEDERATION_REJECTED, // Failed authentication
+    METRIC_COUNT
+} MetricId;
+
+// Counters of one thread, on cache lines of their own. Only the owning
+// thread writes them, so updates are plain loads and stores.
+typedef struct MetricBlock {
+    _Alignas(METRICS_CACHE_LINE) _Atomic uint64_t values[METRIC_COUNT];
+} MetricBlock;
+
+static inline void metric_add(MetricBlock *block, MetricId id, uint64_t n) {
+    atomic_store_explicit(&block->values[id],
+        atomic_load_explicit(&block->values[id], memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+MetricBlock* metrics_create();
+void metrics_listen(Environment *, const char *);
+void metrics_sweep(Environment *);
+size_t metrics_render(Environment *, char *, size_t);
+uint64_t metrics_delivered(Environment *);
+
+#endif
@@ -18,10 +18,26 @@
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <time.h>
+#include <sys/epoll.h>
 
 #include "types.h"
 #include "utilities.h"
+#include "iscp.h"
 #include "rawpacket.h"
+#include "txring.h"
+#include "rxring.h"
+#include "device_table.h"
+#include "workers.h"
+#include "requesters.h"
+#include "scheduler.h"
+#include "metrics.h"
+#include "latency.h"
+#include "replay.h"
+#include "devcache.h"
+#include "interface.h"
+#include "federation.h"
+#include "sockfilter.h"
+#include "relay.h"
 #include "packet_processing.h"
 
 int setup_listener() {
@@ -41,6 +57,13 @@ int setup_listener() {
         exit(EXIT_FAILURE);
     }
 
+    // Tell us which interface every packet came in through, and when
+    if (setsockopt(sockfd, IPPROTO_IP, IP_PKTINFO, &optval, sizeof(optval)) < 0 ||
+        setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &optval, sizeof(optval)) < 0) {
+        perror("setsockopt IP_PKTINFO/SO_TIMESTAMPNS failed");
+        exit(EXIT_FAILURE);
+    }
+
     // Bind the socket to listen for incoming packets
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
@@ -55,213 +78,612 @@ int setup_listener() {
 	return sockfd;
 }
 
-void process_received_packet(int sockfd, Environment *pEnv) {
-    char buffer[BUFFER_SIZE];
-    struct sockaddr_in senderAddr;
-    socklen_t senderAddrLen = sizeof(senderAddr);
-    ssize_t receivedLen;
-	
-    while (1) {
-        // Attempt to receive a packet
-        receivedLen = recvfrom(sockfd, buffer, BUFFER_SIZE, MSG_DONTWAIT, (struct sockaddr *)&senderAddr, &senderAddrLen);
+// Decide what a received datagram is, decoding responses into ecn. For a
+// query, only the unit type it asks for is set.
+PacketType classify_packet(const struct sockaddr_in *senderAddr, const char *buffer, ssize_t receivedLen, const Environment *pEnv, EcnRecord *ecn) {
+	IscpMessage message;
 
-        // If no more packets are available, break the loop
-        if (receivedLen == -1) {
-            break;
-        }
+	// Iterate through interfaceList to check if the packet's source IP matches one of our interfaces,
+	// worker threads included
+	for (InterfaceNode* current = interfaceListHead(&pEnv->interfaces); current != NULL; current = interfaceListNext(current)) {
+		if (interfaceAddress(current) == senderAddr->sin_addr.s_addr) {
+			return PACKET_IGNORED;
+		}
+	}
 
-		bool doIgnore = false;
-		// Iterate through interfaceList to check if the packet's source IP matches one of our interfaces
-		for (InterfaceNode* current = pEnv->interfaces; current != NULL; current = current->next) {
-			if (current->address.sin_addr.s_addr == senderAddr.sin_addr.s_addr) {
-				doIgnore = true;
-				break;
-			}
+	// The header must describe the datagram, and the message be a discovery one
+	if (receivedLen < 0 || iscp_parse(buffer, receivedLen, &message) < 0 || memcmp(message.command, "ECN", 3) != 0) {
+		return PACKET_IGNORED;
+	}
+
+	if (message.parameterLength == 4 && memcmp(message.parameter, "QSTN", 4) == 0) {
+		// It's a discovery broadcast packet, for every device ('x') or a single unit type
+		if (message.unit != ISCP_UNIT_ANY && iscp_category(message.unit) < 0) {
+			return PACKET_IGNORED;
 		}
+		memset(ecn, 0, sizeof(*ecn));
+		ecn->unit = message.unit;
+		return PACKET_QUERY;
+	} else if (iscp_parse_ecn(&message, ecn) == 0) {
+		// It's a well-formed discovery response packet, whatever the unit type
+		return PACKET_RESPONSE;
+	}
+
+	return PACKET_IGNORED;
+}
+
+// Number of devices a reply to a query for the unit type would carry
+static size_t known_device_count(Environment *pEnv, char unit) {
+	size_t count;
+
+	if (pEnv->worker == NULL) {
+		return device_table_count(&pEnv->devices, unit);
+	}
+	worker_snapshot_devices(worker_snapshot_enter(pEnv->worker), unit, &count);
+	worker_snapshot_exit(pEnv->worker);
+	return count;
+}
+
+// Classify and handle one batch of received datagrams
+void process_batch(RxRing *ring, Environment *pEnv) {
+	uint64_t now = monotonic_ms();
+
+	for (unsigned int i = 0; i < ring->count; i++) {
+		RxSlot *slot = &ring->slots[i];
 
-		// Next, check if the packet starts with "ISCP"
-		if (receivedLen < 4 || strncmp(buffer, "ISCP", 4) != 0) {
-			// Packet does not start with "ISCP", ignore it
-			doIgnore = true;
+		// Another worker got the same broadcast
+		if (pEnv->worker && !worker_owns_datagram(pEnv->worker, slot)) {
+			slot->type = PACKET_IGNORED;
+			continue;
 		}
-	
-		// This packet was sent from one of our interfaces, or does not
-		// start with "ISCP" : ignore it
-        if (doIgnore == true) {
-            continue;
-        }
 
-        // Dump the content of the packet
-		if (pEnv->debugging_enabled) {
+		if (slot->length < 0) {
+			metric_add(pEnv->metrics, METRIC_PACKETS_DROPPED, 1);
+			if (pEnv->debugging_enabled) {
+				fprintf(stderr,"Oversize packet dropped, its data was overwritten within the batch\n");
+			}
+			continue;
+		}
+
+		slot->type = classify_packet(&slot->source, slot->packet, slot->length, pEnv, &slot->ecn);
+		metric_add(pEnv->metrics, slot->type == PACKET_QUERY ? METRIC_PACKETS_QUERY :
+			slot->type == PACKET_RESPONSE ? METRIC_PACKETS_RESPONSE : METRIC_PACKETS_IGNORED, 1);
+
+		// Dump the content of the packet
+		if (pEnv->debugging_enabled && slot->type != PACKET_IGNORED) {
 			char senderIP[INET_ADDRSTRLEN];
-			inet_ntop(AF_INET, &(senderAddr.sin_addr), senderIP, INET_ADDRSTRLEN);
-			fprintf(stderr,"Received a packet from %s:%d\n", senderIP, ntohs(senderAddr.sin_port));
-			hexDump("Packet Content", buffer, receivedLen);
+			inet_ntop(AF_INET, &(slot->source.sin_addr), senderIP, INET_ADDRSTRLEN);
+			fprintf(stderr,"Received a packet from %s:%d on interface %d\n", senderIP, ntohs(slot->source.sin_port), slot->ifindex);
+			hexDump("Packet Content", slot->packet, slot->length);
 		}
+	}
 
-		// Check for specific packet types based on payload starting at byte 16
-		if (receivedLen >= 25 && strncmp(buffer + 16, "!xECNQSTN", 9) == 0) {
-			// It's a discovery broadcast packet
-			reply_to_discovery(&senderAddr,pEnv); 
-		} else if (receivedLen >= 20 && strncmp(buffer + 16, "!1ECN", 5) == 0) {
-			// It's a discovery response packet
-			handle_discovery_response(&senderAddr,pEnv,buffer,receivedLen); 
-		}		
-    }
+	// Learn the responses first so that queries of the same batch see them
+	for (unsigned int i = 0; i < ring->count; i++) {
+		RxSlot *slot = &ring->slots[i];
+		if (slot->type != PACKET_RESPONSE) {
+			continue;
+		}
+		if (pEnv->worker) {
+			// Only the main thread updates the device table
+			worker_forward_response(pEnv->worker,&slot->source,slot->ifindex,slot->packet,slot->length,&slot->ecn);
+		} else {
+			handle_discovery_response(&slot->source,slot->ifindex,pEnv,slot->packet,slot->length,&slot->ecn);
+		}
+	}
+
+	for (unsigned int i = 0; i < ring->count; i++) {
+		RxSlot *slot = &ring->slots[i];
+		if (slot->type != PACKET_QUERY) {
+			continue;
+		}
+		// Bursts of identical queries get one reply, floods get none
+		if (requester_admit(pEnv->requesters, &slot->source, slot->ecn.unit, now, pEnv->coalesce_window) == QUERY_ANSWER) {
+			size_t devices = reply_to_discovery(&slot->source,slot->ifindex,slot->ecn.unit,pEnv);
+			latency_record(pEnv->latency, &slot->received, devices);
+
+			// The rest follows as the other segments answer, learned by the main thread
+			if (pEnv->relay != NULL) {
+				if (pEnv->worker) {
+					worker_forward_query(pEnv->worker,&slot->source,slot->ifindex,slot->ecn.unit);
+				} else {
+					relay_query(pEnv,&slot->source,slot->ifindex,slot->ecn.unit);
+				}
+			}
+		} else {
+			atomic_fetch_add_explicit(&pEnv->requesters->counters.repliesSaved, known_device_count(pEnv, slot->ecn.unit), memory_order_relaxed);
+			if (pEnv->debugging_enabled) {
+				fprintf(stderr,"Discovery query from %s:%d suppressed\n", inet_ntoa(slot->source.sin_addr), ntohs(slot->source.sin_port));
+			}
+		}
+	}
 }
 
-void send_discovery_packets(Environment *pEnv) {
+// Event loop callback for the listener and the interface sockets
+void handle_socket_event(EventSource *source, uint32_t events) {
+	Environment *pEnv = source->ctx;
+
+	process_received_packet(source->fd, pEnv);
+	if (pEnv->worker == NULL) {
+		workers_publish(pEnv);
+	}
+}
+
+void process_received_packet(int sockfd, Environment *pEnv) {
+	// Drain the socket batch by batch, within a bound so that a storm
+	// cannot monopolize the process
+	for (int batches = 0; batches < RX_MAX_BATCHES; batches++) {
+		int received = rx_ring_receive(sockfd, pEnv->rx_ring);
+		if (received == 0) {
+			break;
+		}
+
+		process_batch(pEnv->rx_ring, pEnv);
+
+		if (received < RX_BATCH_SIZE) {
+			break;
+		}
+	}
+}
+
+// Discovery probe (!xECNQSTN), identical for every interface and every cycle
+static const char discovery_probe[] = {0x49, 0x53, 0x43, 0x50, 0x00, 0x00, 0x00, 0x10,
+                                       0x00, 0x00, 0x00, 0x0a, 0x01, 0x00, 0x00, 0x00,
+                                       0x21, 0x78, 0x45, 0x43, 0x4e, 0x51, 0x53, 0x54, 0x4e, 0x0a};
+
+// Open the broadcast socket of an interface, bound to its address and PORT.
+// Devices answer our probes on that socket, so it is also read from.
+int open_broadcast_socket(InterfaceNode *iface, Environment *pEnv) {
     int sockfd;
+    int optval = 1;
+
+    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        logger(pEnv,"socket creation failed",errno);
+        return -1;
+    }
+
+    // Enable SO_REUSEPORT, SO_BROADCAST, IP_PKTINFO and SO_TIMESTAMPNS options
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0 ||
+        setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &optval, sizeof(optval)) < 0 ||
+        setsockopt(sockfd, IPPROTO_IP, IP_PKTINFO, &optval, sizeof(optval)) < 0 ||
+        setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &optval, sizeof(optval)) < 0) {
+        logger(pEnv,"setsockopt failed",errno);
+        close(sockfd);
+        return -1;
+    }
+
+    // Adjust the source address to include the source port
+    iface->address.sin_port = htons(PORT); // Source port
+
+    // Bind to the specific interface's IP address and PORT
+    if (bind(sockfd, (struct sockaddr *)&iface->address, sizeof(iface->address)) < 0) {
+        logger(pEnv,"bind failed",errno);
+        close(sockfd);
+        return -1;
+    }
+
+    iface->socket.fd = sockfd;
+    iface->socket.handler = handle_socket_event;
+    iface->socket.ctx = pEnv;
+    if (event_loop_add(pEnv->loop, &iface->socket, EPOLLIN) < 0) {
+        logger(pEnv,"epoll_ctl failed",errno);
+        close(sockfd);
+        iface->socket.fd = -1;
+        return -1;
+    }
+    sockfilter_attach(pEnv, sockfd);
+
+    return sockfd;
+}
+
+void close_broadcast_socket(InterfaceNode *iface, Environment *pEnv) {
+    if (iface->socket.fd >= 0) {
+        sockfilter_detach(pEnv, iface->socket.fd);
+        event_loop_remove(pEnv->loop, &iface->socket);
+        close(iface->socket.fd);
+        iface->socket.fd = -1;
+    }
+}
+
+void setup_broadcast_sockets(Environment *pEnv) {
+    for (InterfaceNode* current = pEnv->interfaces; current != NULL; current = current->next) {
+        // Interfaces still waiting for an address get their socket from linkwatch.c
+        if (interfaceHasAddress(current) && open_broadcast_socket(current, pEnv) < 0) {
+            fprintf(stderr, "Warning: interface %s will be retried on the next discovery cycle\n", current->name);
+        }
+    }
+}
+
+// Broadcast a discovery probe on one interface, a failure only affects that interface
+void send_discovery_probe(InterfaceNode *iface, Environment *pEnv) {
     struct sockaddr_in dest_addr;
-    char payload[] = {0x49, 0x53, 0x43, 0x50, 0x00, 0x00, 0x00, 0x10, 
-                      0x00, 0x00, 0x00, 0x0a, 0x01, 0x00, 0x00, 0x00, 
-                      0x21, 0x78, 0x45, 0x43, 0x4e, 0x51, 0x53, 0x54, 0x4e, 0x0a};
 
     // Destination address setup
     memset(&dest_addr, 0, sizeof(dest_addr));
     dest_addr.sin_family = AF_INET;
     dest_addr.sin_port = htons(PORT); // Destination port
-    dest_addr.sin_addr.s_addr = inet_addr("255.255.255.255"); // Broadcast address
+    dest_addr.sin_addr.s_addr = htonl(INADDR_BROADCAST); // Broadcast address
 
-    // Iterate through each interface
-    for (InterfaceNode* current = pEnv->interfaces; current != NULL; current = current->next) {
-        if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-			logger(pEnv,"socket creation failed",errno);
-            continue; // Try next interface if socket creation fails
-        }
+    // Nothing to probe from until the interface has an address
+    if (!interfaceHasAddress(iface)) {
+        return;
+    }
 
-        // Enable SO_REUSEPORT and SO_BROADCAST options
-        int optval = 1;
-        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0 ||
-            setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &optval, sizeof(optval)) < 0) {
-			logger(pEnv,"setsockopt failed",errno);
-            close(sockfd);
-            return;
-        }
+    // Rebuild the socket if it was dropped after an error
+    if (iface->socket.fd < 0 && open_broadcast_socket(iface, pEnv) < 0) {
+        return;
+    }
 
-		// Adjust the source address to include the source port
-        current->address.sin_port = htons(PORT); // Source port
-		
-        // Bind to the specific interface's IP address and PORT
-        if (bind(sockfd, (struct sockaddr *)&current->address, sizeof(current->address)) < 0) {
-            logger(pEnv,"bind failed",errno);
-            close(sockfd);
-            return;
-        }
+    // Send the packet
+    if (sendto(iface->socket.fd, discovery_probe, sizeof(discovery_probe), 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) < 0) {
+        logger(pEnv,"sendto failed",errno);
+        iface->sendErrors++;
+        close_broadcast_socket(iface, pEnv);
+    } else {
+        metric_add(pEnv->metrics, METRIC_PROBES_SENT, 1);
+		if (pEnv->debugging_enabled) {
+			fprintf(stderr,"Discovery packet sent on interface: %s\n", iface->name);
+		}
+    }
+}
 
-        // Send the packet
-        if (sendto(sockfd, payload, sizeof(payload), 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) < 0) {
-            logger(pEnv,"sendto failed",errno);
-        } else {
-			if (pEnv->debugging_enabled) {
-				fprintf(stderr,"Discovery packet sent on interface: %s\n", current->name);
-			}
-        }
+// Ask a known device directly whether it is still there, through the socket
+// of its interface so that the answer comes back to it
+static int send_liveness_probe(DiscoveredDevice *device, Environment *pEnv) {
+    InterfaceNode *iface = findInterfaceByIndex(pEnv->interfaces, device->ifindex);
 
-        close(sockfd);
+    if (iface == NULL || iface->socket.fd < 0) {
+        return -1;
+    }
+    if (sendto(iface->socket.fd, discovery_probe, sizeof(discovery_probe), 0, (struct sockaddr *)&device->source, sizeof(device->source)) < 0) {
+        logger(pEnv,"sendto failed",errno);
+        iface->sendErrors++;
+        return -1;
+    }
+    metric_add(pEnv->metrics, METRIC_LIVENESS_PROBES, 1);
+	if (pEnv->debugging_enabled) {
+		fprintf(stderr,"Liveness probe %d sent to %s\n", device->livenessProbes + 1, inet_ntoa(device->source.sin_addr));
+	}
+    return 0;
+}
+
+// The entry of old is replaced by one for the response, keeping what was
+// learned about the device: it answered from another address or port, or
+// its response changed
+static DiscoveredDevice* replace_device(Environment *pEnv, DiscoveredDevice *old, const struct sockaddr_in* source, const char* payloadBuffer, ssize_t payloadLength, const EcnRecord *ecn) {
+    DiscoveredDevice *device;
+
+    device_table_remove(&pEnv->devices, old);
+    devcache_erase(pEnv, old);
+    federation_device_expired(pEnv, old);
+
+    device = device_table_insert(&pEnv->devices, source, payloadBuffer, payloadLength, ecn, old->expires);
+    if (device != NULL) {
+        device->ifindex = old->ifindex;
+        device->lastSeen = old->lastSeen;
+        device->cadence = old->cadence;
+        device->provisional = old->provisional;
+        device->peer = old->peer;
+    } else {
+        logger(pEnv,"Failed to allocate memory for new DiscoveredDevice node",errno);
     }
+    workers_release_device(pEnv, old);
+    return device;
 }
 
-void handle_discovery_response(const struct sockaddr_in* source, Environment *pEnv, const char* payloadBuffer, ssize_t payloadLength) {
-    // Iterate through the list of devices to find if the source already exists
-    for (DiscoveredDevice* current = pEnv->devices; current != NULL; current = current->next) {
-        if (current->source.sin_port == source->sin_port &&
-            current->source.sin_addr.s_addr == source->sin_addr.s_addr) {
-            // We found a matching source, update the timestamp and return
-            current->timestamp = time(NULL);
-			if (pEnv->debugging_enabled) {
-				fprintf(stderr,"Updated last seen timestamp for existing device\n");
-			}
+void handle_discovery_response(const struct sockaddr_in* source, int ifindex, Environment *pEnv, const char* payloadBuffer, ssize_t payloadLength, const EcnRecord *ecn) {
+    uint64_t now = monotonic_ms();
+    int moved = 0;
+
+    // Find if the source already exists, or the same device under another source
+    DiscoveredDevice* current = device_table_find(&pEnv->devices, source);
+    DiscoveredDevice* same;
+    if (current != NULL && (current->payloadSize != (size_t)payloadLength || memcmp(current->payload, payloadBuffer, payloadLength) != 0)) {
+        // Another device took the address, or this one answers differently now
+        if (pEnv->debugging_enabled) {
+            fprintf(stderr,"Device at %s:%d changed its response\n", inet_ntoa(source->sin_addr), ntohs(source->sin_port));
+        }
+        same = device_table_find_identity(&pEnv->devices, ecn);
+        if (same != NULL && same != current) {
+            // It moved from elsewhere, that entry is gone with it
+            device_table_remove(&pEnv->devices, same);
+            devcache_erase(pEnv, same);
+            federation_device_expired(pEnv, same);
+            workers_release_device(pEnv, same);
+        }
+        if ((current = replace_device(pEnv, current, source, payloadBuffer, payloadLength, ecn)) == NULL) {
+            return;
+        }
+        moved = 1;
+    } else if (current == NULL && (same = device_table_find_identity(&pEnv->devices, ecn)) != NULL) {
+        if (pEnv->debugging_enabled) {
+            char oldIP[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &same->source.sin_addr, oldIP, sizeof(oldIP));
+            fprintf(stderr,"Device %s moved from %s:%d to %s:%d\n", ecn->identifier, oldIP, ntohs(same->source.sin_port), inet_ntoa(source->sin_addr), ntohs(source->sin_port));
+        }
+        if ((current = replace_device(pEnv, same, source, payloadBuffer, payloadLength, ecn)) == NULL) {
             return;
         }
+        moved = 1;
     }
+    if (current != NULL) {
+        uint64_t gap = now - current->lastSeen;
+        int adopted = current->peer != 0;
+        int relocated = !adopted && current->ifindex != ifindex;
+
+        // Workers read ifindex from the published entries without a lock: an
+        // entry changing interface is replaced rather than written in place
+        if (!moved && (adopted || relocated)) {
+            if ((current = replace_device(pEnv, current, source, payloadBuffer, payloadLength, ecn)) == NULL) {
+                return;
+            }
+        }
 
-    // Create a new DiscoveryResponse node
-    DiscoveredDevice* newNode = (DiscoveredDevice*)malloc(sizeof(DiscoveredDevice));
-    if (!newNode) {
-        logger(pEnv,"Failed to allocate memory for new DiscoveredDevice node",errno);
+        // Learned from a federation peer and heard here as well, ours from now on
+        if (adopted) {
+            current->peer = 0;
+            current->ifindex = ifindex;
+        }
+
+        // The device may have moved
+        if (current->ifindex != ifindex) {
+            scheduler_reset(pEnv, current->ifindex);
+            scheduler_reset(pEnv, ifindex);
+            current->ifindex = ifindex;
+        }
+
+        if (current->provisional || adopted) {
+            // Loaded from the cache or a peer: confirmed, but the gap says nothing of its pace
+            current->provisional = 0;
+        } else {
+            // Follow the pace at which the device answers
+            current->cadence = current->cadence ? (3 * (uint64_t)current->cadence + gap) / 4 : gap;
+        }
+        current->lastSeen = now;
+        current->livenessProbes = 0;
+
+        // We found a matching source, update the timestamp and return
+        device_table_touch(&pEnv->devices, current, scheduler_device_deadline(pEnv, current, now));
+        devcache_store(pEnv, current);
+        if (adopted || moved || relocated) {
+            federation_device_learned(pEnv, current);
+            if (moved) {
+                relay_device_learned(pEnv, current);
+            }
+        } else {
+            federation_device_refreshed(pEnv, current);
+        }
+		if (pEnv->debugging_enabled) {
+			fprintf(stderr,"Updated last seen timestamp for existing device\n");
+		}
         return;
     }
 
-    // Copy the source sockaddr_in
-    memcpy(&newNode->source, source, sizeof(struct sockaddr_in));
-
-    // Copy the payload into dynamically allocated memory
-    newNode->payload = (char*)malloc(payloadLength);
-    if (!newNode->payload) {
-        logger(pEnv,"Failed to allocate memory for payload",errno);
-        free(newNode);
+    // Create a new DiscoveredDevice entry
+    current = device_table_insert(&pEnv->devices, source, payloadBuffer, payloadLength, ecn, now);
+    if (!current) {
+        logger(pEnv,"Failed to allocate memory for new DiscoveredDevice node",errno);
         return;
     }
-    memcpy(newNode->payload, payloadBuffer, payloadLength);
-    newNode->payloadSize = payloadLength;
+    current->ifindex = ifindex;
+    current->lastSeen = now;
+    metric_add(pEnv->metrics, METRIC_DEVICES_LEARNED, 1);
+    device_table_touch(&pEnv->devices, current, scheduler_device_deadline(pEnv, current, now));
+    devcache_store(pEnv, current);
+    federation_device_learned(pEnv, current);
+    relay_device_learned(pEnv, current);
 
-    // Set the timestamp
-    newNode->timestamp = time(NULL);
+    // A new device shows up, look for more
+    scheduler_reset(pEnv, ifindex);
 
-    // Insert the new node at the beginning of the list
-    newNode->next = pEnv->devices;
-	pEnv->devices = newNode;
-	
 	if (pEnv->debugging_enabled) {
 		fprintf(stderr,"Created new device entry\n");
-		dump_device_list(pEnv->devices);
+		dump_device_list(pEnv->devices.head);
 	}
 	
 	return;
 }
 
-void reply_to_discovery(const struct sockaddr_in* destAddr, Environment *pEnv) {
+// Transmit ring of an interface for this thread, opened on first use. An
+// interface whose ring cannot be opened goes through the raw socket, and
+// the ring is tried again after TX_RING_RETRY_MS; the other ones keep theirs.
+static TxRing* tx_ring_get(Environment *pEnv, int ifindex) {
+    TxRing *ring, *opened;
+    uint64_t now;
+
+    for (ring = pEnv->tx_rings; ring != NULL; ring = ring->next) {
+        if (ring->ifindex == ifindex) {
+            break;
+        }
+    }
+    if (ring != NULL && ring->fd >= 0) {
+        return ring;
+    }
+
+    now = monotonic_ms();
+    if (ring != NULL && now < ring->retryAt) {
+        return NULL;
+    }
+
+    if ((opened = tx_ring_open(ifindex)) == NULL) {
+        char name[IF_NAMESIZE] = "?";
+        char msg[96];
+
+        if (ring == NULL && (ring = calloc(1, sizeof(TxRing))) != NULL) {
+            ring->fd = -1;
+            ring->ifindex = ifindex;
+            ring->next = pEnv->tx_rings;
+            pEnv->tx_rings = ring;
+        }
+        if (ring != NULL) {
+            ring->retryAt = now + TX_RING_RETRY_MS;
+        }
+        if_indextoname(ifindex, name);
+        snprintf(msg, sizeof(msg), "Transmit ring unavailable on %s, falling back to the raw socket", name);
+        logger(pEnv, msg, 0);
+        return NULL;
+    }
+
+    if (ring != NULL) {
+        // The interface failed before, its entry takes the ring
+        opened->next = ring->next;
+        *ring = *opened;
+        free(opened);
+        return ring;
+    }
+    opened->next = pEnv->tx_rings;
+    pEnv->tx_rings = opened;
+    return opened;
+}
+
+// Send a burst of forged replies and report every datagram that did not make it
+static void flush_discovery_replies(Environment *pEnv, RawBatch *batch, DiscoveredDevice **devices) {
+    TxRing *ring = NULL;
+    int failures = -1;
+
+    if (batch->count == 0) {
+        return;
+    }
+
+    // The raw socket remains the fallback, also when the requester's MAC is unknown
+    if (pEnv->tx_backend == TX_BACKEND_RING && batch->ifindex > 0) {
+        ring = tx_ring_get(pEnv, batch->ifindex);
+    }
+    if (ring != NULL) {
+        failures = tx_ring_send(ring, batch);
+    }
+    if (pEnv->tx_backend == TX_BACKEND_CAPTURE) {
+        failures = replay_capture(pEnv, batch);
+    }
+    if (failures < 0) {
+        ring = NULL;
+        failures = raw_batch_send(pEnv->raw_sockfd, batch);
+    }
+
+    metric_add(pEnv->metrics, METRIC_REPLIES_SENT, batch->count - failures);
+    metric_add(pEnv->metrics, METRIC_REPLIES_FAILED, failures);
+
+    if (failures > 0) {
+        for (unsigned int i = 0; i < batch->count; i++) {
+            if (batch->errors[i] != 0) {
+                char msg[64];
+                snprintf(msg, sizeof(msg), "sendmmsg failed for device %s", inet_ntoa(devices[i]->source.sin_addr));
+                logger(pEnv, msg, batch->errors[i]);
+            }
+        }
+    }
+
+    if (pEnv->debugging_enabled) {
+        fprintf(stderr,"Discovery reply burst of %u packets sent to %s:%d through the %s\n", batch->count, inet_ntoa(batch->dst.sin_addr), ntohs(batch->dst.sin_port), ring != NULL ? "transmit ring" :
+            pEnv->tx_backend == TX_BACKEND_CAPTURE ? "replay capture" : "raw socket");
+    }
+
+    raw_batch_init(batch, &batch->dst, batch->ifindex);
+}
+
+// Queue the forged reply of one device, flushing the burst when it is full
+static void queue_discovery_reply(Environment *pEnv, RawBatch *batch, DiscoveredDevice **batchDevices, DiscoveredDevice *device) {
+    int i;
+
+    // The requester already heard devices of its own segment directly
+    if (device->ifindex != 0 && device->ifindex == batch->ifindex) {
+        return;
+    }
+
+    i = raw_batch_add_frame(batch, &device->frame, device->payload, device->payloadSize);
+    if (i < 0) {
+        flush_discovery_replies(pEnv, batch, batchDevices);
+        i = raw_batch_add_frame(batch, &device->frame, device->payload, device->payloadSize);
+    }
+    batchDevices[i] = device;
+}
+
+// Forge the reply of a single device, as soon as it is learned
+void reply_with_device(const struct sockaddr_in* destAddr, int ifindex, DiscoveredDevice *device, Environment *pEnv) {
+    static _Thread_local RawBatch batch;
+    DiscoveredDevice *batchDevices[RAW_BATCH_SIZE];
+
+    raw_batch_init(&batch, destAddr, ifindex);
+    queue_discovery_reply(pEnv, &batch, batchDevices, device);
+    flush_discovery_replies(pEnv, &batch, batchDevices);
+}
+
+// Returns the number of devices the reply was built from
+size_t reply_to_discovery(const struct sockaddr_in* destAddr, int ifindex, char unit, Environment *pEnv) {
 	// We need to forge packets with source IP from the discovered devices
 	// destAddr contains the IP/Port of requesting party
+	// ifindex is the interface the query came in through, replies go out there
+	// unit is the unit type asked for, only those devices answer unless it is 'x'
 	// devices->source is a struct sockaddr_in containing the IP/Port we
 	//    want to forge in our answers
 	// devices->payload and devices->payloadSize represent the payload
+	// devices->frame holds the headers, only the destination is patched in
+    static _Thread_local RawBatch batch;
+    DiscoveredDevice *batchDevices[RAW_BATCH_SIZE];
+
+    raw_batch_init(&batch, destAddr, ifindex);
+
+    if (pEnv->worker) {
+        // Workers read the table through the last published snapshot
+        size_t count;
+        DiscoveredDevice **devices = worker_snapshot_devices(worker_snapshot_enter(pEnv->worker), unit, &count);
+        for (size_t i = 0; i < count; i++) {
+            queue_discovery_reply(pEnv, &batch, batchDevices, devices[i]);
+        }
+        flush_discovery_replies(pEnv, &batch, batchDevices);
+        worker_snapshot_exit(pEnv->worker);
+        return count;
+    }
 
-    // Iterate through the devices list
-    for (DiscoveredDevice* current = pEnv->devices; current != NULL; current = current->next) {
-        // Send the payload back to the discoverer
-        if (send_raw_udp_packet(&current->source, destAddr, current->payload, current->payloadSize) < 0) {
-            logger(pEnv,"sendto failed",errno);
-        } else {
-			if (pEnv->debugging_enabled) {
-				fprintf(stderr,"Discovery reply sent to %s:%d\n", inet_ntoa(destAddr->sin_addr), ntohs(destAddr->sin_port));
-			}
+    // Iterate through the devices list, one sendmmsg() per RAW_BATCH_SIZE devices
+    int category = iscp_category(unit);
+    if (category < 0) {
+        for (DiscoveredDevice* current = pEnv->devices.head; current != NULL; current = current->next) {
+            queue_discovery_reply(pEnv, &batch, batchDevices, current);
+        }
+    } else {
+        for (DiscoveredDevice* current = pEnv->devices.categories[category]; current != NULL; current = current->categoryNext) {
+            queue_discovery_reply(pEnv, &batch, batchDevices, current);
         }
     }
+
+    flush_discovery_replies(pEnv, &batch, batchDevices);
+    return device_table_count(&pEnv->devices, unit);
 }
 
 void remove_stale_devices(Environment *pEnv) {
-    DiscoveredDevice *current = pEnv->devices, *prev = NULL;
-    time_t now = time(NULL);
-    int timeout = 4 * pEnv->timeout_interval; // Timeout threshold
+    uint64_t now = monotonic_ms();
+    // Only the timing wheel buckets that became due are visited
+    DiscoveredDevice *current = device_table_due(&pEnv->devices, now);
 
     while (current != NULL) {
-        // Calculate time difference
-        double diff = difftime(now, current->timestamp);
+        DiscoveredDevice* to_delete = current;
 
-        if (diff > timeout) {
-            DiscoveredDevice* to_delete = current;
+        current = current->wheelNext;
 
-			if (pEnv->debugging_enabled) {
-				fprintf(stderr,"Removing stale device %s\n",inet_ntoa(current->source.sin_addr));
-			}
-            // Remove the device from the list
-            if (prev == NULL) {
-                pEnv->devices = current->next; // Update head if the first device is removed
-            } else {
-                prev->next = current->next; // Bypass the current device
-            }
+        // Silent since its last check, ask it before giving up on it
+        if (to_delete->livenessProbes < LIVENESS_RETRIES && scheduler_liveness_applies(pEnv, to_delete) &&
+            send_liveness_probe(to_delete, pEnv) == 0) {
+            to_delete->livenessProbes++;
+            device_table_reschedule(&pEnv->devices, to_delete, scheduler_liveness_retry(to_delete, now));
+            continue;
+        }
 
-            current = current->next;
+		if (pEnv->debugging_enabled) {
+			fprintf(stderr,"Removing stale device %s\n",inet_ntoa(to_delete->source.sin_addr));
+		}
 
-            // Free the removed device's resources
-            free(to_delete->payload);
-            free(to_delete);
-        } else {
-            // Move to the next device
-            prev = current;
-            current = current->next;
+        device_table_remove(&pEnv->devices, to_delete);
+
+        // A lease from a federation peer that ran out is the peer's business
+        if (to_delete->peer == 0) {
+            metric_add(pEnv->metrics, METRIC_DEVICES_EXPIRED, 1);
+
+            // Something changed behind that interface, probe it again soon
+            scheduler_reset(pEnv, to_delete->ifindex);
+            federation_device_expired(pEnv, to_delete);
         }
+        devcache_erase(pEnv, to_delete);
+        workers_release_device(pEnv, to_delete);
     }
 }
@@ -8,10 +8,17 @@
 #define PACKET_PROCESSING_H
 
 int setup_listener();
+PacketType classify_packet(const struct sockaddr_in *, const char *, ssize_t, const Environment *, EcnRecord *);
+void handle_socket_event(EventSource *, uint32_t);
+void process_batch(struct RxRing *, Environment *);
 void process_received_packet(int, Environment *);
-void send_discovery_packets(Environment *);
-void handle_discovery_response(const struct sockaddr_in *, Environment *, const char *, ssize_t);
-void reply_to_discovery(const struct sockaddr_in *, Environment *);
+int open_broadcast_socket(InterfaceNode *, Environment *);
+void close_broadcast_socket(InterfaceNode *, Environment *);
+void setup_broadcast_sockets(Environment *);
+void send_discovery_probe(InterfaceNode *, Environment *);
+void handle_discovery_response(const struct sockaddr_in *, int, Environment *, const char *, ssize_t, const EcnRecord *);
+void reply_with_device(const struct sockaddr_in *, int, DiscoveredDevice *, Environment *);
+size_t reply_to_discovery(const struct sockaddr_in *, int, char, Environment *);
 void remove_stale_devices(Environment *);
 
 #endif
\ No newline at end of file
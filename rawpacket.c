@@ -8,93 +8,228 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>  // IP header
 #include <netinet/udp.h> // UDP header
 #include <arpa/inet.h>
 
-// Function to calculate IP header checksum
-unsigned short checksum(void *b, int len) {    
-    unsigned short *buf = b;
-    unsigned int sum = 0;
-    unsigned short result;
-
-    for (sum = 0; len > 1; len -= 2)
-        sum += *buf++;
-    if (len == 1)
-        sum += *(unsigned char *)buf;
-    sum = (sum >> 16) + (sum & 0xFFFF);
-    sum += (sum >> 16);
-    result = ~sum;
-    return result;
+#include "checksum.h"
+#include "rawpacket.h"
+
+static int udp_checksum_enabled; // UDP checksums are optional in IPv4, off by default
+
+// Fill in the UDP checksum of every forged datagram from now on
+void raw_enable_udp_checksum() {
+    udp_checksum_enabled = 1;
 }
 
-// Function to send a raw UDP packet
-ssize_t send_raw_udp_packet(const struct sockaddr_in *src, const struct sockaddr_in *dst, const char *payload, size_t payload_len) {
+// Open the raw socket used for every forged reply, once for the process lifetime
+int setup_raw_sender() {
     int sockfd;
-    struct iphdr *iph;
-    struct udphdr *udph;
-    char packet[4096];
-    char *data;
-    int packet_len;
-	ssize_t bytes_sent;
 
     // Create a raw socket
     if ((sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_UDP)) < 0) {
-        perror("socket failed");
-        return -1;
+        perror("raw socket creation failed");
+        exit(EXIT_FAILURE);
     }
 
-    // Pointer to the IP header within 'packet'
-    iph = (struct iphdr *)packet;
-
-    // Pointer to the UDP header within 'packet'
-    udph = (struct udphdr *)(packet + sizeof(struct iphdr));
+    // Inform the kernel do not fill up the packet structure, we will build our own...
+    if (setsockopt(sockfd, IPPROTO_IP, IP_HDRINCL, &(int){1}, sizeof(int)) < 0) {
+        perror("setsockopt IP_HDRINCL failed");
+        exit(EXIT_FAILURE);
+    }
 
-    // Pointer to the data/payload within 'packet'
-    data = packet + sizeof(struct iphdr) + sizeof(struct udphdr);
+    return sockfd;
+}
 
-    // Fill in the data/payload
-    memcpy(data, payload, payload_len);
+// Fill in the IP and UDP headers of a forged datagram
+void build_raw_header(RawHeader *hdr, const struct sockaddr_in *src, const struct sockaddr_in *dst, const char *payload, size_t payload_len) {
+    struct iphdr *iph = &hdr->ip;
+    struct udphdr *udph = &hdr->udp;
 
     // Fill in the IP Header
     iph->ihl = 5;
     iph->version = 4;
     iph->tos = 0;
-    iph->tot_len = sizeof(struct iphdr) + sizeof(struct udphdr) + payload_len;
-    iph->id = htonl(54321);
+    iph->tot_len = htons(sizeof(RawHeader) + payload_len);
+    iph->id = htons(54321);
     iph->frag_off = 0;
     iph->ttl = 255;
     iph->protocol = IPPROTO_UDP;
     iph->check = 0; // Set to 0 before calculating checksum
     iph->saddr = src->sin_addr.s_addr;
     iph->daddr = dst->sin_addr.s_addr;
-    iph->check = checksum((unsigned short *)packet, iph->tot_len);
+    iph->check = checksum_ipv4_header(iph);
 
     // Fill in the UDP Header
     udph->source = src->sin_port;
     udph->dest = dst->sin_port;
     udph->len = htons(sizeof(struct udphdr) + payload_len);
     udph->check = 0; // UDP checksum is optional, set to 0
+    if (udp_checksum_enabled) {
+        udph->check = checksum_udp(iph, udph, payload, payload_len);
+    }
+}
 
-    // Calculate total packet length
-    packet_len = iph->tot_len;
+// Build the headers of a device's forged datagrams once, with a blank
+// destination that raw_batch_add_frame() patches in for every requester
+void raw_frame_build(RawHeader *hdr, const struct sockaddr_in *src, const char *payload, size_t payload_len) {
+    struct sockaddr_in blank;
 
-    // Inform the kernel do not fill up the packet structure, we will build our own...
-    if (setsockopt(sockfd, IPPROTO_IP, IP_HDRINCL, &(int){1}, sizeof(int)) < 0) {
-        perror("setsockopt");
-        return -1;
-    }
+    memset(&blank, 0, sizeof(blank));
+    build_raw_header(hdr, src, &blank, payload, payload_len);
+}
+
+// Function to send a single raw UDP packet through the shared raw socket
+ssize_t send_raw_udp_packet(int sockfd, const struct sockaddr_in *src, const struct sockaddr_in *dst, const char *payload, size_t payload_len) {
+    RawHeader hdr;
+    struct iovec iov[2];
+    struct msghdr msg;
+    ssize_t bytes_sent;
+
+    build_raw_header(&hdr, src, dst, payload, payload_len);
+
+    // The payload is sent straight from the caller's buffer
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = payload_len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void *)dst;
+    msg.msg_namelen = sizeof(*dst);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
 
     // Send the packet
-	bytes_sent=sendto(sockfd, packet, packet_len, 0, (struct sockaddr *)dst, sizeof(*dst));
+    bytes_sent = sendmsg(sockfd, &msg, 0);
     if (bytes_sent < 0) {
-        perror("sendto failed");
+        perror("sendmsg failed");
+    }
+
+    return bytes_sent;
+}
+
+// Start a new burst of datagrams towards dst, leaving through ifindex if not 0
+void raw_batch_init(RawBatch *batch, const struct sockaddr_in *dst, int ifindex) {
+    // A flushed batch is reset onto its own destination
+    if (dst != &batch->dst) {
+        memcpy(&batch->dst, dst, sizeof(batch->dst));
+    }
+    batch->count = 0;
+    batch->ifindex = ifindex;
+
+    if (ifindex > 0) {
+        struct msghdr msg = { .msg_control = batch->control, .msg_controllen = sizeof(batch->control) };
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
+
+        memset(batch->control, 0, sizeof(batch->control));
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_PKTINFO;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+        pktinfo->ipi_ifindex = ifindex;
+    }
+}
+
+// Queue one forged datagram, returns its index in the batch or -1 when the batch is full
+int raw_batch_add(RawBatch *batch, const struct sockaddr_in *src, const char *payload, size_t payload_len) {
+    unsigned int i = batch->count;
+    struct msghdr *msg;
+
+    if (i >= RAW_BATCH_SIZE) {
+        return -1;
+    }
+
+    build_raw_header(&batch->headers[i], src, &batch->dst, payload, payload_len);
+
+    batch->iov[i][0].iov_base = &batch->headers[i];
+    batch->iov[i][0].iov_len = sizeof(RawHeader);
+    batch->iov[i][1].iov_base = (void *)payload;
+    batch->iov[i][1].iov_len = payload_len;
+
+    msg = &batch->msgs[i].msg_hdr;
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &batch->dst;
+    msg->msg_namelen = sizeof(batch->dst);
+    msg->msg_iov = batch->iov[i];
+    msg->msg_iovlen = 2;
+    if (batch->ifindex > 0) {
+        msg->msg_control = batch->control;
+        msg->msg_controllen = sizeof(batch->control);
+    }
+
+    batch->errors[i] = 0;
+    batch->count++;
+    return i;
+}
+
+// Queue one datagram from pre-built headers, only the destination is patched.
+// Returns its index in the batch or -1 when the batch is full.
+int raw_batch_add_frame(RawBatch *batch, const RawHeader *frame, const char *payload, size_t payload_len) {
+    unsigned int i = batch->count;
+    RawHeader *hdr = &batch->headers[i];
+    struct msghdr *msg;
+
+    if (i >= RAW_BATCH_SIZE) {
+        return -1;
+    }
+
+    *hdr = *frame;
+    hdr->ip.daddr = batch->dst.sin_addr.s_addr;
+    hdr->ip.check = checksum_update32(frame->ip.check, frame->ip.daddr, hdr->ip.daddr);
+    hdr->udp.dest = batch->dst.sin_port;
+
+    // The destination is part of the UDP pseudo-header
+    if (frame->udp.check != 0) {
+        uint16_t check = checksum_update32(frame->udp.check, frame->ip.daddr, hdr->ip.daddr);
+        check = checksum_update16(check, frame->udp.dest, hdr->udp.dest);
+        hdr->udp.check = check == 0 ? 0xFFFF : check;
+    }
+
+    batch->iov[i][0].iov_base = hdr;
+    batch->iov[i][0].iov_len = sizeof(RawHeader);
+    batch->iov[i][1].iov_base = (void *)payload;
+    batch->iov[i][1].iov_len = payload_len;
+
+    msg = &batch->msgs[i].msg_hdr;
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &batch->dst;
+    msg->msg_namelen = sizeof(batch->dst);
+    msg->msg_iov = batch->iov[i];
+    msg->msg_iovlen = 2;
+    if (batch->ifindex > 0) {
+        msg->msg_control = batch->control;
+        msg->msg_controllen = sizeof(batch->control);
+    }
+
+    batch->errors[i] = 0;
+    batch->count++;
+    return i;
+}
+
+// Send every queued datagram, using as few sendmmsg() calls as possible.
+// Returns the number of datagrams that could not be sent; the errno of each
+// one is left in batch->errors.
+int raw_batch_send(int sockfd, RawBatch *batch) {
+    unsigned int sent = 0;
+    int failures = 0;
+
+    while (sent < batch->count) {
+        int ret = sendmmsg(sockfd, &batch->msgs[sent], batch->count - sent, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // The datagram at the head of the remaining burst was refused, skip it
+            batch->errors[sent++] = errno;
+            failures++;
+            continue;
+        }
+        sent += ret;
     }
 
-    // Close the socket
-    close(sockfd);
-	
-	return bytes_sent;
+    return failures;
 }
@@ -7,7 +7,42 @@
 #ifndef RAWPACKET_H
 #define RAWPACKET_H
 
-unsigned short checksum(void *, int);
-ssize_t send_raw_udp_packet(const struct sockaddr_in *, const struct sockaddr_in *, const char *, size_t);
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
 
-#endif
\ No newline at end of file
+#define RAW_BATCH_SIZE 64 // Maximum number of datagrams handed to one sendmmsg()
+
+// IP and UDP headers of a forged datagram, laid out as they go on the wire
+typedef struct {
+    struct iphdr ip;
+    struct udphdr udp;
+} RawHeader;
+
+// A burst of forged datagrams sharing the same destination
+typedef struct {
+    struct sockaddr_in dst;
+    RawHeader headers[RAW_BATCH_SIZE];
+    struct iovec iov[RAW_BATCH_SIZE][2]; // Header, then payload (not copied)
+    struct mmsghdr msgs[RAW_BATCH_SIZE];
+    int errors[RAW_BATCH_SIZE]; // errno of each datagram after sending, 0 on success
+    int ifindex; // Egress interface forced on every datagram, 0 to let routing decide
+    char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    unsigned int count;
+} RawBatch;
+
+int setup_raw_sender();
+void raw_enable_udp_checksum();
+void build_raw_header(RawHeader *, const struct sockaddr_in *, const struct sockaddr_in *, const char *, size_t);
+ssize_t send_raw_udp_packet(int, const struct sockaddr_in *, const struct sockaddr_in *, const char *, size_t);
+void raw_batch_init(RawBatch *, const struct sockaddr_in *, int);
+int raw_batch_add(RawBatch *, const struct sockaddr_in *, const char *, size_t);
+void raw_frame_build(RawHeader *, const struct sockaddr_in *, const char *, size_t);
+int raw_batch_add_frame(RawBatch *, const RawHeader *, const char *, size_t);
+int raw_batch_send(int, RawBatch *);
+
+#endif
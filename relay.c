@@ -0,0 +1,143 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+/*
+ * Relay mode (-R), for the queries the device table cannot answer in full
+ * yet: right after startup, or while the devices behind an interface are
+ * changing. Such an interface is cold, its probing interval is still at the
+ * minimum (see scheduler.c), or no device at all is known.
+ *
+ * A query is answered from the table as usual, then relayed at once onto
+ * the other cold interfaces as a !xECNQSTN broadcast. The requester is
+ * remembered for RELAY_WINDOW_MS: every device learned meanwhile, whatever
+ * the query or probe it answered, is forged to it as soon as it is in the
+ * table. It gets the missing devices after one round trip, instead of
+ * waiting for the next probe and asking again.
+ *
+ * Only the main thread runs this, the workers hand their queries over.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "types.h"
+#include "interface.h"
+#include "scheduler.h"
+#include "metrics.h"
+#include "packet_processing.h"
+#include "utilities.h"
+#include "relay.h"
+
+void relay_open(Environment *pEnv) {
+    if (!pEnv->relay_enabled) {
+        return;
+    }
+    if ((pEnv->relay = calloc(1, sizeof(Relay))) == NULL) {
+        perror("Failed to allocate memory for the relay");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static int interface_cold(const Environment *pEnv, const InterfaceNode *iface) {
+    return iface->probeInterval <= PROBE_MIN_INTERVAL_MS || pEnv->devices.count == 0;
+}
+
+// Forget the requesters whose window is over
+static void relay_expire(Relay *relay, uint64_t now) {
+    for (int i = 0; i < relay->count; ) {
+        if (relay->pending[i].deadline <= now) {
+            relay->pending[i] = relay->pending[--relay->count];
+        } else {
+            i++;
+        }
+    }
+}
+
+// Remember the requester, a repeated query extends its window
+static void relay_remember(Relay *relay, const struct sockaddr_in *requester, int ifindex, char unit, uint64_t now) {
+    RelayedQuery *entry = NULL;
+
+    relay_expire(relay, now);
+    for (int i = 0; i < relay->count; i++) {
+        RelayedQuery *current = &relay->pending[i];
+        if (current->ifindex == ifindex && current->unit == unit &&
+            current->requester.sin_addr.s_addr == requester->sin_addr.s_addr &&
+            current->requester.sin_port == requester->sin_port) {
+            entry = current;
+            break;
+        }
+    }
+
+    if (entry == NULL) {
+        if (relay->count == RELAY_PENDING_MAX) {
+            // Full, the requester closest to the end of its window makes room
+            entry = &relay->pending[0];
+            for (int i = 1; i < relay->count; i++) {
+                if (relay->pending[i].deadline < entry->deadline) {
+                    entry = &relay->pending[i];
+                }
+            }
+        } else {
+            entry = &relay->pending[relay->count++];
+        }
+        memcpy(&entry->requester, requester, sizeof(entry->requester));
+        entry->ifindex = ifindex;
+        entry->unit = unit;
+    }
+    entry->deadline = now + RELAY_WINDOW_MS;
+}
+
+// An admitted query from ifindex, already answered from the table
+void relay_query(Environment *pEnv, const struct sockaddr_in *requester, int ifindex, char unit) {
+    uint64_t now = monotonic_ms();
+    int relayed = 0;
+
+    for (InterfaceNode *current = pEnv->interfaces; current != NULL; current = current->next) {
+        if (current->ifindex == ifindex || !interfaceHasAddress(current) || !interface_cold(pEnv, current)) {
+            continue;
+        }
+        relayed = 1;
+
+        if (current->relayedAt != 0 && now - current->relayedAt < RELAY_HOLDOFF_MS) {
+            continue;
+        }
+        current->relayedAt = now;
+        send_discovery_probe(current, pEnv);
+        if (pEnv->debugging_enabled) {
+            fprintf(stderr,"Query from %s:%d relayed onto interface %s\n", inet_ntoa(requester->sin_addr), ntohs(requester->sin_port), current->name);
+        }
+    }
+
+    // Every segment is warm, the table had the whole answer
+    if (!relayed) {
+        return;
+    }
+    metric_add(pEnv->metrics, METRIC_QUERIES_RELAYED, 1);
+    relay_remember(pEnv->relay, requester, ifindex, unit, now);
+}
+
+// A device entered the table, stream it to the requesters still waiting
+void relay_device_learned(Environment *pEnv, DiscoveredDevice *device) {
+    Relay *relay = pEnv->relay;
+
+    if (relay == NULL || relay->count == 0 || device->peer != 0) {
+        return;
+    }
+
+    relay_expire(relay, monotonic_ms());
+    for (int i = 0; i < relay->count; i++) {
+        RelayedQuery *current = &relay->pending[i];
+
+        // The requester hears the devices of its own segment directly
+        if (current->ifindex == device->ifindex ||
+            (current->unit != ISCP_UNIT_ANY && current->unit != device->ecn.unit)) {
+            continue;
+        }
+        reply_with_device(&current->requester, current->ifindex, device, pEnv);
+        metric_add(pEnv->metrics, METRIC_RELAYED_REPLIES, 1);
+    }
+}
@@ -0,0 +1,36 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "types.h"
+
+#define RELAY_PENDING_MAX 64  // Requesters waiting for relayed responses
+#define RELAY_WINDOW_MS 3000  // How long devices learned are streamed to a requester
+#define RELAY_HOLDOFF_MS 250  // One broadcast per interface serves the queries relayed meanwhile
+
+// A requester still waiting for the responses to its relayed query
+typedef struct {
+    struct sockaddr_in requester;
+    int ifindex;       // Interface the query came in through
+    char unit;         // Unit type asked for, ISCP_UNIT_ANY for every device
+    uint64_t deadline; // Monotonic ms, end of the window
+} RelayedQuery;
+
+typedef struct Relay {
+    int count;
+    RelayedQuery pending[RELAY_PENDING_MAX];
+} Relay;
+
+void relay_open(Environment *);
+void relay_query(Environment *, const struct sockaddr_in *, int, char);
+void relay_device_learned(Environment *, DiscoveredDevice *);
+
+#endif
@@ -0,0 +1,521 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+/*
+ * Offline replay of captured discovery traffic through the live code path.
+ *
+ * Every UDP datagram sent to port 60128 in a pcap or pcapng file is handed
+ * to process_batch(), as if received by recvmmsg(). The clock follows the
+ * capture timestamps, so that device expiry, cadences and query coalescing
+ * behave as they did on site however fast the file is read, and a replay
+ * always gives the same replies. Those are written to a classic pcap file
+ * (raw IPv4) instead of being sent.
+ *
+ * The segment a datagram was seen on stands in for its interface: the
+ * 802.1Q VLAN when tagged, else the ifindex of a Linux "any" capture (SLL2),
+ * else the pcapng interface. Otherwise it is unknown (0) and no reply is
+ * held back for being on the requester's own segment.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+
+#include "types.h"
+#include "eventloop.h"
+#include "rxring.h"
+#include "txring.h"
+#include "requesters.h"
+#include "scheduler.h"
+#include "device_table.h"
+#include "metrics.h"
+#include "latency.h"
+#include "packet_processing.h"
+#include "replay.h"
+
+#define PCAP_MAGIC_USEC 0xA1B2C3D4
+#define PCAP_MAGIC_NSEC 0xA1B23C4D
+#define PCAPNG_SHB 0x0A0D0D0A // Section header block, also marks the format
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4D
+#define PCAPNG_IDB 1 // Interface description block
+#define PCAPNG_SPB 3 // Simple packet block
+#define PCAPNG_EPB 6 // Enhanced packet block
+#define PCAPNG_OPTION_TSRESOL 9
+#define PCAPNG_MAX_INTERFACES 256
+#define CAPTURE_MAX_BLOCK (16 * 1024 * 1024) // Anything larger is a corrupt file
+
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_LINUX_SLL2 276
+
+// Reading position in a capture file, either format
+typedef struct {
+    FILE *file;
+    int pcapng;
+    int swapped;      // Written on a host of the other byte order
+    int nanoseconds;  // Classic pcap only
+    int linktype;     // Classic pcap only
+    int interfaces;   // pcapng interfaces of the current section
+    int linktypes[PCAPNG_MAX_INTERFACES];
+    uint64_t resolution[PCAPNG_MAX_INTERFACES]; // Timestamp units per second
+    unsigned char *buffer;
+    size_t bufferSize;
+    struct timespec last; // Simple packet blocks carry no timestamp
+} CaptureReader;
+
+// One captured link-layer frame
+typedef struct {
+    const unsigned char *data;
+    size_t length;
+    int linktype;
+    int interface; // pcapng interface number plus one, 0 in a classic pcap
+    struct timespec ts;
+} CapturedFrame;
+
+static uint32_t read32(const CaptureReader *reader, const unsigned char *p) {
+    uint32_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return reader->swapped ? __builtin_bswap32(value) : value;
+}
+
+static uint16_t read16(const CaptureReader *reader, const unsigned char *p) {
+    uint16_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return reader->swapped ? __builtin_bswap16(value) : value;
+}
+
+static int reader_fill(CaptureReader *reader, size_t length) {
+    if (length > reader->bufferSize) {
+        unsigned char *grown = realloc(reader->buffer, length);
+        if (grown == NULL) {
+            return -1;
+        }
+        reader->buffer = grown;
+        reader->bufferSize = length;
+    }
+    return fread(reader->buffer, 1, length, reader->file) == length ? 0 : -1;
+}
+
+static int capture_open(CaptureReader *reader, const char *path) {
+    unsigned char header[24];
+    uint32_t magic;
+
+    memset(reader, 0, sizeof(*reader));
+    if ((reader->file = fopen(path, "rb")) == NULL) {
+        return -1;
+    }
+    if (fread(header, 1, 4, reader->file) != 4) {
+        return -1;
+    }
+    memcpy(&magic, header, sizeof(magic));
+
+    // The section header reads the same in both byte orders
+    if (magic == PCAPNG_SHB) {
+        reader->pcapng = 1;
+        rewind(reader->file);
+        return 0;
+    }
+
+    if (fread(header + 4, 1, sizeof(header) - 4, reader->file) != sizeof(header) - 4) {
+        return -1;
+    }
+    if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC) {
+        reader->swapped = 0;
+    } else if (__builtin_bswap32(magic) == PCAP_MAGIC_USEC || __builtin_bswap32(magic) == PCAP_MAGIC_NSEC) {
+        reader->swapped = 1;
+        magic = __builtin_bswap32(magic);
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+    reader->nanoseconds = magic == PCAP_MAGIC_NSEC;
+    reader->linktype = read32(reader, header + 20) & 0xFFFF;
+    return 0;
+}
+
+// Timestamp units per second, from the if_tsresol option of an interface
+static void pcapng_interface(CaptureReader *reader, const unsigned char *body, size_t length) {
+    uint64_t resolution = 1000000;
+    size_t offset = 8;
+
+    if (reader->interfaces >= PCAPNG_MAX_INTERFACES || length < 8) {
+        return;
+    }
+
+    while (offset + 4 <= length) {
+        uint16_t code = read16(reader, body + offset);
+        uint16_t size = read16(reader, body + offset + 2);
+
+        if (code == 0 || offset + 4 + size > length) {
+            break;
+        }
+        if (code == PCAPNG_OPTION_TSRESOL && size >= 1) {
+            uint8_t exponent = body[offset + 4];
+            if (exponent & 0x80) {
+                resolution = 1ULL << ((exponent & 0x7F) < 63 ? (exponent & 0x7F) : 63);
+            } else {
+                resolution = 1;
+                for (int i = 0; i < exponent && i < 19; i++) {
+                    resolution *= 10;
+                }
+            }
+        }
+        offset += 4 + ((size + 3) & ~3);
+    }
+
+    reader->linktypes[reader->interfaces] = read16(reader, body);
+    reader->resolution[reader->interfaces] = resolution;
+    reader->interfaces++;
+}
+
+static void ticks_to_timespec(uint64_t ticks, uint64_t resolution, struct timespec *ts) {
+    uint64_t fraction = ticks % resolution;
+
+    ts->tv_sec = ticks / resolution;
+    if (resolution <= 1000000000ULL) {
+        ts->tv_nsec = fraction * (1000000000ULL / resolution);
+    } else {
+        ts->tv_nsec = (long)((double)fraction * 1e9 / resolution);
+    }
+}
+
+// Next frame of a pcapng file: 1 when found, 0 at the end, -1 if corrupt
+static int pcapng_next(CaptureReader *reader, CapturedFrame *frame) {
+    unsigned char head[12];
+
+    while (fread(head, 1, 8, reader->file) == 8) {
+        uint32_t type, length;
+        const unsigned char *body;
+
+        memcpy(&type, head, sizeof(type));
+        if (type == PCAPNG_SHB) {
+            uint32_t order;
+
+            // A new section may come with another byte order, and restarts interfaces
+            if (fread(head + 8, 1, 4, reader->file) != 4) {
+                return -1;
+            }
+            memcpy(&order, head + 8, sizeof(order));
+            if (order != PCAPNG_BYTE_ORDER && __builtin_bswap32(order) != PCAPNG_BYTE_ORDER) {
+                return -1;
+            }
+            reader->swapped = order != PCAPNG_BYTE_ORDER;
+            reader->interfaces = 0;
+            length = read32(reader, head + 4);
+            if (length < 28 || length % 4 != 0 || length > CAPTURE_MAX_BLOCK || reader_fill(reader, length - 12) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        type = read32(reader, head);
+        length = read32(reader, head + 4);
+        if (length < 12 || length % 4 != 0 || length > CAPTURE_MAX_BLOCK || reader_fill(reader, length - 8) < 0) {
+            return -1;
+        }
+        body = reader->buffer;
+        length -= 12; // Body only, without the trailing length either
+
+        if (type == PCAPNG_IDB) {
+            pcapng_interface(reader, body, length);
+        } else if (type == PCAPNG_EPB && length >= 20) {
+            uint32_t interface = read32(reader, body);
+            uint64_t ticks = ((uint64_t)read32(reader, body + 4) << 32) | read32(reader, body + 8);
+            uint32_t captured = read32(reader, body + 12);
+
+            if (interface >= (uint32_t)reader->interfaces || captured > length - 20) {
+                return -1;
+            }
+            ticks_to_timespec(ticks, reader->resolution[interface], &reader->last);
+            frame->data = body + 20;
+            frame->length = captured;
+            frame->linktype = reader->linktypes[interface];
+            frame->interface = interface + 1;
+            frame->ts = reader->last;
+            return 1;
+        } else if (type == PCAPNG_SPB && length >= 4 && reader->interfaces > 0) {
+            uint32_t original = read32(reader, body);
+
+            frame->data = body + 4;
+            frame->length = original < length - 4 ? original : length - 4;
+            frame->linktype = reader->linktypes[0];
+            frame->interface = 1;
+            frame->ts = reader->last;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Next frame of the capture: 1 when found, 0 at the end, -1 if corrupt
+static int capture_next(CaptureReader *reader, CapturedFrame *frame) {
+    unsigned char record[16];
+    uint32_t captured;
+
+    if (reader->pcapng) {
+        return pcapng_next(reader, frame);
+    }
+
+    if (fread(record, 1, sizeof(record), reader->file) != sizeof(record)) {
+        return 0;
+    }
+    captured = read32(reader, record + 8);
+    if (captured > CAPTURE_MAX_BLOCK || reader_fill(reader, captured) < 0) {
+        return -1;
+    }
+    frame->data = reader->buffer;
+    frame->length = captured;
+    frame->linktype = reader->linktype;
+    frame->interface = 0;
+    frame->ts.tv_sec = read32(reader, record);
+    frame->ts.tv_nsec = read32(reader, record + 4) * (reader->nanoseconds ? 1 : 1000);
+    return 1;
+}
+
+// Fill a receive slot from a frame holding a UDP datagram sent to our port
+static int decode_datagram(const CapturedFrame *frame, RxSlot *slot) {
+    const unsigned char *p = frame->data;
+    size_t length = frame->length;
+    uint16_t ethertype = 0;
+    int segment = frame->interface;
+    const struct iphdr *ip;
+    const struct udphdr *udp;
+    size_t ipLength, udpLength;
+
+    switch (frame->linktype) {
+        case LINKTYPE_ETHERNET:
+            if (length < 14) {
+                return 0;
+            }
+            ethertype = (p[12] << 8) | p[13];
+            p += 14;
+            length -= 14;
+            // 802.1Q and 802.1ad tags, the innermost VLAN is the segment
+            while ((ethertype == 0x8100 || ethertype == 0x88A8) && length >= 4) {
+                segment = ((p[0] << 8) | p[1]) & 0x0FFF;
+                ethertype = (p[2] << 8) | p[3];
+                p += 4;
+                length -= 4;
+            }
+            break;
+        case LINKTYPE_LINUX_SLL:
+            if (length < 16) {
+                return 0;
+            }
+            ethertype = (p[14] << 8) | p[15];
+            p += 16;
+            length -= 16;
+            break;
+        case LINKTYPE_LINUX_SLL2:
+            if (length < 20) {
+                return 0;
+            }
+            ethertype = (p[0] << 8) | p[1];
+            segment = (p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+            p += 20;
+            length -= 20;
+            break;
+        case LINKTYPE_NULL:
+            if (length < 4) {
+                return 0;
+            }
+            // Address family in the byte order of the capturing host
+            ethertype = (p[0] == AF_INET || p[3] == AF_INET) ? 0x0800 : 0;
+            p += 4;
+            length -= 4;
+            break;
+        case LINKTYPE_RAW:
+        case LINKTYPE_IPV4:
+            ethertype = 0x0800;
+            break;
+        default:
+            return 0;
+    }
+
+    if (ethertype != 0x0800 || length < sizeof(struct iphdr)) {
+        return 0;
+    }
+    ip = (const struct iphdr *)p;
+    ipLength = ip->ihl * 4;
+    // Fragments are left out, discovery datagrams never need them
+    if (ip->version != 4 || ip->protocol != IPPROTO_UDP || ipLength < sizeof(struct iphdr) ||
+        (ntohs(ip->frag_off) & 0x3FFF) != 0 || length < ipLength + sizeof(struct udphdr)) {
+        return 0;
+    }
+    udp = (const struct udphdr *)(p + ipLength);
+    udpLength = ntohs(udp->len);
+    if (ntohs(udp->dest) != PORT || udpLength < sizeof(struct udphdr) || length < ipLength + udpLength) {
+        return 0;
+    }
+    udpLength -= sizeof(struct udphdr);
+    // Nothing that large is discovery traffic
+    if (udpLength > RX_SLOT_SIZE) {
+        return 0;
+    }
+
+    memcpy(slot->data, p + ipLength + sizeof(struct udphdr), udpLength);
+    memset(&slot->source, 0, sizeof(slot->source));
+    slot->source.sin_family = AF_INET;
+    slot->source.sin_addr.s_addr = ip->saddr;
+    slot->source.sin_port = udp->source;
+    slot->destination.s_addr = ip->daddr;
+    slot->ifindex = segment;
+    // Capture times are not comparable with ours, no latency to record
+    slot->received.tv_sec = 0;
+    slot->received.tv_nsec = 0;
+    slot->packet = slot->data;
+    slot->length = udpLength;
+    return 1;
+}
+
+// Classic pcap 2.4 in host byte order, nanosecond timestamps, raw IPv4
+static void capture_write_header(FILE *output) {
+    struct {
+        uint32_t magic;
+        uint16_t major, minor;
+        int32_t zone;
+        uint32_t sigfigs, snaplen, linktype;
+    } header = { PCAP_MAGIC_NSEC, 2, 4, 0, 0, 65535, LINKTYPE_RAW };
+
+    if (fwrite(&header, sizeof(header), 1, output) != 1) {
+        perror("Failed to write the replay output");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Transmit backend of a replay: the burst goes to the output capture
+int replay_capture(Environment *pEnv, RawBatch *batch) {
+    Replay *replay = pEnv->replay;
+    int failures = 0;
+
+    for (unsigned int i = 0; i < batch->count; i++) {
+        size_t length = batch->iov[i][0].iov_len + batch->iov[i][1].iov_len;
+        uint32_t record[4] = { replay->now.tv_sec, replay->now.tv_nsec, length, length };
+
+        batch->errors[i] = 0;
+        if (replay->output == NULL) {
+            continue;
+        }
+        if (fwrite(record, sizeof(record), 1, replay->output) != 1 ||
+            fwrite(batch->iov[i][0].iov_base, batch->iov[i][0].iov_len, 1, replay->output) != 1 ||
+            fwrite(batch->iov[i][1].iov_base, batch->iov[i][1].iov_len, 1, replay->output) != 1) {
+            batch->errors[i] = errno ? errno : EIO;
+            failures++;
+        }
+    }
+    return failures;
+}
+
+static uint64_t timespec_ms(const struct timespec *ts) {
+    return (uint64_t)ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
+}
+
+// Run the capture through the proxy, then report what came out of it
+void replay_run(Environment *pEnv) {
+    CaptureReader reader;
+    CapturedFrame frame;
+    Replay replay;
+    RxRing *ring;
+    struct timespec started, finished;
+    uint64_t datagrams = 0, nextSweep = 0;
+    double elapsed;
+    int result;
+
+    if (capture_open(&reader, pEnv->replay_input) < 0) {
+        perror("Failed to open the capture to replay");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&replay, 0, sizeof(replay));
+    if (pEnv->replay_output != NULL) {
+        if ((replay.output = fopen(pEnv->replay_output, "wb")) == NULL) {
+            perror("Failed to open the replay output");
+            exit(EXIT_FAILURE);
+        }
+        capture_write_header(replay.output);
+    }
+
+    pEnv->replay = &replay;
+    pEnv->tx_backend = TX_BACKEND_CAPTURE;
+    pEnv->rx_ring = ring = rx_ring_create();
+    pEnv->requesters = requester_table_create();
+    pEnv->metrics = metrics_create();
+    pEnv->latency = latency_create();
+    ring->count = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    while ((result = capture_next(&reader, &frame)) > 0) {
+        // Time never goes back, not even in merged captures
+        if (frame.ts.tv_sec < replay.now.tv_sec ||
+            (frame.ts.tv_sec == replay.now.tv_sec && frame.ts.tv_nsec < replay.now.tv_nsec)) {
+            frame.ts = replay.now;
+        }
+
+        // Datagrams of the same millisecond make up one receive batch
+        if (ring->count > 0 && (timespec_ms(&frame.ts) != timespec_ms(&replay.now) || ring->count == RX_BATCH_SIZE)) {
+            process_batch(ring, pEnv);
+            ring->count = 0;
+        }
+
+        replay.now = frame.ts;
+        monotonic_replay(&replay.now);
+        if (nextSweep == 0) {
+            // The wheel started on the clock of the host, it takes the one of the capture
+            device_table_set_clock(&pEnv->devices, timespec_ms(&replay.now));
+        }
+        if (timespec_ms(&replay.now) >= nextSweep) {
+            remove_stale_devices(pEnv);
+            nextSweep = timespec_ms(&replay.now) + EXPIRY_SWEEP_MS;
+        }
+
+        if (decode_datagram(&frame, &ring->slots[ring->count])) {
+            ring->count++;
+            datagrams++;
+        }
+    }
+    if (ring->count > 0) {
+        process_batch(ring, pEnv);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    if (result < 0) {
+        fprintf(stderr, "The capture is truncated or corrupt, replay stopped there\n");
+    }
+    if (replay.output != NULL && fclose(replay.output) != 0) {
+        perror("Failed to write the replay output");
+        exit(EXIT_FAILURE);
+    }
+
+    elapsed = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    printf("Replayed %llu datagrams in %.3f s (%.0f datagrams/s)\n", (unsigned long long)datagrams, elapsed,
+           elapsed > 0 ? datagrams / elapsed : 0);
+    printf("Queries: %llu, answered: %llu, responses: %llu, ignored: %llu\n",
+           (unsigned long long)atomic_load(&pEnv->metrics->values[METRIC_PACKETS_QUERY]),
+           (unsigned long long)atomic_load(&pEnv->requesters->counters.answered),
+           (unsigned long long)atomic_load(&pEnv->metrics->values[METRIC_PACKETS_RESPONSE]),
+           (unsigned long long)atomic_load(&pEnv->metrics->values[METRIC_PACKETS_IGNORED]));
+    printf("Replies: %llu, failed: %llu, devices learned: %llu, expired: %llu, known at the end: %zu\n",
+           (unsigned long long)atomic_load(&pEnv->metrics->values[METRIC_REPLIES_SENT]),
+           (unsigned long long)atomic_load(&pEnv->metrics->values[METRIC_REPLIES_FAILED]),
+           (unsigned long long)atomic_load(&pEnv->metrics->values[METRIC_DEVICES_LEARNED]),
+           (unsigned long long)atomic_load(&pEnv->metrics->values[METRIC_DEVICES_EXPIRED]),
+           pEnv->devices.count);
+
+    free(reader.buffer);
+    fclose(reader.file);
+    rx_ring_free(ring);
+}
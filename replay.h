@@ -0,0 +1,25 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdio.h>
+#include <time.h>
+
+#include "types.h"
+#include "rawpacket.h"
+
+// An offline run over a capture file
+typedef struct Replay {
+    FILE *output;        // Classic pcap of the forged replies, NULL to drop them
+    struct timespec now; // Capture time of the batch being handled
+} Replay;
+
+void replay_run(Environment *);
+int replay_capture(Environment *, RawBatch *);
+
+#endif
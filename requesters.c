@@ -0,0 +1,97 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "iscp.h"
+#include "requesters.h"
+
+/*
+ * Requesters live in a fixed-size table probed linearly from their hash.
+ * When no slot within REQUESTER_PROBE_LIMIT matches or is free, the one
+ * that was answered least recently is taken over, so that a flood of
+ * spoofed sources cannot grow memory.
+ */
+
+RequesterTable* requester_table_create() {
+    RequesterTable *table = calloc(1, sizeof(RequesterTable));
+    if (!table) {
+        perror("Failed to allocate memory for requester table");
+        exit(EXIT_FAILURE);
+    }
+    return table;
+}
+
+static uint32_t requester_hash(in_addr_t addr, in_port_t port) {
+    uint32_t h = addr ^ ((uint32_t)port << 16 | port);
+
+    h ^= h >> 16;
+    h *= 0x7feb352d;
+    h ^= h >> 15;
+    h *= 0x846ca68b;
+    h ^= h >> 16;
+    return h;
+}
+
+static Requester* requester_lookup(RequesterTable *table, const struct sockaddr_in *source, uint64_t now) {
+    uint32_t home = requester_hash(source->sin_addr.s_addr, source->sin_port);
+    Requester *victim = NULL;
+
+    for (int i = 0; i < REQUESTER_PROBE_LIMIT; i++) {
+        Requester *slot = &table->slots[(home + i) & (REQUESTER_TABLE_SIZE - 1)];
+        if (slot->lastReply != 0 &&
+            slot->addr == source->sin_addr.s_addr && slot->port == source->sin_port) {
+            return slot;
+        }
+        if (victim == NULL || slot->lastReply < victim->lastReply) {
+            victim = slot;
+        }
+    }
+
+    // New requesters start with a full bucket
+    victim->addr = source->sin_addr.s_addr;
+    victim->port = source->sin_port;
+    victim->tokens = REQUESTER_BURST * 1000;
+    victim->lastRefill = now;
+    victim->lastReply = 0;
+    return victim;
+}
+
+// Decide whether a query from source gets a reply, at monotonic time now (ms).
+// Queries repeated within window_ms of the last reply are folded into it, as
+// long as it covered the unit type they ask for.
+QueryVerdict requester_admit(RequesterTable *table, const struct sockaddr_in *source, char unit, uint64_t now, int window_ms) {
+    Requester *req = requester_lookup(table, source, now);
+    uint64_t refill;
+
+    if (req->lastReply != 0 && now - req->lastReply < (uint64_t)window_ms &&
+        (req->unit == ISCP_UNIT_ANY || req->unit == unit)) {
+        atomic_fetch_add_explicit(&table->counters.coalesced, 1, memory_order_relaxed);
+        return QUERY_COALESCED;
+    }
+
+    // One token per REQUESTER_RATE-th of a second, up to the burst size
+    refill = (now - req->lastRefill) * REQUESTER_RATE;
+    if (refill > 0) {
+        req->tokens = req->tokens + refill > REQUESTER_BURST * 1000 ? REQUESTER_BURST * 1000 : req->tokens + refill;
+        req->lastRefill = now;
+    }
+
+    if (req->tokens < 1000) {
+        atomic_fetch_add_explicit(&table->counters.rateLimited, 1, memory_order_relaxed);
+        return QUERY_RATE_LIMITED;
+    }
+
+    req->tokens -= 1000;
+    req->lastReply = now;
+    req->unit = unit;
+    atomic_fetch_add_explicit(&table->counters.answered, 1, memory_order_relaxed);
+    return QUERY_ANSWER;
+}
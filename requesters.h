@@ -0,0 +1,50 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#ifndef REQUESTERS_H
+#define REQUESTERS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+
+#define REQUESTER_TABLE_SIZE 1024 // Requesters tracked at once (power of two)
+#define REQUESTER_PROBE_LIMIT 8   // Slots looked at before evicting the stalest one
+#define REQUESTER_BURST 10        // Replies a requester may get in a row
+#define REQUESTER_RATE 2          // Replies per second once the burst is spent
+
+typedef enum {
+    QUERY_ANSWER,      // Reply with the device list
+    QUERY_COALESCED,   // A reply covering it was sent to that requester within the window
+    QUERY_RATE_LIMITED // The requester is over budget
+} QueryVerdict;
+
+typedef struct {
+    in_addr_t addr;
+    in_port_t port;
+    uint32_t tokens;     // Thousandths of a reply
+    uint64_t lastRefill; // Monotonic ms
+    uint64_t lastReply;  // Monotonic ms, 0 for a free slot
+    char unit;           // Unit type the last reply was for, 'x' for every device
+} Requester;
+
+// Suppressed work, read from other threads when statistics are dumped
+typedef struct {
+    _Atomic uint64_t answered;
+    _Atomic uint64_t coalesced;
+    _Atomic uint64_t rateLimited;
+    _Atomic uint64_t repliesSaved; // Forged datagrams not sent
+} QueryCounters;
+
+typedef struct RequesterTable {
+    Requester slots[REQUESTER_TABLE_SIZE];
+    QueryCounters counters;
+} RequesterTable;
+
+RequesterTable* requester_table_create();
+QueryVerdict requester_admit(RequesterTable *, const struct sockaddr_in *, char, uint64_t, int);
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "types.h"
+#include "rxring.h"
+
+RxRing* rx_ring_create() {
+    RxRing *ring = calloc(1, sizeof(RxRing));
+    if (!ring) {
+        perror("Failed to allocate memory for receive ring");
+        exit(EXIT_FAILURE);
+    }
+
+    ring->overflow = malloc(BUFFER_SIZE);
+    if (!ring->overflow) {
+        perror("Failed to allocate memory for receive overflow buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    // Datagrams larger than a slot spill into the overflow buffer, past
+    // the first RX_SLOT_SIZE bytes which are kept free to reassemble them
+    for (int i = 0; i < RX_BATCH_SIZE; i++) {
+        ring->iov[i][0].iov_base = ring->slots[i].data;
+        ring->iov[i][0].iov_len = RX_SLOT_SIZE;
+        ring->iov[i][1].iov_base = ring->overflow + RX_SLOT_SIZE;
+        ring->iov[i][1].iov_len = BUFFER_SIZE - RX_SLOT_SIZE;
+    }
+
+    return ring;
+}
+
+void rx_ring_free(RxRing *ring) {
+    free(ring->overflow);
+    free(ring);
+}
+
+// Pull up to RX_BATCH_SIZE datagrams from sockfd without blocking.
+// Returns the number of slots filled, 0 when the socket is drained.
+int rx_ring_receive(int sockfd, RxRing *ring) {
+    int received;
+    int lastSpill = -1;
+
+    for (int i = 0; i < RX_BATCH_SIZE; i++) {
+        struct msghdr *msg = &ring->msgs[i].msg_hdr;
+        msg->msg_name = &ring->slots[i].source;
+        msg->msg_namelen = sizeof(struct sockaddr_in);
+        msg->msg_iov = ring->iov[i];
+        msg->msg_iovlen = 2;
+        msg->msg_control = ring->slots[i].control;
+        msg->msg_controllen = sizeof(ring->slots[i].control);
+        msg->msg_flags = 0;
+    }
+
+    do {
+        received = recvmmsg(sockfd, ring->msgs, RX_BATCH_SIZE, MSG_DONTWAIT, NULL);
+    } while (received < 0 && errno == EINTR);
+
+    if (received <= 0) {
+        ring->count = 0;
+        return 0;
+    }
+
+    for (int i = 0; i < received; i++) {
+        ring->slots[i].packet = ring->slots[i].data;
+        ring->slots[i].length = ring->msgs[i].msg_len;
+        ring->slots[i].type = PACKET_IGNORED;
+        ring->slots[i].ifindex = 0;
+        ring->slots[i].destination.s_addr = INADDR_ANY;
+        ring->slots[i].received.tv_sec = 0;
+        ring->slots[i].received.tv_nsec = 0;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&ring->msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&ring->msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+                ring->slots[i].ifindex = ((struct in_pktinfo *)CMSG_DATA(cmsg))->ipi_ifindex;
+                ring->slots[i].destination = ((struct in_pktinfo *)CMSG_DATA(cmsg))->ipi_addr;
+            } else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                memcpy(&ring->slots[i].received, CMSG_DATA(cmsg), sizeof(struct timespec));
+            }
+        }
+        if (ring->msgs[i].msg_len > RX_SLOT_SIZE) {
+            lastSpill = i;
+        }
+    }
+
+    // All oversize datagrams of a batch share the overflow buffer: only the
+    // last one is still intact, it is made contiguous again in that buffer
+    for (int i = 0; i < lastSpill; i++) {
+        if (ring->msgs[i].msg_len > RX_SLOT_SIZE) {
+            ring->slots[i].length = -1;
+        }
+    }
+    if (lastSpill >= 0) {
+        memcpy(ring->overflow, ring->slots[lastSpill].data, RX_SLOT_SIZE);
+        ring->slots[lastSpill].packet = ring->overflow;
+    }
+
+    ring->count = received;
+    return received;
+}
@@ -0,0 +1,49 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#ifndef RXRING_H
+#define RXRING_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "types.h"
+
+#define RX_SLOT_SIZE 512  // eISCP discovery packets are well under 100 bytes
+#define RX_BATCH_SIZE 64  // Maximum number of datagrams pulled by one recvmmsg()
+#define RX_MAX_BATCHES 16 // Maximum number of recvmmsg() calls per wakeup
+
+// One received datagram
+typedef struct {
+    char data[RX_SLOT_SIZE];
+    struct sockaddr_in source;
+    int ifindex;        // Interface the datagram arrived on, 0 if unknown
+    struct in_addr destination; // Destination address in the IP header
+    struct timespec received; // Kernel receive timestamp (CLOCK_REALTIME), 0 if unknown
+    char control[CMSG_SPACE(sizeof(struct in_pktinfo)) + CMSG_SPACE(sizeof(struct timespec))];
+    const char *packet; // Start of the datagram, in data or in the overflow buffer
+    ssize_t length;     // Length of the datagram, -1 if it was lost to an oversize neighbour
+    PacketType type;    // Filled in by the classifier
+    EcnRecord ecn;      // Decoded by the classifier, for a PACKET_RESPONSE
+} RxSlot;
+
+// Preallocated receive slots, reused by every batch
+typedef struct RxRing {
+    RxSlot slots[RX_BATCH_SIZE];
+    struct iovec iov[RX_BATCH_SIZE][2]; // Slot, then the shared overflow buffer
+    struct mmsghdr msgs[RX_BATCH_SIZE];
+    char *overflow; // BUFFER_SIZE bytes for the rare oversize datagram
+    unsigned int count;
+} RxRing;
+
+RxRing* rx_ring_create();
+void rx_ring_free(RxRing *);
+int rx_ring_receive(int, RxRing *);
+
+#endif
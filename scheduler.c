@@ -0,0 +1,175 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "types.h"
+#include "utilities.h"
+#include "eventloop.h"
+#include "interface.h"
+#include "packet_processing.h"
+#include "scheduler.h"
+
+/*
+ * Broadcasts look for new devices. Every interface is probed on its own
+ * timer. The interval starts at PROBE_MIN_INTERVAL_MS and doubles after
+ * every probe during which the set of devices did not change, up to
+ * DISCOVERY_BACKOFF_FACTOR times timeout_interval seconds. Any device
+ * appearing or disappearing on an interface brings it back to the minimum.
+ * Each interval is spread by a random jitter so that several proxies on the
+ * same segments do not fall into step.
+ *
+ * Known devices are kept alive by unicast probes instead. A device heard
+ * from is due for a check timeout_interval seconds later, give or take the
+ * jitter. If it stayed silent by then, it is sent !xECNQSTN directly, up to
+ * LIVENESS_RETRIES times with a doubling timeout, and dropped if none is
+ * answered. Devices that cannot be reached that way (learned from a peer,
+ * loaded from the cache, behind an interface without socket, or replayed)
+ * expire after missing DEVICE_EXPIRY_FACTOR responses instead.
+ */
+
+// Interval between the liveness checks of a device
+static long check_interval_ms(const Environment *pEnv) {
+    long interval = pEnv->timeout_interval * 1000L;
+    return interval < PROBE_MIN_INTERVAL_MS ? PROBE_MIN_INTERVAL_MS : interval;
+}
+
+static long probe_ceiling_ms(const Environment *pEnv) {
+    return check_interval_ms(pEnv) * DISCOVERY_BACKOFF_FACTOR;
+}
+
+static long jittered(long interval_ms) {
+    long spread = interval_ms * PROBE_JITTER_PERCENT / 100;
+    return interval_ms - spread + (spread > 0 ? random() % (2 * spread + 1) : 0);
+}
+
+static void schedule_probe(InterfaceNode *iface, long delay_ms) {
+    monotonic_now(&iface->probeDeadline);
+    timespec_add_ms(&iface->probeDeadline, delay_ms);
+    event_timer_set_deadline(&iface->probeTimer, &iface->probeDeadline);
+}
+
+static void handle_probe_timer(EventSource *source, uint32_t events) {
+    InterfaceNode *iface = (InterfaceNode *)((char *)source - offsetof(InterfaceNode, probeTimer));
+    Environment *pEnv = source->ctx;
+
+    if (event_timer_ack(source) == 0) {
+        return;
+    }
+
+    // Back off while the devices behind this interface stay the same
+    if (!iface->probeChanged && iface->probeInterval < probe_ceiling_ms(pEnv)) {
+        iface->probeInterval *= 2;
+        if (iface->probeInterval > probe_ceiling_ms(pEnv)) {
+            iface->probeInterval = probe_ceiling_ms(pEnv);
+        }
+    }
+    iface->probeChanged = 0;
+
+    send_discovery_probe(iface, pEnv);
+    schedule_probe(iface, jittered(iface->probeInterval));
+
+    if (pEnv->debugging_enabled) {
+        fprintf(stderr, "Next probe on interface %s in about %ld ms\n", iface->name, iface->probeInterval);
+    }
+}
+
+// Arm the probe timer of an interface, the first probe goes out almost at once
+void scheduler_add_interface(Environment *pEnv, InterfaceNode *iface) {
+    if (event_timer_create(pEnv->loop, &iface->probeTimer, handle_probe_timer, pEnv) < 0) {
+        logger(pEnv, "timerfd setup failed", errno);
+        exit(EXIT_FAILURE);
+    }
+    iface->probeInterval = PROBE_MIN_INTERVAL_MS;
+    iface->probeChanged = 1;
+    schedule_probe(iface, random() % PROBE_MIN_INTERVAL_MS);
+}
+
+// Arm the probe timer of every interface known at startup, more are added by linkwatch.c
+void scheduler_start(Environment *pEnv) {
+    srandom(getpid() ^ monotonic_ms());
+
+    for (InterfaceNode *current = pEnv->interfaces; current != NULL; current = current->next) {
+        scheduler_add_interface(pEnv, current);
+    }
+}
+
+// The devices behind ifindex changed (any interface when 0): probe it aggressively again
+void scheduler_reset(Environment *pEnv, int ifindex) {
+    for (InterfaceNode *current = pEnv->interfaces; current != NULL; current = current->next) {
+        struct timespec soonest;
+
+        if (ifindex != 0 && current->ifindex != ifindex) {
+            continue;
+        }
+
+        current->probeChanged = 1;
+        if (current->probeInterval <= PROBE_MIN_INTERVAL_MS) {
+            continue;
+        }
+        current->probeInterval = PROBE_MIN_INTERVAL_MS;
+
+        // Bring the next probe forward if it was further away
+        monotonic_now(&soonest);
+        timespec_add_ms(&soonest, PROBE_MIN_INTERVAL_MS);
+        if (current->probeDeadline.tv_sec > soonest.tv_sec ||
+            (current->probeDeadline.tv_sec == soonest.tv_sec && current->probeDeadline.tv_nsec > soonest.tv_nsec)) {
+            schedule_probe(current, jittered(PROBE_MIN_INTERVAL_MS));
+        }
+    }
+}
+
+// Whether the device can be checked with unicast probes
+int scheduler_liveness_applies(const Environment *pEnv, const DiscoveredDevice *device) {
+    InterfaceNode *iface;
+
+    if (device->peer != 0 || device->provisional) {
+        return 0;
+    }
+    iface = findInterfaceByIndex(pEnv->interfaces, device->ifindex);
+    return iface != NULL && iface->socket.fd >= 0;
+}
+
+// Deadline of the next unicast probe to a silent device, once one more was sent
+uint64_t scheduler_liveness_retry(const DiscoveredDevice *device, uint64_t now) {
+    return now + ((uint64_t)LIVENESS_TIMEOUT_MS << (device->livenessProbes - 1));
+}
+
+// Deadline of a device just heard from at now (monotonic ms): its next
+// liveness check, or its expiry when it cannot be checked. It may then miss
+// DEVICE_EXPIRY_FACTOR responses, at the pace it was seen answering or at
+// the pace its interface is probed, whichever is slower.
+uint64_t scheduler_device_deadline(const Environment *pEnv, const DiscoveredDevice *device, uint64_t now) {
+    InterfaceNode *iface = findInterfaceByIndex(pEnv->interfaces, device->ifindex);
+    uint64_t pace = device->cadence;
+    uint64_t expiry;
+
+    if (scheduler_liveness_applies(pEnv, device)) {
+        return now + jittered(check_interval_ms(pEnv));
+    }
+
+    if (iface != NULL && (uint64_t)iface->probeInterval > pace) {
+        pace = iface->probeInterval;
+    }
+    if (pace == 0) {
+        pace = check_interval_ms(pEnv);
+    }
+
+    // The jitter may stretch an interval
+    expiry = DEVICE_EXPIRY_FACTOR * pace * (100 + PROBE_JITTER_PERCENT) / 100;
+    return now + (expiry < DEVICE_EXPIRY_MIN_MS ? DEVICE_EXPIRY_MIN_MS : expiry);
+}
+
+// Until when a device is known to be alive, or will have been dropped
+uint64_t scheduler_device_lifetime(const Environment *pEnv, const DiscoveredDevice *device) {
+    return scheduler_liveness_applies(pEnv, device) ? device->expires + LIVENESS_BUDGET_MS : device->expires;
+}
@@ -0,0 +1,34 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+#include "types.h"
+
+#define PROBE_MIN_INTERVAL_MS 500 // Probing interval after startup or a topology change
+#define PROBE_JITTER_PERCENT 20   // Random spread applied to every probing interval
+#define EXPIRY_SWEEP_MS 1000      // How often expired devices are looked for
+#define DEVICE_EXPIRY_FACTOR 3    // Missed responses before a device is stale
+#define DEVICE_EXPIRY_MIN_MS 3000
+#define DISCOVERY_BACKOFF_FACTOR 4 // Broadcasts back off that much further than devices are checked
+#define LIVENESS_RETRIES 3         // Unicast probes a silent device gets before it is dropped
+#define LIVENESS_TIMEOUT_MS 1000   // Wait for an answer to the first one, doubled for every retry
+// Longest the retries take: the timeouts, each noticed up to a sweep and a wheel tick late
+#define LIVENESS_BUDGET_MS ((LIVENESS_TIMEOUT_MS << LIVENESS_RETRIES) - LIVENESS_TIMEOUT_MS + \
+                            (LIVENESS_RETRIES + 1) * (EXPIRY_SWEEP_MS + DEVICE_WHEEL_TICK_MS))
+
+void scheduler_start(Environment *);
+void scheduler_add_interface(Environment *, InterfaceNode *);
+void scheduler_reset(Environment *, int);
+uint64_t scheduler_device_deadline(const Environment *, const DiscoveredDevice *, uint64_t);
+int scheduler_liveness_applies(const Environment *, const DiscoveredDevice *);
+uint64_t scheduler_liveness_retry(const DiscoveredDevice *, uint64_t);
+uint64_t scheduler_device_lifetime(const Environment *, const DiscoveredDevice *);
+
+#endif
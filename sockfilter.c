@@ -0,0 +1,158 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+/*
+ * Classic BPF filter on the sockets receiving port 60128, so that datagrams
+ * the proxy would discard do not wake it up. The kernel drops:
+ *  - our own broadcasts looping back, by source address;
+ *  - datagrams without the "ISCP" magic;
+ *  - messages that are not ECN ones, queries and responses alike.
+ * The rest is still validated in full by iscp_parse().
+ *
+ * The program is rebuilt from the interface addresses whenever an interface
+ * socket is opened or closed, which is how address changes show, and
+ * attached again to every socket: SO_ATTACH_FILTER swaps it atomically.
+ * What the filter dropped is read back from each socket with SO_MEMINFO.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+
+#include "types.h"
+#include "interface.h"
+#include "utilities.h"
+#include "sockfilter.h"
+
+typedef struct SocketFilter {
+    int *fds;              // Sockets the filter is attached to
+    size_t count;
+    size_t capacity;
+    uint64_t retiredDrops; // Dropped by sockets closed since
+} SocketFilter;
+
+#define MAGIC_ISCP 0x49534350 // "ISCP"
+#define COMMAND_ECN 0x45434E00 // "ECN" and whatever byte follows
+
+// Offsets from the UDP header, where the socket filter of a UDP socket starts
+#define AT_MAGIC (sizeof(struct udphdr))
+#define AT_HEADER_SIZE (sizeof(struct udphdr) + 4)
+#define AT_START (sizeof(struct udphdr))      // Of the message, from the header size in X
+#define AT_COMMAND (sizeof(struct udphdr) + 2)
+
+static SocketFilter* filter_get(Environment *pEnv) {
+    if (pEnv->socket_filter == NULL && (pEnv->socket_filter = calloc(1, sizeof(SocketFilter))) == NULL) {
+        perror("Failed to allocate memory for the socket filter");
+        exit(EXIT_FAILURE);
+    }
+    return pEnv->socket_filter;
+}
+
+// Returns the number of instructions written to code
+static size_t build_program(const Environment *pEnv, struct sock_filter *code) {
+    size_t n = 0, addresses = 0;
+
+    // Datagrams from one of our addresses are our own
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12);
+    for (InterfaceNode *current = pEnv->interfaces; current != NULL && addresses < SOCKFILTER_ADDRESSES_MAX; current = current->next) {
+        if (interfaceHasAddress(current)) {
+            code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(current->address.sin_addr.s_addr), 0, 1);
+            code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+            addresses++;
+        }
+    }
+
+    // Loads beyond the datagram end the program with a drop, no length check needed
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, AT_MAGIC);
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, MAGIC_ISCP, 0, 8);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, AT_HEADER_SIZE);
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, SOCKFILTER_HEADER_MAX, 6, 0);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TAX, 0);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_IND, AT_START);
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, '!', 0, 3);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_IND, AT_COMMAND);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xFFFFFF00);
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, COMMAND_ECN, 1, 0);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF);
+    return n;
+}
+
+static uint64_t socket_drops(int fd) {
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t length = sizeof(meminfo);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &length) < 0 || length <= SK_MEMINFO_DROPS * sizeof(uint32_t)) {
+        return 0;
+    }
+    return meminfo[SK_MEMINFO_DROPS];
+}
+
+// Build the program for the current addresses and attach it to every socket
+void sockfilter_update(Environment *pEnv) {
+    static struct sock_filter code[2 * SOCKFILTER_ADDRESSES_MAX + 16];
+    SocketFilter *filter = filter_get(pEnv);
+    struct sock_fprog prog = { .len = build_program(pEnv, code), .filter = code };
+
+    for (size_t i = 0; i < filter->count; i++) {
+        if (setsockopt(filter->fds[i], SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+            logger(pEnv, "setsockopt SO_ATTACH_FILTER failed, the socket receives everything", errno);
+        }
+    }
+}
+
+// Filter a socket bound to the discovery port from now on
+void sockfilter_attach(Environment *pEnv, int fd) {
+    SocketFilter *filter = filter_get(pEnv);
+
+    if (filter->count == filter->capacity) {
+        size_t capacity = filter->capacity ? filter->capacity * 2 : 8;
+        int *fds = realloc(filter->fds, capacity * sizeof(int));
+        if (fds == NULL) {
+            logger(pEnv, "Failed to allocate memory for the socket filter", errno);
+            return;
+        }
+        filter->fds = fds;
+        filter->capacity = capacity;
+    }
+    filter->fds[filter->count++] = fd;
+    sockfilter_update(pEnv);
+}
+
+// Forget a socket about to be closed, keeping its drop count
+void sockfilter_detach(Environment *pEnv, int fd) {
+    SocketFilter *filter = filter_get(pEnv);
+
+    for (size_t i = 0; i < filter->count; i++) {
+        if (filter->fds[i] == fd) {
+            filter->retiredDrops += socket_drops(fd);
+            filter->fds[i] = filter->fds[--filter->count];
+            sockfilter_update(pEnv);
+            return;
+        }
+    }
+}
+
+// Datagrams the kernel dropped before they reached us: filtered out, or
+// for lack of room in a receive queue
+uint64_t sockfilter_dropped(Environment *pEnv) {
+    SocketFilter *filter = pEnv->socket_filter;
+    uint64_t dropped;
+
+    if (filter == NULL) {
+        return 0;
+    }
+    dropped = filter->retiredDrops;
+    for (size_t i = 0; i < filter->count; i++) {
+        dropped += socket_drops(filter->fds[i]);
+    }
+    return dropped;
+}
@@ -0,0 +1,22 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#ifndef SOCKFILTER_H
+#define SOCKFILTER_H
+
+#include <stdint.h>
+
+#include "types.h"
+
+#define SOCKFILTER_ADDRESSES_MAX 1000 // Own addresses matched in the kernel, two instructions each
+#define SOCKFILTER_HEADER_MAX 64      // Largest eISCP header size let through
+
+void sockfilter_attach(Environment *, int);
+void sockfilter_detach(Environment *, int);
+void sockfilter_update(Environment *);
+uint64_t sockfilter_dropped(Environment *);
+
+#endif
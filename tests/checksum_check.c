@@ -0,0 +1,128 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+/*
+ * Checksums of forged replies, run by "make check": every implementation
+ * the CPU supports against the scalar reference, the UDP checksum against
+ * its pseudo-header, and the headers patched incrementally from a
+ * pre-built frame against the ones built from scratch.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "checksum.h"
+#include "rawpacket.h"
+
+#define MAX_LEN 2048
+
+static unsigned char data[MAX_LEN + 8];
+
+// Every length at every alignment must give the reference result
+static int check_impl(const ChecksumImpl *impl) {
+    for (size_t len = 0; len <= MAX_LEN; len++) {
+        for (size_t offset = 0; offset < 8; offset += 2) {
+            uint16_t expected = checksum_reference(data + offset, len);
+            uint16_t got = checksum_fold(impl->sum(data + offset, len));
+            if (got != expected) {
+                fprintf(stderr, "checksum-check: %s: length %zu offset %zu gives %04x instead of %04x\n", impl->name, len, offset, got, expected);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// A datagram carrying its UDP checksum must sum to zero with its pseudo-header
+static int check_udp() {
+    struct {
+        uint32_t saddr, daddr;
+        uint8_t zero, protocol;
+        uint16_t len;
+        struct udphdr udp;
+        unsigned char payload[128];
+    } pseudo; // No padding: every field falls on its natural alignment
+    struct iphdr iph;
+
+    for (size_t len = 0; len <= sizeof(pseudo.payload); len++) {
+        memset(&iph, 0, sizeof(iph));
+        iph.saddr = htonl(0x0A000002);
+        iph.daddr = htonl(0xC0A80105 + len);
+        pseudo.saddr = iph.saddr;
+        pseudo.daddr = iph.daddr;
+        pseudo.zero = 0;
+        pseudo.protocol = IPPROTO_UDP;
+        pseudo.len = htons(sizeof(struct udphdr) + len);
+        pseudo.udp.source = htons(60128);
+        pseudo.udp.dest = htons(40000 + len);
+        pseudo.udp.len = pseudo.len;
+        memcpy(pseudo.payload, data, len);
+
+        pseudo.udp.check = checksum_udp(&iph, &pseudo.udp, pseudo.payload, len);
+        if (checksum_reference(&pseudo, 20 + len) != 0) {
+            fprintf(stderr, "checksum-check: UDP checksum wrong for a %zu-byte payload\n", len);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Patching the destination into a pre-built frame must give the same
+// headers, checksums included, as building them for that destination
+static int check_frame() {
+    static RawBatch full, patched;
+    struct sockaddr_in src, dst;
+    RawHeader frame;
+
+    memset(&src, 0, sizeof(src));
+    src.sin_family = AF_INET;
+    src.sin_addr.s_addr = htonl(0x0A000001);
+    src.sin_port = htons(60128);
+    memset(&dst, 0, sizeof(dst));
+    dst.sin_family = AF_INET;
+
+    for (size_t len = 0; len <= 128; len++) {
+        raw_frame_build(&frame, &src, (const char *)data, len);
+        for (int requester = 0; requester < 4096; requester++) {
+            dst.sin_addr.s_addr = htonl(0xC0A80000 | (requester * 2654435761u >> 16));
+            dst.sin_port = htons(1024 + requester * 40503u % 64512);
+            raw_batch_init(&full, &dst, 0);
+            raw_batch_init(&patched, &dst, 0);
+            raw_batch_add(&full, &src, (const char *)data, len);
+            raw_batch_add_frame(&patched, &frame, (const char *)data, len);
+            if (memcmp(&full.headers[0], &patched.headers[0], sizeof(RawHeader)) != 0) {
+                fprintf(stderr, "checksum-check: patched headers differ for %s:%u and a %zu-byte payload (IP %04x/%04x, UDP %04x/%04x)\n",
+                        inet_ntoa(dst.sin_addr), ntohs(dst.sin_port), len,
+                        full.headers[0].ip.check, patched.headers[0].ip.check, full.headers[0].udp.check, patched.headers[0].udp.check);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+int main() {
+    size_t count;
+    const ChecksumImpl *impls = checksum_impls(&count);
+    int failures = 0;
+
+    srandom(1);
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = random();
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (impls[i].supported() && !check_impl(&impls[i])) {
+            failures++;
+        }
+    }
+    failures += !check_udp();
+    // With UDP checksums on, so that their incremental update is checked too
+    raw_enable_udp_checksum();
+    failures += !check_frame();
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,71 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+/*
+ * HMAC-SHA256 against the test cases of RFC 4231, run by "make check".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hmac.h"
+
+typedef struct {
+    const char *key;    // Repeated byte when keyLength is set
+    size_t keyLength;
+    const char *data;
+    size_t dataLength;
+    const char *mac;
+} HmacVector;
+
+static const HmacVector vectors[] = {
+    // Test case 1
+    { "\x0b", 20, "Hi There", 0,
+      "b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7" },
+    // Test case 2
+    { "Jefe", 0, "what do ya want for nothing?", 0,
+      "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843" },
+    // Test case 3
+    { "\xaa", 20, "\xdd", 50,
+      "773ea91e36800e46854db8ebd09181a72959098b3ef8c122d9635514ced565fe" },
+    // Test case 6, a key longer than a block
+    { "\xaa", 131, "Test Using Larger Than Block-Size Key - Hash Key First", 0,
+      "60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54" },
+};
+
+// Repeat the byte when a length is given, else take the string
+static size_t expand(char *out, const char *text, size_t length) {
+    if (length == 0) {
+        length = strlen(text);
+        memcpy(out, text, length);
+    } else {
+        memset(out, text[0], length);
+    }
+    return length;
+}
+
+int main() {
+    int failures = 0;
+
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        char key[256], data[256], hex[2 * SHA256_DIGEST_SIZE + 1];
+        size_t keyLength = expand(key, vectors[i].key, vectors[i].keyLength);
+        size_t dataLength = expand(data, vectors[i].data, vectors[i].dataLength);
+        unsigned char mac[SHA256_DIGEST_SIZE];
+        HmacKey hmacKey;
+
+        hmac_key_init(&hmacKey, key, keyLength);
+        hmac_sha256(&hmacKey, data, dataLength, mac);
+        for (int j = 0; j < SHA256_DIGEST_SIZE; j++) {
+            sprintf(hex + 2 * j, "%02x", mac[j]);
+        }
+        if (strcmp(hex, vectors[i].mac) != 0) {
+            fprintf(stderr, "hmac-vectors: vector %zu gives %s, expected %s\n", i + 1, hex, vectors[i].mac);
+            failures++;
+        }
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
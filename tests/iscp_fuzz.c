@@ -0,0 +1,247 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+/*
+ * Robustness of the eISCP parser, run by "make check".
+ *
+ * Well-formed datagrams with random fields must decode to exactly those
+ * fields. They are then mutated (bytes flipped or overwritten, header sizes
+ * forged, truncated, extended) and random bytes are thrown in: whatever the
+ * verdict, the parser must stay within the datagram, which is copied to a
+ * buffer of its exact size so that ASan or valgrind catch any overread, and
+ * whatever it accepts must satisfy the format.
+ *
+ * Usage: iscp-fuzz [rounds [seed]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "iscp.h"
+
+#define DEFAULT_ROUNDS 200000
+#define DATAGRAM_MAX 160
+
+static uint64_t state;
+
+// xorshift64*, reproducible from the seed
+static uint32_t next_random() {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return (state * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+static uint32_t random_below(uint32_t bound) {
+    return next_random() % bound;
+}
+
+static void random_string(char *out, size_t length, const char *alphabet) {
+    size_t size = strlen(alphabet);
+
+    for (size_t i = 0; i < length; i++) {
+        out[i] = alphabet[random_below(size)];
+    }
+    out[length] = '\0';
+}
+
+static void put32(char *at, uint32_t value) {
+    at[0] = value >> 24;
+    at[1] = value >> 16;
+    at[2] = value >> 8;
+    at[3] = value;
+}
+
+// A datagram as devices send it, returns its length
+static size_t build_datagram(char *out, const char *message) {
+    size_t length = strlen(message);
+
+    memcpy(out, "ISCP", 4);
+    put32(out + 4, ISCP_HEADER_SIZE);
+    put32(out + 8, length);
+    out[12] = ISCP_VERSION;
+    out[13] = out[14] = out[15] = 0;
+    memcpy(out + ISCP_HEADER_SIZE, message, length);
+    return ISCP_HEADER_SIZE + length;
+}
+
+// A response with random fields, expected holds what it must decode to
+static size_t random_response(char *out, EcnRecord *expected) {
+    static const char *terminators[] = { "\x19\r\n", "\x1a\r\n", "\x1a", "\r\n", "\n", "" };
+    char message[DATAGRAM_MAX - ISCP_HEADER_SIZE];
+
+    memset(expected, 0, sizeof(*expected));
+    do {
+        expected->unit = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"[random_below(62)];
+    } while (expected->unit == ISCP_UNIT_ANY);
+    random_string(expected->model, 1 + random_below(ISCP_MODEL_SIZE - 1),
+                  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_ .()");
+    expected->port = 1 + random_below(65535);
+    random_string(expected->region, 2, "DXJ");
+    random_string(expected->identifier, 1 + random_below(ISCP_IDENTIFIER_SIZE - 1), "0123456789ABCDEF");
+
+    snprintf(message, sizeof(message), "!%cECN%s/%u/%s/%s%s", expected->unit, expected->model, expected->port,
+             expected->region, expected->identifier, terminators[random_below(6)]);
+    return build_datagram(out, message);
+}
+
+static int fail(const char *what, const char *datagram, size_t length) {
+    fprintf(stderr, "iscp-fuzz: %s, datagram of %zu bytes:", what, length);
+    for (size_t i = 0; i < length; i++) {
+        fprintf(stderr, " %02x", (unsigned char)datagram[i]);
+    }
+    fprintf(stderr, "\n");
+    return 0;
+}
+
+static int field_valid(const char *field, size_t size, int (*valid)(int)) {
+    size_t length = strnlen(field, size);
+
+    if (length == 0 || length == size) {
+        return 0;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (!valid((unsigned char)field[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int is_model_char(int c) {
+    return c >= 0x20 && c <= 0x7E && c != '/';
+}
+
+static int is_alnum_char(int c) {
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+// Parse a private copy of the datagram and check whatever is accepted.
+// Returns 1 when consistent, and sets *decoded when it is a valid response.
+static int check_datagram(const char *datagram, size_t length, EcnRecord *record, int *decoded) {
+    char *copy = malloc(length ? length : 1);
+    IscpMessage message;
+    int ok = 1;
+
+    memcpy(copy, datagram, length);
+    *decoded = 0;
+
+    if (iscp_parse(copy, length, &message) == 0) {
+        const char *end = copy + length;
+
+        if (message.data < copy + ISCP_HEADER_SIZE || message.data + message.length > end ||
+            message.length < 5 || message.data[0] != '!' || message.unit != message.data[1] ||
+            message.command != message.data + 2 || message.parameter != message.data + 5 ||
+            message.parameter + message.parameterLength != message.data + message.length) {
+            ok = fail("message view outside of the datagram", datagram, length);
+        } else if (iscp_parse_ecn(&message, record) == 0) {
+            *decoded = 1;
+            if (record->port == 0 || record->unit != message.unit || iscp_category(record->unit) < 0 ||
+                !field_valid(record->model, sizeof(record->model), is_model_char) ||
+                !field_valid(record->region, sizeof(record->region), is_alnum_char) || strlen(record->region) != 2 ||
+                !field_valid(record->identifier, sizeof(record->identifier), is_alnum_char)) {
+                ok = fail("accepted a malformed response", datagram, length);
+            }
+        }
+    }
+
+    free(copy);
+    return ok;
+}
+
+// One random change to a datagram, its new length is returned
+static size_t mutate(char *datagram, size_t length) {
+    size_t at = length ? random_below(length) : 0;
+
+    switch (random_below(7)) {
+        case 0: // Flip a bit
+            if (length) {
+                datagram[at] ^= 1 << random_below(8);
+            }
+            break;
+        case 1: // Overwrite with a byte the format gives a meaning to
+            if (length) {
+                datagram[at] = "/!\x1a\x19\r\n\0x1ECN9"[random_below(13)];
+            }
+            break;
+        case 2: // Forge the header size
+            if (length >= 8) {
+                put32(datagram + 4, random_below(2) ? random_below(DATAGRAM_MAX) : next_random());
+            }
+            break;
+        case 3: // Forge the data size
+            if (length >= 12) {
+                put32(datagram + 8, random_below(2) ? random_below(DATAGRAM_MAX) : next_random());
+            }
+            break;
+        case 4: // Truncate
+            return at;
+        case 5: // Append random bytes
+            while (length < DATAGRAM_MAX && random_below(4)) {
+                datagram[length++] = next_random();
+            }
+            break;
+        case 6: // Garbage
+            length = random_below(DATAGRAM_MAX);
+            for (size_t i = 0; i < length; i++) {
+                datagram[i] = next_random();
+            }
+            if (length >= 4 && random_below(2)) {
+                memcpy(datagram, "ISCP", 4);
+            }
+            break;
+    }
+    return length;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long rounds = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_ROUNDS;
+    uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 0) : 0x1CEB00DA;
+    unsigned long accepted = 0, rejected = 0;
+    char datagram[DATAGRAM_MAX];
+    EcnRecord expected, record;
+    size_t length;
+    int decoded;
+
+    state = seed ? seed : 1;
+
+    for (unsigned long round = 0; round < rounds; round++) {
+        // The well-formed response must decode to what was put in
+        length = random_response(datagram, &expected);
+        if (!check_datagram(datagram, length, &record, &decoded)) {
+            return EXIT_FAILURE;
+        }
+        if (!decoded || memcmp(&record, &expected, sizeof(record)) != 0) {
+            fail("well-formed response not decoded as built", datagram, length);
+            return EXIT_FAILURE;
+        }
+
+        // Then a few rounds of damage
+        for (int mutations = 1 + random_below(4); mutations > 0; mutations--) {
+            length = mutate(datagram, length);
+        }
+        if (!check_datagram(datagram, length, &record, &decoded)) {
+            return EXIT_FAILURE;
+        }
+        if (decoded) {
+            accepted++;
+        } else {
+            rejected++;
+        }
+    }
+
+    // The query, and a query is not a response
+    length = build_datagram(datagram, "!xECNQSTN\n");
+    if (!check_datagram(datagram, length, &record, &decoded) || decoded) {
+        fail("query decoded as a response", datagram, length);
+        return EXIT_FAILURE;
+    }
+
+    printf("iscp-fuzz: %lu rounds (seed 0x%llx), %lu mutated datagrams still decoded, %lu rejected\n",
+           rounds, (unsigned long long)seed, accepted, rejected);
+    return EXIT_SUCCESS;
+}
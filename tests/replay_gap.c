@@ -0,0 +1,105 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+/*
+ * Replay of a capture with a long silence, run by "make check".
+ *
+ * A device answers at the start of the capture, a controller asks right
+ * after and must get its reply, another one asks an hour later and must
+ * not: the device expired meanwhile. Devices have to expire on the clock
+ * of the capture, whatever the uptime of the machine running the replay,
+ * so the timestamps are kept small.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+
+#include "types.h"
+#include "cmdline.h"
+#include "replay.h"
+
+#define CAPTURE_INPUT "replay-gap-in.pcap"
+#define CAPTURE_OUTPUT "replay-gap-out.pcap"
+#define GAP_SECONDS 3600
+
+static void write_frame(FILE *capture, uint32_t seconds, const char *source, const char *message) {
+    size_t messageLength = strlen(message);
+    size_t length = sizeof(struct iphdr) + sizeof(struct udphdr) + 16 + messageLength;
+    unsigned char frame[256];
+    struct iphdr *ip = (struct iphdr *)frame;
+    struct udphdr *udp = (struct udphdr *)(frame + sizeof(struct iphdr));
+    unsigned char *iscp = frame + sizeof(struct iphdr) + sizeof(struct udphdr);
+    uint32_t record[4] = { seconds, 0, length, length };
+
+    memset(frame, 0, sizeof(frame));
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->tot_len = htons(length);
+    ip->saddr = inet_addr(source);
+    ip->daddr = INADDR_BROADCAST;
+    udp->source = htons(PORT);
+    udp->dest = htons(PORT);
+    udp->len = htons(length - sizeof(struct iphdr));
+    memcpy(iscp, "ISCP\0\0\0\x10", 8);
+    iscp[11] = messageLength;
+    iscp[12] = 1;
+    memcpy(iscp + 16, message, messageLength);
+
+    fwrite(record, sizeof(record), 1, capture);
+    fwrite(frame, length, 1, capture);
+}
+
+// Records of a classic pcap file, -1 if it cannot be read
+static int count_records(const char *path) {
+    FILE *capture = fopen(path, "rb");
+    uint32_t record[4];
+    int count = 0;
+
+    if (capture == NULL || fseek(capture, 24, SEEK_SET) != 0) {
+        return -1;
+    }
+    while (fread(record, sizeof(record), 1, capture) == 1 && fseek(capture, record[2], SEEK_CUR) == 0) {
+        count++;
+    }
+    fclose(capture);
+    return count;
+}
+
+int main() {
+    static const uint32_t header[6] = { 0xA1B2C3D4, 0x00040002, 0, 0, 65535, 101 };
+    char *argv[] = { "replay-gap", "-c", "none", "-r", CAPTURE_INPUT, "-o", CAPTURE_OUTPUT, NULL };
+    Environment env;
+    FILE *capture;
+    int replies;
+
+    if ((capture = fopen(CAPTURE_INPUT, "wb")) == NULL) {
+        perror(CAPTURE_INPUT);
+        return EXIT_FAILURE;
+    }
+    fwrite(header, sizeof(header), 1, capture);
+    write_frame(capture, 1, "192.0.2.10", "!1ECNTX-NR686/60128/DX/0009B0123456\x19\r\n");
+    write_frame(capture, 2, "192.0.2.20", "!xECNQSTN\n");
+    write_frame(capture, 2 + GAP_SECONDS, "192.0.2.30", "!xECNQSTN\n");
+    fclose(capture);
+
+    handle_command_line(sizeof(argv) / sizeof(argv[0]) - 1, argv, &env);
+    replay_run(&env);
+
+    replies = count_records(CAPTURE_OUTPUT);
+    remove(CAPTURE_INPUT);
+    remove(CAPTURE_OUTPUT);
+    if (replies != 1) {
+        fprintf(stderr, "replay-gap: %d replies, expected 1: the device must have expired during the gap\n", replies);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
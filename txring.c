@@ -0,0 +1,219 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <linux/if_packet.h>
+
+#include "eventloop.h"
+#include "rawpacket.h"
+#include "txring.h"
+
+/*
+ * Forged replies written straight into a PACKET_TX_RING as Ethernet frames,
+ * bypassing the IP stack. A whole burst is handed to the kernel with one
+ * send(). Queries are broadcasts, so requesters are on the link of the
+ * interface they asked on: their MAC address is looked up in the ARP
+ * cache. When it is not there, the caller falls back to the raw socket,
+ * which makes the kernel resolve it for the next time.
+ */
+
+// Open the transmit ring of an interface, NULL if AF_PACKET is not usable
+TxRing* tx_ring_open(int ifindex) {
+    struct tpacket_req req;
+    struct sockaddr_ll addr;
+    struct ifreq ifr;
+    int version = TPACKET_V2;
+    TxRing *ring = calloc(1, sizeof(TxRing));
+
+    if (!ring) {
+        perror("Failed to allocate memory for transmit ring");
+        return NULL;
+    }
+    ring->ifindex = ifindex;
+
+    // Protocol 0: this socket only transmits
+    if ((ring->fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0) {
+        perror("packet socket creation failed");
+        free(ring);
+        return NULL;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    if (!if_indextoname(ifindex, ifr.ifr_name) || ioctl(ring->fd, SIOCGIFHWADDR, &ifr) < 0) {
+        perror("SIOCGIFHWADDR failed");
+        goto fail;
+    }
+    memcpy(ring->mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = 4 * TX_RING_FRAME_SIZE;
+    req.tp_frame_size = TX_RING_FRAME_SIZE;
+    req.tp_frame_nr = TX_RING_FRAMES;
+    req.tp_block_nr = TX_RING_FRAMES / 4;
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+        setsockopt(ring->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+        perror("setsockopt PACKET_TX_RING failed");
+        goto fail;
+    }
+
+    ring->mapSize = (size_t)req.tp_block_size * req.tp_block_nr;
+    ring->map = mmap(NULL, ring->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+    if (ring->map == MAP_FAILED) {
+        perror("mmap of the transmit ring failed");
+        goto fail;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_IP);
+    addr.sll_ifindex = ifindex;
+    if (bind(ring->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind of the packet socket failed");
+        munmap(ring->map, ring->mapSize);
+        goto fail;
+    }
+
+    return ring;
+
+fail:
+    close(ring->fd);
+    free(ring);
+    return NULL;
+}
+
+void tx_ring_close(TxRing *ring) {
+    if (ring->fd >= 0) {
+        munmap(ring->map, ring->mapSize);
+        close(ring->fd);
+    }
+    free(ring);
+}
+
+// Find the MAC address of an on-link neighbour in the ARP cache
+static int resolve_neighbour(TxRing *ring, in_addr_t addr, unsigned char *mac) {
+    struct arpreq req;
+    struct sockaddr_in *pa = (struct sockaddr_in *)&req.arp_pa;
+    uint64_t now = monotonic_ms();
+
+    if (ring->neighAddr == addr && now < ring->neighExpires) {
+        memcpy(mac, ring->neighMac, ETH_ALEN);
+        return 0;
+    }
+
+    memset(&req, 0, sizeof(req));
+    pa->sin_family = AF_INET;
+    pa->sin_addr.s_addr = addr;
+    if (!if_indextoname(ring->ifindex, req.arp_dev) ||
+        ioctl(ring->fd, SIOCGARP, &req) < 0 || !(req.arp_flags & ATF_COM)) {
+        return -1;
+    }
+
+    memcpy(mac, req.arp_ha.sa_data, ETH_ALEN);
+    memcpy(ring->neighMac, mac, ETH_ALEN);
+    ring->neighAddr = addr;
+    ring->neighExpires = now + TX_RING_NEIGH_TTL_MS;
+    return 0;
+}
+
+// The kick failed: the kernel stopped at the first frame still waiting, in
+// TP_STATUS_SEND_REQUEST, or TP_STATUS_WRONG_FORMAT if it rejected it. That
+// frame and the ones queued after it were not sent: they are handed back,
+// and the next burst starts there again, where the kernel will look.
+static int tx_ring_reclaim(TxRing *ring, RawBatch *batch, const int *frames, int error) {
+    int failures = 0;
+    int stopped = 0;
+
+    for (unsigned int i = 0; i < batch->count; i++) {
+        struct tpacket2_hdr *hdr;
+
+        if (frames[i] < 0) {
+            failures++;
+            continue;
+        }
+        hdr = (struct tpacket2_hdr *)(ring->map + (size_t)frames[i] * TX_RING_FRAME_SIZE);
+        if (!stopped) {
+            unsigned int status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+            if (status != TP_STATUS_SEND_REQUEST && status != TP_STATUS_WRONG_FORMAT) {
+                continue;
+            }
+            stopped = 1;
+            ring->head = frames[i];
+        }
+        __atomic_store_n(&hdr->tp_status, TP_STATUS_AVAILABLE, __ATOMIC_RELEASE);
+        batch->errors[i] = error;
+        failures++;
+    }
+    return failures;
+}
+
+// Send a burst as Ethernet frames. Returns the number of datagrams that
+// could not be sent, with their errno in batch->errors, or -1 when the
+// requester's MAC address is unknown and nothing was sent.
+int tx_ring_send(TxRing *ring, RawBatch *batch) {
+    unsigned char dstMac[ETH_ALEN];
+    int frames[RAW_BATCH_SIZE]; // Frame of each datagram, -1 when not queued
+    int failures = 0;
+    int queued = 0;
+
+    if (resolve_neighbour(ring, batch->dst.sin_addr.s_addr, dstMac) < 0) {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < batch->count; i++) {
+        struct tpacket2_hdr *hdr = (struct tpacket2_hdr *)(ring->map + (size_t)ring->head * TX_RING_FRAME_SIZE);
+        struct ether_header *eth = (struct ether_header *)((char *)hdr + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll));
+        char *data = (char *)(eth + 1);
+        struct iovec *iov = batch->iov[i];
+        size_t len = sizeof(*eth) + iov[0].iov_len + iov[1].iov_len;
+        unsigned int status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+
+        // A frame the kernel once rejected is ours again
+        if (status == TP_STATUS_WRONG_FORMAT) {
+            status = TP_STATUS_AVAILABLE;
+        }
+        frames[i] = -1;
+        if (status != TP_STATUS_AVAILABLE || (char *)eth + len > (char *)hdr + TX_RING_FRAME_SIZE) {
+            batch->errors[i] = status != TP_STATUS_AVAILABLE ? ENOBUFS : EMSGSIZE;
+            failures++;
+            continue;
+        }
+
+        memcpy(eth->ether_dhost, dstMac, ETH_ALEN);
+        memcpy(eth->ether_shost, ring->mac, ETH_ALEN);
+        eth->ether_type = htons(ETHERTYPE_IP);
+        memcpy(data, iov[0].iov_base, iov[0].iov_len);
+        memcpy(data + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+
+        hdr->tp_len = len;
+        __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+        frames[i] = ring->head;
+        batch->errors[i] = 0;
+        ring->head = (ring->head + 1) % TX_RING_FRAMES;
+        queued++;
+    }
+
+    // One kick for the whole burst, it returns once the frames are sent
+    if (queued > 0) {
+        while (send(ring->fd, NULL, 0, 0) < 0) {
+            if (errno != EINTR) {
+                return tx_ring_reclaim(ring, batch, frames, errno);
+            }
+        }
+    }
+
+    return failures;
+}
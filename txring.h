@@ -0,0 +1,46 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#ifndef TXRING_H
+#define TXRING_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <net/ethernet.h>
+
+#include "rawpacket.h"
+
+#define TX_RING_FRAME_SIZE 2048 // Room for one Ethernet frame of a forged reply
+#define TX_RING_FRAMES (2 * RAW_BATCH_SIZE)
+#define TX_RING_NEIGH_TTL_MS 10000 // How long a resolved next hop is trusted
+#define TX_RING_RETRY_MS 60000 // How long an interface whose ring failed to open uses the raw socket
+
+typedef enum {
+    TX_BACKEND_RAW,  // SOCK_RAW with IP_HDRINCL, through the IP stack
+    TX_BACKEND_RING, // AF_PACKET PACKET_TX_RING, complete Ethernet frames
+    TX_BACKEND_CAPTURE // Written to the output capture of a replay
+} TxBackend;
+
+// Transmit ring of one interface, owned by a single thread
+typedef struct TxRing {
+    int fd; // -1 while the ring cannot be opened on the interface
+    uint64_t retryAt; // When to try opening it again, monotonic ms
+    int ifindex;
+    char *map;
+    size_t mapSize;
+    unsigned int head; // Next frame to fill
+    unsigned char mac[ETH_ALEN]; // Our address on the interface
+    in_addr_t neighAddr; // Last next hop resolved, with its address
+    unsigned char neighMac[ETH_ALEN];
+    uint64_t neighExpires;
+    struct TxRing *next;
+} TxRing;
+
+TxRing* tx_ring_open(int);
+void tx_ring_close(TxRing *);
+int tx_ring_send(TxRing *, RawBatch *);
+
+#endif
@@ -7,31 +7,116 @@
 #ifndef TYPES_H
 #define TYPES_H
 
+#include <stdint.h>
+#include <time.h>
 #include <netinet/in.h>
 
+#include "eventloop.h"
+#include "rawpacket.h"
+#include "iscp.h"
+
 #define PORT 60128
 #define BUFFER_SIZE 65507
 
+typedef enum {
+    PACKET_IGNORED,  // Our own, not ISCP or not discovery related
+    PACKET_QUERY,    // !xECNQSTN discovery broadcast, or for one unit type
+    PACKET_RESPONSE  // !1ECN discovery response, or of another unit type
+} PacketType;
+
 typedef struct InterfaceNode {
     char* name;
 	char* ipAddress; // IP address of the interface (as text)
 	struct sockaddr_in address; // Ip address of the interface (as system structure)
+    int ifindex; // 0 while the link does not exist
+    int linkUp; // Carrier state last reported by netlink
+    EventSource socket; // Broadcast socket bound to the interface address, fd -1 when closed
+    EventSource probeTimer; // Fires when the next discovery probe is due
+    struct timespec probeDeadline;
+    long probeInterval; // Current probing interval (ms), see scheduler.c
+    int probeChanged; // Devices appeared or disappeared since the last probe
+    uint64_t sendErrors; // Failed probes, for the metrics
+    uint64_t relayedAt; // Monotonic time (ms) a query was last relayed onto it, see relay.c
     struct InterfaceNode* next;
 } InterfaceNode;
 
+#define DEVICE_WHEEL_SLOTS 256   // Buckets of the expiry timing wheel
+#define DEVICE_WHEEL_TICK_MS 250 // Time covered by one bucket
+
 typedef struct DiscoveredDevice {
     struct sockaddr_in source; // Source IP and port
     char* payload; // Dynamically allocated to store the payload
 	size_t payloadSize;         // Size of the payload
+    EcnRecord ecn; // Decoded payload, the identifier tells the device apart
+    RawHeader frame; // Pre-built IP/UDP headers of our forged replies, destination left blank
     time_t timestamp; // Time when the packet was received
-    struct DiscoveredDevice* next; // Pointer to the next element in the list
+    int ifindex; // Interface the device answers on, 0 if unknown
+    uint64_t lastSeen; // Monotonic time (ms) of the last response
+    uint32_t cadence; // Smoothed interval (ms) between responses, 0 until seen twice
+    uint64_t expires; // Monotonic deadline (ms) of its next liveness check, or after which it is stale
+    int livenessProbes; // Unicast probes sent since it was last heard from
+    uint32_t cacheSlot; // Slot in the device cache plus one, 0 when not cached
+    int provisional; // Loaded from the cache, not heard from since
+    int peer; // Federation peer the device was learned from plus one, 0 when heard here
+    uint32_t snapshot; // Last snapshot of that peer listing the device
+    uint64_t advertised; // Expiry last announced to the federation peers
+    struct DiscoveredDevice* next; // Next element in iteration order
+    struct DiscoveredDevice* prev;
+    struct DiscoveredDevice* categoryNext; // Neighbours among the devices of the same unit type
+    struct DiscoveredDevice* categoryPrev;
+    struct DiscoveredDevice* wheelNext; // Neighbours in the timing wheel bucket
+    struct DiscoveredDevice* wheelPrev;
+    struct DiscoveredDevice** wheelBucket;
 } DiscoveredDevice;
 
+// Devices indexed by (address, port), see device_table.c
+typedef struct {
+    DiscoveredDevice** slots; // Open-addressing hash table, capacity is a power of two
+    DiscoveredDevice** identities; // Same, by identifier, for the devices that have one
+    size_t capacity;
+    size_t count;
+    DiscoveredDevice* head; // Iteration list, newest first
+    DiscoveredDevice* categories[ISCP_CATEGORIES]; // Same, one list per unit type
+    size_t categoryCounts[ISCP_CATEGORIES];
+    DiscoveredDevice* wheel[DEVICE_WHEEL_SLOTS];
+    uint64_t wheelTick; // Last tick the wheel was advanced to
+    uint64_t generation; // Bumped whenever a device is added or removed
+} DeviceTable;
+
 typedef struct {
-	DiscoveredDevice* devices;
+	DeviceTable devices;
 	InterfaceNode* interfaces;
+    int raw_sockfd; // Raw socket shared by all forged replies
+    int tx_backend; // TxBackend used for forged replies
+    struct TxRing* tx_rings; // Transmit rings of this thread, opened on first use
+    struct RxRing* rx_ring; // Receive slots shared by all sockets
+    struct RequesterTable* requesters; // Per-requester reply budgets
+    struct MetricBlock* metrics; // Counters of this thread
+    struct LatencyHistogram* latency; // Query-to-reply latencies seen by this thread
+    EventLoop* loop;
+    struct Workers* workers; // Receive workers, NULL when running single-threaded
+    struct Worker* worker; // Set in the environment of a worker thread
     int debugging_enabled;
-    int timeout_interval;
+    int foreground; // Not daemonized, without the debug output of -d
+    int timeout_interval; // Interval between liveness checks of a device, in seconds
+    int worker_count;
+    int coalesce_window; // Milliseconds during which repeated queries share one reply
+    const char* metrics_endpoint; // Where to serve the metrics, NULL when disabled
+    const char* replay_input; // Capture to replay instead of listening, NULL when live
+    const char* replay_output; // Capture receiving the replies of a replay, may be NULL
+    struct Replay* replay; // State of the replay in progress
+    const char* cache_path; // Device cache file, NULL when disabled
+    struct DeviceCache* cache; // Device cache, NULL when disabled or unavailable
+    char** interface_patterns; // -i names with wildcards, matched as interfaces appear
+    int interface_pattern_count;
+    struct LinkWatch* linkwatch; // Netlink subscription keeping the interfaces up to date
+    const char* federation_endpoint; // Where to exchange devices with peers, NULL when disabled
+    const char* federation_peers; // Comma-separated address:port of the peers
+    const char* federation_key; // File holding the key that authenticates the peers, NULL for none
+    struct Federation* federation; // Device sharing with peers, NULL when disabled
+    struct SocketFilter* socket_filter; // Kernel filter of the discovery sockets, NULL until one is opened
+    int relay_enabled; // Relay queries onto the interfaces still being discovered
+    struct Relay* relay; // Requesters waiting for relayed responses, NULL when disabled
 } Environment;
 
 #endif
@@ -157,15 +157,15 @@ void daemonize() {
 }
 
 void logger(const Environment *env,const char *msg, int errnum) {
-	if (env->debugging_enabled) {
-		// If debugging is enabled, print to stderr
+	if (env->debugging_enabled || env->foreground) {
+		// In the foreground, print to stderr
 		if (errnum) {
 			perror(msg);
 		} else {
 			fprintf(stderr, "%s\n", msg);
 		}
 	} else {
-		// If debugging is not enables, we are daemonized --> log to syslog
+		// Otherwise we are daemonized --> log to syslog
 		if (errnum) {
 			syslog(LOG_ERR, "%s: %s", msg, strerror(errnum));
 		} else {
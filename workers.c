@@ -0,0 +1,373 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+#include "types.h"
+#include "utilities.h"
+#include "interface.h"
+#include "rawpacket.h"
+#include "rxring.h"
+#include "device_table.h"
+#include "packet_processing.h"
+#include "requesters.h"
+#include "metrics.h"
+#include "latency.h"
+#include "sockfilter.h"
+#include "relay.h"
+#include "workers.h"
+
+/*
+ * In worker mode, each worker thread owns a SO_REUSEPORT listener, its own
+ * event loop, receive ring and raw socket, and answers queries by itself.
+ * The main thread is the single writer of the device table: workers hand
+ * the responses they receive over through a queue, and the writer
+ * publishes an immutable snapshot of the table after every change.
+ *
+ * The kernel spreads unicast datagrams over the reuseport group, steered
+ * by CPU when attach_cpu_steering() could be used. Broadcasts, which is
+ * what nearly all discovery traffic is, are copied to every listener
+ * instead: each worker wakes up for each of them, and all but the one
+ * chosen by worker_owns_datagram() drop their copy.
+ *
+ * Workers read the snapshot without locking. Before loading it, a worker
+ * announces the current global epoch; a replaced snapshot is retired at
+ * the epoch it was replaced at, and freed once every worker is either
+ * idle or announced a later epoch.
+ */
+
+static DeviceSnapshot* snapshot_build(const DeviceTable *table) {
+    DeviceSnapshot *snap = malloc(sizeof(DeviceSnapshot) + table->count * sizeof(DiscoveredDevice *));
+    if (!snap) {
+        perror("Failed to allocate memory for device snapshot");
+        exit(EXIT_FAILURE);
+    }
+
+    snap->epoch = 0;
+    snap->retired = NULL;
+    snap->next = NULL;
+    snap->count = 0;
+    // Grouped by unit type, so that a query for one is answered from a slice
+    for (int category = 0; category < ISCP_CATEGORIES; category++) {
+        snap->categories[category] = snap->count;
+        for (DiscoveredDevice *current = table->categories[category]; current != NULL; current = current->categoryNext) {
+            snap->devices[snap->count++] = current;
+        }
+    }
+    snap->categories[ISCP_CATEGORIES] = snap->count;
+    for (DiscoveredDevice *current = table->head; current != NULL; current = current->next) {
+        if (iscp_category(current->ecn.unit) < 0) {
+            snap->devices[snap->count++] = current;
+        }
+    }
+    return snap;
+}
+
+static void snapshot_free(DeviceSnapshot *snap) {
+    DiscoveredDevice *current = snap->retired;
+
+    while (current != NULL) {
+        DiscoveredDevice *to_delete = current;
+        current = current->next;
+        device_free(to_delete);
+    }
+    free(snap);
+}
+
+// Free the retired snapshots that no worker can still be reading
+static void workers_reclaim(Workers *shared) {
+    uint64_t oldest = UINT64_MAX;
+    DeviceSnapshot **link = &shared->retired;
+
+    for (int i = 0; i < shared->count; i++) {
+        uint64_t epoch = atomic_load(&shared->workers[i].epoch);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    while (*link != NULL) {
+        DeviceSnapshot *snap = *link;
+        if (snap->epoch < oldest) {
+            *link = snap->next;
+            snapshot_free(snap);
+        } else {
+            link = &snap->next;
+        }
+    }
+}
+
+// Publish the device table to the workers if it changed since the last call
+void workers_publish(Environment *pEnv) {
+    Workers *shared = pEnv->workers;
+    DeviceSnapshot *old;
+
+    if (shared == NULL) {
+        return;
+    }
+    if (shared->generation == pEnv->devices.generation) {
+        workers_reclaim(shared);
+        return;
+    }
+
+    old = atomic_exchange(&shared->snapshot, snapshot_build(&pEnv->devices));
+    shared->generation = pEnv->devices.generation;
+
+    // The expired devices are only referenced by the old snapshot now
+    old->retired = shared->expired;
+    shared->expired = NULL;
+    old->epoch = atomic_fetch_add(&shared->epoch, 1);
+    old->next = shared->retired;
+    shared->retired = old;
+
+    workers_reclaim(shared);
+}
+
+// Dispose of a device removed from the table, workers may still be sending it
+void workers_release_device(Environment *pEnv, DiscoveredDevice *device) {
+    if (pEnv->workers == NULL) {
+        device_free(device);
+        return;
+    }
+    device->next = pEnv->workers->expired;
+    pEnv->workers->expired = device;
+}
+
+DeviceSnapshot* worker_snapshot_enter(Worker *worker) {
+    Workers *shared = worker->env.workers;
+
+    atomic_store(&worker->epoch, atomic_load(&shared->epoch));
+    return atomic_load(&shared->snapshot);
+}
+
+void worker_snapshot_exit(Worker *worker) {
+    atomic_store_explicit(&worker->epoch, 0, memory_order_release);
+}
+
+// The devices of the snapshot with the unit type, or all of them for 'x'
+DiscoveredDevice** worker_snapshot_devices(DeviceSnapshot *snap, char unit, size_t *count) {
+    int category = iscp_category(unit);
+
+    if (category < 0) {
+        *count = snap->count;
+        return snap->devices;
+    }
+    *count = snap->categories[category + 1] - snap->categories[category];
+    return snap->devices + snap->categories[category];
+}
+
+// Every worker of the reuseport group gets a copy of each broadcast, only
+// one of them, chosen from the source, handles it. Unicast datagrams are
+// delivered to a single worker already.
+int worker_owns_datagram(Worker *worker, const RxSlot *slot) {
+    uint32_t hash;
+
+    for (InterfaceNode *current = interfaceListHead(&worker->env.interfaces); current != NULL; current = interfaceListNext(current)) {
+        if (interfaceAddress(current) == slot->destination.s_addr) {
+            return 1;
+        }
+    }
+
+    hash = (slot->source.sin_addr.s_addr ^ slot->source.sin_port) * 0x9E3779B1u;
+    return (hash >> 16) % worker->env.workers->count == (uint32_t)worker->index;
+}
+
+// Count a datagram that could not be handed over, logging one per WORKER_DROP_LOG_MS
+static void worker_forward_dropped(Worker *worker, MetricId reason, const char *msg) {
+    uint64_t now = monotonic_ms();
+
+    metric_add(worker->env.metrics, reason, 1);
+    if (worker->dropLogged == 0 || now - worker->dropLogged >= WORKER_DROP_LOG_MS) {
+        worker->dropLogged = now;
+        logger(&worker->env, msg, 0);
+    }
+}
+
+// Next free entry of the writer queue, NULL if it is full
+static ForwardedResponse* worker_queue_entry(Worker *worker) {
+    unsigned int tail = atomic_load_explicit(&worker->queueTail, memory_order_relaxed);
+
+    if (tail - atomic_load_explicit(&worker->queueHead, memory_order_acquire) >= WORKER_QUEUE_SIZE) {
+        return NULL;
+    }
+    return &worker->queue[tail % WORKER_QUEUE_SIZE];
+}
+
+// Publish the entry filled in and wake the writer up
+static void worker_queue_push(Worker *worker) {
+    unsigned int tail = atomic_load_explicit(&worker->queueTail, memory_order_relaxed);
+
+    atomic_store_explicit(&worker->queueTail, tail + 1, memory_order_release);
+    eventfd_write(worker->env.workers->notify.fd, 1);
+}
+
+// Hand a discovery response over to the writer, dropped if the queue is full
+void worker_forward_response(Worker *worker, const struct sockaddr_in *source, int ifindex, const char *payload, ssize_t length, const EcnRecord *ecn) {
+    ForwardedResponse *entry;
+
+    if (length > RX_SLOT_SIZE) {
+        worker_forward_dropped(worker, METRIC_FORWARD_OVERSIZE, "Discovery response dropped, too large for the writer queue");
+        return;
+    }
+    if ((entry = worker_queue_entry(worker)) == NULL) {
+        worker_forward_dropped(worker, METRIC_FORWARD_QUEUE_FULL, "Discovery response dropped, writer queue full");
+        return;
+    }
+
+    entry->type = PACKET_RESPONSE;
+    memcpy(&entry->source, source, sizeof(entry->source));
+    entry->ifindex = ifindex;
+    entry->ecn = *ecn;
+    memcpy(entry->data, payload, length);
+    entry->length = length;
+    worker_queue_push(worker);
+}
+
+// Hand an answered query over to the writer, which relays it onto the segments still being discovered
+void worker_forward_query(Worker *worker, const struct sockaddr_in *source, int ifindex, char unit) {
+    ForwardedResponse *entry;
+
+    if ((entry = worker_queue_entry(worker)) == NULL) {
+        worker_forward_dropped(worker, METRIC_FORWARD_QUEUE_FULL, "Discovery query not relayed, writer queue full");
+        return;
+    }
+
+    entry->type = PACKET_QUERY;
+    memcpy(&entry->source, source, sizeof(entry->source));
+    entry->ifindex = ifindex;
+    entry->ecn.unit = unit;
+    entry->length = 0;
+    worker_queue_push(worker);
+}
+
+// Writer side: learn the responses queued by every worker
+static void handle_worker_notify(EventSource *source, uint32_t events) {
+    Environment *pEnv = source->ctx;
+    Workers *shared = pEnv->workers;
+    eventfd_t value;
+
+    eventfd_read(source->fd, &value);
+
+    for (int i = 0; i < shared->count; i++) {
+        Worker *worker = &shared->workers[i];
+        unsigned int head = atomic_load_explicit(&worker->queueHead, memory_order_relaxed);
+        unsigned int tail = atomic_load_explicit(&worker->queueTail, memory_order_acquire);
+
+        for (; head != tail; head++) {
+            ForwardedResponse *entry = &worker->queue[head % WORKER_QUEUE_SIZE];
+            if (entry->type == PACKET_QUERY) {
+                relay_query(pEnv, &entry->source, entry->ifindex, entry->ecn.unit);
+            } else {
+                handle_discovery_response(&entry->source, entry->ifindex, pEnv, entry->data, entry->length, &entry->ecn);
+            }
+        }
+        atomic_store_explicit(&worker->queueHead, head, memory_order_release);
+    }
+
+    workers_publish(pEnv);
+}
+
+// Steer each unicast datagram to the listener of the CPU that received it,
+// broadcasts still reach every listener
+static void attach_cpu_steering(int sockfd, int count) {
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        perror("setsockopt SO_ATTACH_REUSEPORT_CBPF failed, using the default reuseport hash");
+    }
+}
+
+static void* worker_main(void *arg) {
+    Worker *worker = arg;
+
+    event_loop_run(worker->env.loop);
+    return NULL;
+}
+
+// Start count receive workers, each with its own listener in the reuseport group
+void workers_start(Environment *pEnv, int count) {
+    Workers *shared = calloc(1, sizeof(Workers));
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (!shared || !(shared->workers = calloc(count, sizeof(Worker)))) {
+        perror("Failed to allocate memory for workers");
+        exit(EXIT_FAILURE);
+    }
+
+    shared->count = count;
+    shared->writer = pEnv;
+    atomic_init(&shared->epoch, 1); // 0 marks an idle worker
+    shared->generation = pEnv->devices.generation;
+    atomic_init(&shared->snapshot, snapshot_build(&pEnv->devices));
+    pEnv->workers = shared;
+
+    shared->notify.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    shared->notify.handler = handle_worker_notify;
+    shared->notify.ctx = pEnv;
+    if (shared->notify.fd < 0 || event_loop_add(pEnv->loop, &shared->notify, EPOLLIN) < 0) {
+        perror("Failed to set up worker notifications");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < count; i++) {
+        Worker *worker = &shared->workers[i];
+
+        worker->index = i;
+        memcpy(&worker->env, pEnv, sizeof(Environment));
+        worker->env.worker = worker;
+        worker->env.loop = event_loop_create();
+        worker->env.rx_ring = rx_ring_create();
+        worker->env.raw_sockfd = setup_raw_sender();
+        worker->env.requesters = requester_table_create();
+        worker->env.tx_rings = NULL;
+        worker->env.metrics = metrics_create();
+        worker->env.latency = latency_create();
+
+        // Sockets join the reuseport group in worker order, as the steering program expects
+        worker->listener.fd = setup_listener();
+        sockfilter_attach(pEnv, worker->listener.fd);
+        worker->listener.handler = handle_socket_event;
+        worker->listener.ctx = &worker->env;
+        if (i == 0 && count <= cpus) {
+            attach_cpu_steering(worker->listener.fd, count);
+        }
+        if (event_loop_add(worker->env.loop, &worker->listener, EPOLLIN) < 0) {
+            perror("epoll_ctl failed");
+            exit(EXIT_FAILURE);
+        }
+
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            perror("Failed to start worker thread");
+            exit(EXIT_FAILURE);
+        }
+
+        // Pin the worker to the CPU whose datagrams it is steered
+        if (cpus > 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(i % cpus, &set);
+            if (pthread_setaffinity_np(worker->thread, sizeof(set), &set) != 0 && pEnv->debugging_enabled) {
+                fprintf(stderr, "Could not pin worker %d to CPU %ld\n", i, i % cpus);
+            }
+        }
+    }
+}
@@ -0,0 +1,78 @@
+/*
+ * This file is part of eISCP Proxy, which is licensed under the
+ * GNU General Public License v3.0. You can find the full license text
+ * in the LICENSE file at the root of the source tree or at
+ * https://www.gnu.org/licenses/gpl-3.0.txt.
+ */
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "types.h"
+#include "eventloop.h"
+#include "rxring.h"
+
+#define WORKERS_MAX 64
+#define WORKER_QUEUE_SIZE 256 // Responses waiting for the writer, per worker (power of two)
+#define WORKER_DROP_LOG_MS 10000 // Shortest interval between two logged forwarding drops
+
+// Immutable view of the device table, in iteration order
+typedef struct DeviceSnapshot {
+    uint64_t epoch; // Global epoch at which it was replaced
+    DiscoveredDevice* retired; // Devices expired while it was current, freed with it
+    struct DeviceSnapshot* next; // Retired snapshots waiting to be freed
+    size_t count;
+    size_t categories[ISCP_CATEGORIES + 1]; // Where the devices of each unit type start, then the others
+    DiscoveredDevice* devices[];
+} DeviceSnapshot;
+
+// A discovery response received by a worker, handed over to the writer,
+// or a query it answered, for the writer to relay
+typedef struct {
+    PacketType type;
+    struct sockaddr_in source;
+    int ifindex;
+    EcnRecord ecn; // Decoded by the worker, only the unit of a query
+    size_t length;
+    char data[RX_SLOT_SIZE];
+} ForwardedResponse;
+
+typedef struct Worker {
+    pthread_t thread;
+    int index;
+    Environment env; // Copy of the main environment with the worker's own sockets
+    EventSource listener;
+    _Atomic uint64_t epoch; // Epoch the worker is reading the snapshot at, 0 when idle
+    _Atomic unsigned int queueHead; // Consumed by the writer
+    _Atomic unsigned int queueTail; // Produced by the worker
+    ForwardedResponse queue[WORKER_QUEUE_SIZE];
+    uint64_t dropLogged; // Monotonic time (ms) a forwarding drop was last logged
+} Worker;
+
+typedef struct Workers {
+    int count;
+    Worker* workers;
+    Environment* writer; // Main thread environment, the only one updating the table
+    EventSource notify; // eventfd raised when a worker queued a response
+    _Atomic(DeviceSnapshot*) snapshot;
+    _Atomic uint64_t epoch;
+    uint64_t generation; // Table generation of the current snapshot
+    DiscoveredDevice* expired; // Devices expired since the last publication
+    DeviceSnapshot* retired;
+} Workers;
+
+void workers_start(Environment *, int);
+void workers_publish(Environment *);
+void workers_release_device(Environment *, DiscoveredDevice *);
+DeviceSnapshot* worker_snapshot_enter(Worker *);
+void worker_snapshot_exit(Worker *);
+DiscoveredDevice** worker_snapshot_devices(DeviceSnapshot *, char, size_t *);
+int worker_owns_datagram(Worker *, const RxSlot *);
+void worker_forward_response(Worker *, const struct sockaddr_in *, int, const char *, ssize_t, const EcnRecord *);
+void worker_forward_query(Worker *, const struct sockaddr_in *, int, char);
+
+#endif